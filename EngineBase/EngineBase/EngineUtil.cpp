@@ -10,6 +10,22 @@
 // Local includes
 #include "EngineUtil.h"
 
+// Memory mapping
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+// SIMD
+#include <float.h>
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+#include <xmmintrin.h>
+#define USE_SSE
+#endif
+
 //-------------------------------------------------------------------------//
 // MISCELLANEOUS
 //-------------------------------------------------------------------------//
@@ -25,11 +41,91 @@ double TIME(void)
 	return (double)clock() / (double)CLOCKS_PER_SEC;
 }
 
+double WALL_TIME(void)
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 void SLEEP(int millis)
 {
 	this_thread::sleep_for(chrono::milliseconds(millis));
 }
 
+//-------------------------------------------------------------------------//
+// THREADS
+//-------------------------------------------------------------------------//
+
+static thread_local bool tOnWorker = false;
+
+ThreadPool::ThreadPool(int numThreads)
+{
+	numActive = 0;
+	stopping = false;
+	if (numThreads <= 0) numThreads = (int)thread::hardware_concurrency();
+	if (numThreads <= 0) numThreads = 2;
+	for (int i = 0; i < numThreads; i++) {
+		workers.push_back(thread(&ThreadPool::workerLoop, this));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> guard(jobLock);
+		stopping = true;
+	}
+	jobAdded.notify_all();
+	for (int i = 0; i < (int)workers.size(); i++) workers[i].join();
+}
+
+void ThreadPool::add(const function<void(void)> &job)
+{
+	{
+		lock_guard<mutex> guard(jobLock);
+		jobs.push_back(job);
+	}
+	jobAdded.notify_one();
+}
+
+void ThreadPool::wait(void)
+{
+	unique_lock<mutex> guard(jobLock);
+	jobsDone.wait(guard, [this] { return jobs.empty() && numActive == 0; });
+}
+
+bool ThreadPool::onWorker(void)
+{
+	return tOnWorker;
+}
+
+void ThreadPool::workerLoop(void)
+{
+	tOnWorker = true;
+	while (true) {
+		function<void(void)> job;
+		{
+			unique_lock<mutex> guard(jobLock);
+			jobAdded.wait(guard, [this] { return stopping || !jobs.empty(); });
+			if (stopping && jobs.empty()) return;
+			job = jobs.front();
+			jobs.pop_front();
+			numActive++;
+		}
+		job();
+		{
+			lock_guard<mutex> guard(jobLock);
+			numActive--;
+			if (jobs.empty() && numActive == 0) jobsDone.notify_all();
+		}
+	}
+}
+
+ThreadPool &getWorkerPool(void)
+{
+	static ThreadPool pool;
+	return pool;
+}
+
 //-------------------------------------------------------------------------//
 // OPENGL STUFF
 //-------------------------------------------------------------------------//
@@ -75,20 +171,23 @@ GLFWwindow* createOpenGLWindow(int width, int height, const char *title, int sam
 
 //-------------------------------------------------------------------------//
 
-GLuint loadShader(const string &fileName, GLuint shaderType)
+bool loadShaderSource(const string &fileName, string &shaderCode)
 {
 	// load the shader as a file
 	string mainCode;
 	if (!loadFileAsString(fileName, mainCode)) {
 		ERROR("Could not load file '" + fileName + "'", false);
-		return NULL_HANDLE;
+		return false;
 	}
 
-	string shaderCode;
+	shaderCode = "";
 	string alreadyIncluded = fileName;
 	replaceIncludes(mainCode, shaderCode, "#include", alreadyIncluded, true);
+	return true;
+}
 
-    
+GLuint compileShader(const string &shaderCode, GLuint shaderType, const string &fileName)
+{
 	// print the shader code
 	#ifdef _DEBUG
 	//cout << "\n----------------------------------------------- SHADER CODE:\n";
@@ -120,6 +219,13 @@ GLuint loadShader(const string &fileName, GLuint shaderType)
 	return shaderHandle;
 }
 
+GLuint loadShader(const string &fileName, GLuint shaderType)
+{
+	string shaderCode;
+	if (!loadShaderSource(fileName, shaderCode)) return NULL_HANDLE;
+	return compileShader(shaderCode, shaderType, fileName);
+}
+
 //-------------------------------------------------------------------------//
 
 GLuint createShaderProgram(GLuint vertexShader, GLuint fragmentShader)
@@ -132,6 +238,7 @@ GLuint createShaderProgram(GLuint vertexShader, GLuint fragmentShader)
 	}
 	glAttachShader(shaderProgram, vertexShader);    // attach vertex shader
 	glAttachShader(shaderProgram, fragmentShader);  // attach fragment shader
+	if (gUseShaderCache) glProgramParameteri(shaderProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(shaderProgram);
     
 	// check to see if the linking was successful
@@ -144,18 +251,329 @@ GLuint createShaderProgram(GLuint vertexShader, GLuint fragmentShader)
 		std::vector<char> msg(msgLength);
 		glGetShaderInfoLog(shaderProgram, msgLength, &msgLength, &msg[0]);
 		printf("%s\n", &msg[0]);
-		glDeleteProgram(shaderProgram);
+		deleteShaderProgram(shaderProgram);
 		return NULL_HANDLE;
 	}
 
+	setupShaderProgram(shaderProgram);
+	return shaderProgram;
+}
+
+void setupShaderProgram(GLuint shaderProgram)
+{
+	// find all the uniforms now, rather than on every draw
+	ShaderProgram *program = getShaderProgram(shaderProgram);
+
 	// HOOK UP UNIFORM BUFFER AND UNIFORM BLOCK TO SAME BINDING POINT
-	GLint lightBlockIndex = glGetUniformBlockIndex(shaderProgram, "Lights");
-	glUniformBlockBinding(shaderProgram, lightBlockIndex, LIGHT_BUFFER_ID);
-	glBindBufferBase(GL_UNIFORM_BUFFER, LIGHT_BUFFER_ID, gLightBufferObject);
+	GLuint lightBlockIndex = program->getUniformBlock("Lights");
+	if (lightBlockIndex != GL_INVALID_INDEX) {
+		glUniformBlockBinding(shaderProgram, lightBlockIndex, LIGHT_BUFFER_ID);
+	}
+	// the buffer itself is bound by initLightBuffer and Scene::updateLights; a
+	// program made mid-frame must not swap out a Lights block from the ring
+
+	// per-frame constants, for shaders that include FRAME_INCLUDE
+	GLuint cameraBlockIndex = program->getUniformBlock("Camera");
+	if (cameraBlockIndex != GL_INVALID_INDEX) glUniformBlockBinding(shaderProgram, cameraBlockIndex, CAMERA_BUFFER_ID);
+	GLuint objectBlockIndex = program->getUniformBlock("Object");
+	if (objectBlockIndex != GL_INVALID_INDEX) glUniformBlockBinding(shaderProgram, objectBlockIndex, OBJECT_BUFFER_ID);
+
+	// clustered lights, for shaders that include CLUSTER_INCLUDE
+	GLuint clusterBlockIndex = program->getUniformBlock("Clusters");
+	if (clusterBlockIndex != GL_INVALID_INDEX) {
+		glUniformBlockBinding(shaderProgram, clusterBlockIndex, CLUSTER_BUFFER_ID);
+		gClusterPrograms.insert(shaderProgram);
+		const char *samplers[3] = { "uClusterLights", "uClusterRanges", "uClusterIndices" };
+		for (int i = 0; i < 3; i++) {
+			GLint location = program->getUniform(samplers[i]);
+			if (location >= 0) glProgramUniform1i(shaderProgram, location, CLUSTER_TEXTURE_UNIT + i);
+		}
+	}
 
 	//printf("LIGHT STUFF %d %d %d\n", shaderProgram, lightBlockIndex, lightBufferObject);
-    
-	return shaderProgram;
+}
+
+//-------------------------------------------------------------------------//
+
+uint64_t hashString(const string &s, uint64_t hash)
+{
+	for (int i = 0; i < (int)s.length(); i++) {
+		hash ^= (unsigned char)s[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+class ProgramCacheEntry
+{
+public:
+	string vsCode, fsCode; // kept to rule out hash collisions
+	GLuint program;
+};
+
+map<uint64_t, ProgramCacheEntry> gProgramCache;
+ShaderCacheStats gShaderCacheStats;
+
+static GLuint buildShaderProgram(const string &vsCode, const string &fsCode,
+	const string &vsFileName, const string &fsFileName)
+{
+	GLuint vertexShader = compileShader(vsCode, GL_VERTEX_SHADER, vsFileName);
+	GLuint fragmentShader = compileShader(fsCode, GL_FRAGMENT_SHADER, fsFileName);
+	GLuint program = NULL_HANDLE;
+	if (vertexShader != NULL_HANDLE && fragmentShader != NULL_HANDLE) {
+		program = createShaderProgram(vertexShader, fragmentShader);
+	}
+	// the program keeps what it needs
+	if (vertexShader != NULL_HANDLE) glDeleteShader(vertexShader);
+	if (fragmentShader != NULL_HANDLE) glDeleteShader(fragmentShader);
+	return program;
+}
+
+GLuint loadShaderProgram(const string &vsFileName, const string &fsFileName)
+{
+	double start = WALL_TIME();
+	gShaderCacheStats.requests++;
+
+	string vsCode, fsCode;
+	if (!loadShaderSource(vsFileName, vsCode) || !loadShaderSource(fsFileName, fsCode)) {
+		gShaderCacheStats.seconds += WALL_TIME() - start;
+		return NULL_HANDLE;
+	}
+
+	// the key covers both stages, with a separator so the split matters
+	uint64_t key = hashString(fsCode, hashString(string(1, '\0'), hashString(vsCode)));
+	map<uint64_t, ProgramCacheEntry>::iterator it = gProgramCache.find(key);
+	if (it != gProgramCache.end() && it->second.vsCode == vsCode && it->second.fsCode == fsCode) {
+		gShaderCacheStats.shared++;
+		gShaderCacheStats.seconds += WALL_TIME() - start;
+		return it->second.program;
+	}
+
+	// try the driver's own binary from a previous run before compiling
+	GLuint program = NULL_HANDLE;
+	string cacheName;
+	uint64_t binaryKey = 0;
+	if (gUseShaderCache && shaderBinariesSupported()) {
+		binaryKey = programBinaryKey(key);
+		cacheName = programBinaryFileName(binaryKey);
+		program = loadProgramBinary(cacheName, binaryKey);
+		if (program != NULL_HANDLE) gShaderCacheStats.loadedBinary++;
+	}
+	if (program == NULL_HANDLE) {
+		program = buildShaderProgram(vsCode, fsCode, vsFileName, fsFileName);
+		gShaderCacheStats.compiled++;
+		if (program != NULL_HANDLE && !cacheName.empty()) saveProgramBinary(cacheName, binaryKey, program);
+	}
+
+	// failures aren't cached, and neither is the loser of a hash collision
+	if (program != NULL_HANDLE && it == gProgramCache.end()) {
+		ProgramCacheEntry &entry = gProgramCache[key];
+		entry.vsCode = vsCode;
+		entry.fsCode = fsCode;
+		entry.program = program;
+	}
+	gShaderCacheStats.seconds += WALL_TIME() - start;
+	return program;
+}
+
+//-------------------------------------------------------------------------//
+// Program binary cache.  One file per program in the working directory:
+//   ShaderCacheHeader
+//   binary block, length bytes in the driver's own format
+// Binaries are only valid for the driver that produced them, so the key mixes
+// in GL_VENDOR, GL_RENDERER and GL_VERSION on top of the source hash.
+//-------------------------------------------------------------------------//
+
+bool gUseShaderCache = false;
+
+struct ShaderCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t key;
+	uint32_t format;
+	uint32_t length;
+};
+
+static const char SHADER_CACHE_MAGIC[4] = { 'E', 'B', 'S', 'P' };
+
+bool shaderBinariesSupported(void)
+{
+	GLint numFormats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+	return numFormats > 0;
+}
+
+uint64_t programBinaryKey(uint64_t sourceKey)
+{
+	string driver;
+	const char *strings[3] = { (const char*)glGetString(GL_VENDOR),
+		(const char*)glGetString(GL_RENDERER), (const char*)glGetString(GL_VERSION) };
+	for (int i = 0; i < 3; i++) {
+		if (strings[i] != NULL) driver += strings[i];
+		driver += '\n';
+	}
+	return hashString(driver, sourceKey);
+}
+
+string programBinaryFileName(uint64_t binaryKey)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "shader_%016llx", (unsigned long long)binaryKey);
+	return string(name) + SHADER_CACHE_EXTENSION;
+}
+
+GLuint loadProgramBinary(const string &cacheName, uint64_t binaryKey)
+{
+	MappedFile file;
+	if (!file.open(cacheName)) return NULL_HANDLE; // not cached yet
+
+	ShaderCacheHeader header;
+	if (file.size < sizeof(header)) return NULL_HANDLE;
+	memcpy(&header, file.data, sizeof(header));
+	if (memcmp(header.magic, SHADER_CACHE_MAGIC, 4) != 0 || header.version != SHADER_CACHE_VERSION ||
+		header.key != binaryKey || file.size != sizeof(header) + (size_t)header.length) {
+		return NULL_HANDLE;
+	}
+
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, header.format, file.data + sizeof(header), header.length);
+	int linked;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked) {
+		// usually a driver update; drop it so it gets rewritten
+		deleteShaderProgram(program);
+		file.close();
+		remove(cacheName.c_str());
+		gShaderCacheStats.rejectedBinary++;
+		return NULL_HANDLE;
+	}
+
+	// block bindings are not part of the binary
+	setupShaderProgram(program);
+	return program;
+}
+
+bool saveProgramBinary(const string &cacheName, uint64_t binaryKey, GLuint program)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) return false;
+
+	vector<char> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(program, length, &length, &format, &binary[0]);
+
+	ShaderCacheHeader header;
+	memcpy(header.magic, SHADER_CACHE_MAGIC, 4);
+	header.version = SHADER_CACHE_VERSION;
+	header.key = binaryKey;
+	header.format = format;
+	header.length = (uint32_t)length;
+
+	FILE *f = fopen(cacheName.c_str(), "wb");
+	if (f == NULL) {
+		ERROR("Could not write shader cache '" + cacheName + "'", false);
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	if (ok) ok = fwrite(&binary[0], length, 1, f) == 1;
+	fclose(f);
+
+	if (!ok) {
+		remove(cacheName.c_str());
+		ERROR("Could not write shader cache '" + cacheName + "'", false);
+	}
+	return ok;
+}
+
+//-------------------------------------------------------------------------//
+
+map<GLuint, ShaderProgram*> gShaderPrograms;
+
+ShaderProgram *getShaderProgram(GLuint handle)
+{
+	if (handle == NULL_HANDLE) return NULL;
+	map<GLuint, ShaderProgram*>::iterator it = gShaderPrograms.find(handle);
+	if (it != gShaderPrograms.end()) return it->second;
+
+	// not made by createShaderProgram, reflect it now
+	ShaderProgram *program = new ShaderProgram(handle);
+	gShaderPrograms[handle] = program;
+	return program;
+}
+
+void deleteShaderProgram(GLuint handle)
+{
+	if (handle == NULL_HANDLE) return;
+	map<GLuint, ShaderProgram*>::iterator it = gShaderPrograms.find(handle);
+	if (it != gShaderPrograms.end()) {
+		delete it->second;
+		gShaderPrograms.erase(it);
+	}
+	for (map<uint64_t, ProgramCacheEntry>::iterator entry = gProgramCache.begin(); entry != gProgramCache.end(); ) {
+		if (entry->second.program == handle) gProgramCache.erase(entry++);
+		else ++entry;
+	}
+	gClusterPrograms.erase(handle);
+	glDeleteProgram(handle);
+}
+
+void ShaderProgram::reflect(void)
+{
+	uniforms.clear();
+	uniformBlocks.clear();
+
+	GLint numUniforms = 0, maxLength = 0;
+	glGetProgramiv(handle, GL_ACTIVE_UNIFORMS, &numUniforms);
+	glGetProgramiv(handle, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+	vector<char> buffer(maxLength + 1);
+	for (int i = 0; i < numUniforms; i++) {
+		GLsizei length = 0;
+		GLint size = 0;
+		GLenum type;
+		glGetActiveUniform(handle, i, (GLsizei)buffer.size(), &length, &size, &type, &buffer[0]);
+		string name(&buffer[0], length);
+		GLint loc = glGetUniformLocation(handle, name.c_str());
+		if (loc < 0) continue; // uniform block members have no location
+		uniforms[name] = loc;
+
+		// arrays are reported as "name[0]", make "name" work too
+		int bracket = (int)name.find('[');
+		if (bracket > 0) uniforms[name.substr(0, bracket)] = loc;
+	}
+
+	GLint numBlocks = 0;
+	maxLength = 0;
+	glGetProgramiv(handle, GL_ACTIVE_UNIFORM_BLOCKS, &numBlocks);
+	glGetProgramiv(handle, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxLength);
+	buffer.resize(maxLength + 1);
+	for (int i = 0; i < numBlocks; i++) {
+		GLsizei length = 0;
+		glGetActiveUniformBlockName(handle, i, (GLsizei)buffer.size(), &length, &buffer[0]);
+		uniformBlocks[string(&buffer[0], length)] = (GLuint)i;
+	}
+
+	uObjectWorldM = getUniform("uObjectWorldM");
+	uObjectWorldInverseM = getUniform("uObjectWorldInverseM");
+	uObjectPerpsectM = getUniform("uObjectPerpsectM");
+	uView = getUniform("uView");
+	uViewPerspectM = getUniform("uViewPerspectM");
+	uObjectIndex = getUniform("uObjectIndex");
+	aInstanceWorldM = glGetAttribLocation(handle, "aInstanceWorldM");
+	aInstanceWorldInverseM = glGetAttribLocation(handle, "aInstanceWorldInverseM");
+}
+
+GLint ShaderProgram::getUniform(const string &name) const
+{
+	map<string, GLint>::const_iterator it = uniforms.find(name);
+	return (it != uniforms.end()) ? it->second : -1;
+}
+
+GLuint ShaderProgram::getUniformBlock(const string &name) const
+{
+	map<string, GLuint>::const_iterator it = uniformBlocks.find(name);
+	return (it != uniformBlocks.end()) ? it->second : GL_INVALID_INDEX;
 }
 
 //-------------------------------------------------------------------------//
@@ -229,6 +647,73 @@ FILE *openFileForReading(const string &fileName)
 	return NULL;
 }
 
+bool getFileModTime(const string &fullName, time_t &modTime)
+{
+	struct stat st;
+	if (stat(fullName.c_str(), &st) != 0) return false;
+	modTime = st.st_mtime;
+	return true;
+}
+
+//-------------------------------------------------------------------------//
+
+bool MappedFile::open(const string &fullName)
+{
+	close();
+#ifndef _WIN32
+	int fd = ::open(fullName.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		::close(fd);
+		return false;
+	}
+	void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd); // the mapping keeps its own reference to the file
+	if (p == MAP_FAILED) return false;
+	data = (const unsigned char*)p;
+	size = (size_t)st.st_size;
+	isMapped = true;
+	return true;
+#else
+	// no mmap, read the whole file instead
+	FILE *f = fopen(fullName.c_str(), "rb");
+	if (f == NULL) return false;
+	fseek(f, 0, SEEK_END);
+	long length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (length <= 0) {
+		fclose(f);
+		return false;
+	}
+	unsigned char *buffer = (unsigned char*)malloc(length);
+	size_t numRead = fread(buffer, 1, length, f);
+	fclose(f);
+	if (numRead != (size_t)length) {
+		free(buffer);
+		return false;
+	}
+	data = buffer;
+	size = (size_t)length;
+	isMapped = false;
+	return true;
+#endif
+}
+
+void MappedFile::close(void)
+{
+	if (data == NULL) return;
+#ifndef _WIN32
+	if (isMapped) munmap((void*)data, size);
+	else free((void*)data);
+#else
+	free((void*)data);
+#endif
+	data = NULL;
+	size = 0;
+	isMapped = false;
+}
+
 //-------------------------------------------------------------------------//
 
 bool getToken(FILE *f, string &token, const string &oneCharTokens)
@@ -313,6 +798,172 @@ int getInts(FILE *f, int *a, int num)
 	}
 	return count;
 }
+//-------------------------------------------------------------------------//
+// Tokenizer
+//-------------------------------------------------------------------------//
+
+#define CHAR_SPACE 1
+#define CHAR_ONE_TOKEN 2
+#define CHAR_QUOTE 4
+#define CHAR_BREAK (CHAR_SPACE | CHAR_ONE_TOKEN | CHAR_QUOTE)
+
+static const string LIST_TOKENS = "[],";
+
+bool Tokenizer::open(const string &fileName)
+{
+	string fullName;
+	if (!getFullFileName(fileName, fullName) || !file.open(fullName)) {
+		ERROR("Could not open file " + fileName, false);
+		cur = end = NULL;
+		return false;
+	}
+	cout << "Opening file '" << fileName << "'" << endl;
+	setBuffer((const char*)file.data, file.size);
+	return true;
+}
+
+const unsigned char *Tokenizer::getCharClasses(const string &oneCharTokens)
+{
+	for (int i = 0; i < numTables; i++) {
+		if (tables[i].oneCharTokens == oneCharTokens) return tables[i].classes;
+	}
+
+	// build a new table, replacing the oldest one if they are all used.
+	// Spaces win over one char tokens, which win over quotes (as in getToken).
+	CharClasses &t = tables[nextTable];
+	nextTable = (nextTable + 1) % TOKENIZER_TABLES;
+	if (numTables < TOKENIZER_TABLES) numTables++;
+
+	t.oneCharTokens = oneCharTokens;
+	memset(t.classes, 0, sizeof(t.classes));
+	t.classes[(unsigned char)'\''] = CHAR_QUOTE;
+	t.classes[(unsigned char)'\"'] = CHAR_QUOTE;
+	for (int i = 0; i < (int)oneCharTokens.length(); i++) {
+		t.classes[(unsigned char)oneCharTokens[i]] = CHAR_ONE_TOKEN;
+	}
+	const char spaces[] = " \t\n\v\f\r";
+	for (int i = 0; spaces[i] != 0; i++) {
+		t.classes[(unsigned char)spaces[i]] = CHAR_SPACE;
+	}
+	return t.classes;
+}
+
+bool Tokenizer::next(string_view &token, const string &oneCharTokens)
+{
+	const unsigned char *classes = getCharClasses(oneCharTokens);
+
+	// spaces before token, ignore
+	while (cur < end && (classes[(unsigned char)*cur] & CHAR_SPACE)) cur++;
+	if (cur >= end) {
+		token = string_view();
+		return false;
+	}
+
+	const char *start = cur;
+	unsigned char c = classes[(unsigned char)*cur];
+	if (c & CHAR_ONE_TOKEN) { // oneCharToken, done
+		token = string_view(cur, 1);
+		cur++;
+		return true;
+	}
+	if (c & CHAR_QUOTE) { // quoted string, take everything til end quote
+		char endQuote = *cur++;
+		start = cur;
+		while (cur < end && *cur != endQuote) cur++;
+		token = string_view(start, cur - start);
+		if (cur < end) {
+			cur++; // skip end quote
+			return true;
+		}
+		return (token.length() > 0);
+	}
+
+	// plain token ends at a space (consumed), a oneCharToken or quote (not consumed)
+	while (cur < end && !(classes[(unsigned char)*cur] & CHAR_BREAK)) cur++;
+	token = string_view(start, cur - start);
+	if (cur < end && (classes[(unsigned char)*cur] & CHAR_SPACE)) cur++;
+	return true;
+}
+
+void Tokenizer::skipSpace(void)
+{
+	while (cur < end && (*cur == ' ' || (*cur >= '\t' && *cur <= '\r'))) cur++;
+}
+
+bool Tokenizer::getFloat(float &val)
+{
+	skipSpace();
+	from_chars_result r = from_chars(cur, end, val);
+	if (r.ec != errc()) return false;
+	cur = r.ptr;
+	return true;
+}
+
+bool Tokenizer::getInt(int &val)
+{
+	skipSpace();
+	from_chars_result r = from_chars(cur, end, val);
+	if (r.ec != errc()) return false;
+	cur = r.ptr;
+	return true;
+}
+
+//-------------------------------------------------------------------------//
+
+bool getToken(Tokenizer &t, string &token, const string &oneCharTokens)
+{
+	string_view view;
+	bool found = t.next(view, oneCharTokens);
+	token.assign(view.data(), view.length());
+	return found;
+}
+
+int getFloats(Tokenizer &t, float *a, int num)
+{
+	string_view token;
+	int count = 0;
+	while (t.next(token, LIST_TOKENS)) {
+		if (token == "]") {
+			break;
+		}
+		else if (token.empty()) { // an empty quoted string
+			ERROR("empty entry in a number list", false);
+		}
+		else if (isdigit((unsigned char)token[0]) || token[0] == '-') {
+			if (from_chars(token.data(), token.data() + token.length(), a[count]).ec != errc()) {
+				ERROR("bad number '" + string(token) + "' in a list", false);
+				continue;
+			}
+			count++;
+			if (count == num) break;
+		}
+	}
+	return count;
+}
+
+int getInts(Tokenizer &t, int *a, int num)
+{
+	string_view token;
+	int count = 0;
+	while (t.next(token, LIST_TOKENS)) {
+		if (token == "]") {
+			break;
+		}
+		else if (token.empty()) { // an empty quoted string
+			ERROR("empty entry in a number list", false);
+		}
+		else if (isdigit((unsigned char)token[0]) || token[0] == '-') {
+			if (from_chars(token.data(), token.data() + token.length(), a[count]).ec != errc()) {
+				ERROR("bad number '" + string(token) + "' in a list", false);
+				continue;
+			}
+			count++;
+			if (count == num) break;
+		}
+	}
+	return count;
+}
+
 //-------------------------------------------------------------------------//
 
 bool loadFileAsString(const string &fileName, string &fileContents)
@@ -349,10 +1000,14 @@ void replaceIncludes(string &src, string &dest, const string &directive,
 			dest += src.substr(start);
 			break;
 		}
-		if (includeIndex > 0 && !isspace(src[includeIndex - 1])) continue;
-		dest += src.substr(start, includeIndex - 1);
+		if (includeIndex > 0 && !isspace(src[includeIndex - 1])) {
+			dest += src.substr(start, includeIndex + 8 - start);
+			start = includeIndex + 8;
+			continue;
+		}
+		dest += src.substr(start, includeIndex - start);
 		//
-		int quoteStart = (int)src.find("\"", start + 8);
+		int quoteStart = (int)src.find("\"", includeIndex + 8);
 		int quoteEnd = (int)src.find("\"", quoteStart + 1);
 		start = quoteEnd + 1;
 		if (quoteStart >= quoteEnd) {
@@ -366,7 +1021,9 @@ void replaceIncludes(string &src, string &dest, const string &directive,
 				alreadyIncluded.append(includeFileName);
 			}
 			string subSource;
-			loadFileAsString(includeFileName, subSource);
+			const char *builtin = getBuiltinInclude(includeFileName);
+			if (builtin != NULL) subSource = builtin;
+			else loadFileAsString(includeFileName, subSource);
 			replaceIncludes(subSource, dest, directive, alreadyIncluded, onlyOnce);
 		}
 	}
@@ -434,7 +1091,8 @@ void RGBAImage::sendToOpenGL(GLuint magFilter, GLuint minFilter, bool createMipM
 	if (createMipMap) glGenerateMipmap(GL_TEXTURE_2D);
 
 	glGenSamplers(1, &samplerId);
-	glBindSampler(textureId, samplerId);
+	glSamplerParameteri(samplerId, GL_TEXTURE_MAG_FILTER, magFilter);
+	glSamplerParameteri(samplerId, GL_TEXTURE_MIN_FILTER, minFilter);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, magFilter);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minFilter);
 }
@@ -443,60 +1101,493 @@ void RGBAImage::sendToOpenGL(GLuint magFilter, GLuint minFilter, bool createMipM
 // TRIANGLE MESH
 //-------------------------------------------------------------------------//
 
-bool TriMesh::readFromPly(const string &fileName, bool flipZ)
+// PLY header: elements in file order, each with typed properties.  A list
+// property has a count type as well as an item type.
+enum PlyFormat { PLY_ASCII, PLY_BINARY_LITTLE_ENDIAN, PLY_BINARY_BIG_ENDIAN };
+enum PlyType { PLY_NONE, PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64 };
+
+struct PlyProperty {
+	string name;
+	PlyType type;
+	PlyType countType; // PLY_NONE unless this is a list
+};
+
+struct PlyElement {
+	string name;
+	int count;
+	vector<PlyProperty> properties;
+};
+
+static PlyType plyType(string_view name)
 {
-	name = fileName;
-	FILE *f = openFileForReading(fileName);
-	if (f == NULL) return false;
-	string token, t;
-	int numVertices = 0;
-	int numFaces = 0;
+	if (name == "char" || name == "int8") return PLY_INT8;
+	if (name == "uchar" || name == "uint8") return PLY_UINT8;
+	if (name == "short" || name == "int16") return PLY_INT16;
+	if (name == "ushort" || name == "uint16") return PLY_UINT16;
+	if (name == "int" || name == "int32") return PLY_INT32;
+	if (name == "uint" || name == "uint32") return PLY_UINT32;
+	if (name == "float" || name == "float32") return PLY_FLOAT32;
+	if (name == "double" || name == "float64") return PLY_FLOAT64;
+	return PLY_NONE;
+}
+
+static int plySize(PlyType type)
+{
+	static const int sizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+	return sizes[type];
+}
+
+static bool hostIsLittleEndian(void)
+{
+	uint16_t one = 1;
+	return *(const unsigned char*)&one == 1;
+}
+
+// one binary value, converted to double (exact for every PLY type but 64 bit ints, which PLY lacks)
+static double readPlyValue(const char *p, PlyType type, bool swap)
+{
+	unsigned char b[8];
+	int size = plySize(type);
+	memcpy(b, p, size);
+	if (swap) reverse(b, b + size);
+	switch (type) {
+	case PLY_INT8: return (double)*(const int8_t*)b;
+	case PLY_UINT8: return (double)*(const uint8_t*)b;
+	case PLY_INT16: { int16_t v; memcpy(&v, b, 2); return v; }
+	case PLY_UINT16: { uint16_t v; memcpy(&v, b, 2); return v; }
+	case PLY_INT32: { int32_t v; memcpy(&v, b, 4); return v; }
+	case PLY_UINT32: { uint32_t v; memcpy(&v, b, 4); return v; }
+	case PLY_FLOAT32: { float v; memcpy(&v, b, 4); return v; }
+	case PLY_FLOAT64: { double v; memcpy(&v, b, 8); return v; }
+	default: return 0.0;
+	}
+}
+
+// The header is line based (comments may contain any word), so each line
+// gets its own tokenizer.  Leaves f at the first byte after end_header.
+static bool readPlyHeader(Tokenizer &f, PlyFormat &format, vector<PlyElement> &elements)
+{
+	format = PLY_ASCII;
+	elements.clear();
+	bool first = true;
+	while (!f.atEnd()) {
+		const char *start = f.position();
+		const char *newline = (const char*)memchr(start, '\n', f.bufferEnd() - start);
+		const char *lineEnd = (newline != NULL) ? newline : f.bufferEnd();
+		f.setPosition((newline != NULL) ? newline + 1 : lineEnd);
+
+		Tokenizer line;
+		line.setBuffer(start, lineEnd - start);
+		string_view token;
+		if (!line.next(token, "")) continue;
+		if (first) {
+			if (token != "ply") return false;
+			first = false;
+		}
+		else if (token == "format") {
+			line.next(token, "");
+			if (token == "ascii") format = PLY_ASCII;
+			else if (token == "binary_little_endian") format = PLY_BINARY_LITTLE_ENDIAN;
+			else if (token == "binary_big_endian") format = PLY_BINARY_BIG_ENDIAN;
+			else return false;
+		}
+		else if (token == "element") {
+			PlyElement e;
+			line.next(token, "");
+			e.name.assign(token.data(), token.length());
+			if (!line.getInt(e.count) || e.count < 0) return false;
+			elements.push_back(e);
+		}
+		else if (token == "property") {
+			if (elements.empty()) return false;
+			PlyProperty p;
+			p.countType = PLY_NONE;
+			line.next(token, "");
+			if (token == "list") {
+				line.next(token, "");
+				p.countType = plyType(token);
+				if (p.countType == PLY_NONE || p.countType >= PLY_FLOAT32) return false;
+				line.next(token, "");
+			}
+			p.type = plyType(token);
+			if (p.type == PLY_NONE || !line.next(token, "")) return false;
+			p.name.assign(token.data(), token.length());
+			elements.back().properties.push_back(p);
+		}
+		else if (token == "end_header") {
+			return true;
+		}
+		// comment and obj_info lines are skipped
+	}
+	return false;
+}
+
+int gPlyThreads = 0;
+
+// Only used off the pool (see readFromPly), so the chunks get threads of
+// their own rather than waiting on the shared pool.
+static void runPlyChunks(int numChunks, const function<void(int)> &job)
+{
+	vector<thread> threads;
+	for (int i = 1; i < numChunks; i++) threads.push_back(thread(job, i));
+	job(0);
+	for (int i = 0; i < (int)threads.size(); i++) threads[i].join();
+}
+
+static const char *skipPlySpace(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f')) p++;
+	return p;
+}
+
+template<class T> static bool parsePlyValue(const char *&p, const char *end, T &val)
+{
+	p = skipPlySpace(p, end);
+	from_chars_result r = from_chars(p, end, val);
+	if (r.ec != errc()) return false;
+	p = r.ptr;
+	return true;
+}
+
+// ASCII body split at line boundaries, one chunk per thread.  Needs one
+// element row per line, which every exporter writes; anything else returns
+// false (with the arrays cleared) and is left to the serial parser.  Values
+// go through from_chars like Tokenizer::getFloat/getInt, so the result is
+// the same either way.
+static bool readPlyAsciiParallel(const char *body, const char *end, const vector<PlyElement> &elements,
+	int vertexElement, int faceElement, int numThreads, int stride, vector<float> &vertexData, vector<int> &indices)
+{
+	vector<const char*> chunkStart(numThreads + 1);
+	chunkStart[0] = body;
+	chunkStart[numThreads] = end;
+	for (int i = 1; i < numThreads; i++) {
+		const char *p = max(chunkStart[i - 1], body + (end - body) * i / numThreads);
+		const char *newline = (const char*)memchr(p, '\n', end - p);
+		chunkStart[i] = (newline != NULL) ? newline + 1 : end;
+	}
+
+	// rows per chunk, then the first row of each chunk by prefix sum
+	vector<size_t> chunkRows(numThreads + 1, 0);
+	runPlyChunks(numThreads, [&](int c) {
+		size_t rows = 0;
+		for (const char *p = chunkStart[c]; p < chunkStart[c + 1];) {
+			const char *newline = (const char*)memchr(p, '\n', chunkStart[c + 1] - p);
+			const char *lineEnd = (newline != NULL) ? newline : chunkStart[c + 1];
+			if (skipPlySpace(p, lineEnd) < lineEnd) rows++;
+			p = lineEnd + 1;
+		}
+		chunkRows[c + 1] = rows;
+	});
+	for (int c = 0; c < numThreads; c++) chunkRows[c + 1] += chunkRows[c];
+	vector<size_t> elementRow(elements.size() + 1, 0);
+	for (int e = 0; e < (int)elements.size(); e++) elementRow[e + 1] = elementRow[e] + elements[e].count;
+	if (chunkRows[numThreads] != elementRow[elements.size()]) return false;
+
+	// vertices land at their final place, triangles go to a list per chunk
+	vector< vector<int> > chunkIndices(numThreads);
+	vector<char> failed(numThreads, 0);
+	vertexData.resize((vertexElement >= 0) ? (size_t)elements[vertexElement].count * stride : 0);
+	runPlyChunks(numThreads, [&](int c) {
+		vector<int> face;
+		size_t row = chunkRows[c];
+		int e = 0;
+		for (const char *p = chunkStart[c]; p < chunkStart[c + 1] && !failed[c];) {
+			const char *newline = (const char*)memchr(p, '\n', chunkStart[c + 1] - p);
+			const char *lineEnd = (newline != NULL) ? newline : chunkStart[c + 1];
+			const char *q = skipPlySpace(p, lineEnd);
+			p = lineEnd + 1;
+			if (q == lineEnd) continue;
+			while (row >= elementRow[e + 1]) e++;
+			const vector<PlyProperty> &props = elements[e].properties;
+			float *out = (e == vertexElement) ? &vertexData[(row - elementRow[e]) * stride] : NULL;
+			bool ok = true;
+			face.clear();
+			for (int i = 0; i < (int)props.size() && ok; i++) {
+				float val = 0.0f;
+				if (props[i].countType == PLY_NONE) {
+					ok = parsePlyValue(q, lineEnd, val);
+					if (out != NULL) *out++ = val;
+					continue;
+				}
+				int n = 0;
+				ok = parsePlyValue(q, lineEnd, n);
+				bool isIndices = (e == faceElement && (props[i].name == "vertex_indices" || props[i].name == "vertex_index"));
+				for (int j = 0; j < n && ok; j++) {
+					int idx = 0;
+					if (isIndices || e == faceElement) ok = parsePlyValue(q, lineEnd, idx);
+					else ok = parsePlyValue(q, lineEnd, val);
+					if (isIndices) face.push_back(idx);
+				}
+			}
+			if (!ok || skipPlySpace(q, lineEnd) != lineEnd) {
+				failed[c] = 1;
+				break;
+			}
+			for (int j = 2; j < (int)face.size(); j++) { // make triangle fan
+				chunkIndices[c].push_back(face[0]);
+				chunkIndices[c].push_back(face[j-1]);
+				chunkIndices[c].push_back(face[j]);
+			}
+			row++;
+		}
+	});
+	for (int c = 0; c < numThreads; c++) {
+		if (failed[c]) {
+			vertexData.clear();
+			return false;
+		}
+	}
+
+	// stitch the triangle lists together
+	vector<size_t> chunkOffset(numThreads + 1, 0);
+	for (int c = 0; c < numThreads; c++) chunkOffset[c + 1] = chunkOffset[c] + chunkIndices[c].size();
+	indices.resize(chunkOffset[numThreads]);
+	runPlyChunks(numThreads, [&](int c) {
+		if (!chunkIndices[c].empty()) {
+			memcpy(&indices[chunkOffset[c]], &chunkIndices[c][0], chunkIndices[c].size() * sizeof(int));
+		}
+	});
+	return true;
+}
+
+bool TriMesh::readFromPly(const string &fileName, bool flipZ)
+{
+	name = fileName;
+	Tokenizer f;
+	if (!f.open(fileName)) return false;
+	PlyFormat format;
+	vector<PlyElement> elements;
+	if (!readPlyHeader(f, format, elements)) {
+		ERROR("Bad ply header in " + fileName, false);
+		return false;
+	}
+	bool binary = (format != PLY_ASCII);
+	bool swap = binary && ((format == PLY_BINARY_LITTLE_ENDIAN) != hostIsLittleEndian());
+	const char *p = f.position();
+	const char *end = f.bufferEnd();
+	int numVertices = 0;
 	int numTriangles = 0;
 	vector<int> faceIndices;
-    
-	// get num vertices
-	while (getToken(f, token, "")) {
-		//cout << token << endl;
-		if (token == "vertex") break;
+	vector<PlyType> vertexTypes;
+	bool truncated = false;
+
+	// scalar vertex properties become the interleaved attributes, lists are skipped
+	int vertexElement = -1, faceElement = -1;
+	for (int e = 0; e < (int)elements.size(); e++) {
+		if (elements[e].name == "vertex" && vertexElement < 0) vertexElement = e;
+		else if (elements[e].name == "face" && faceElement < 0) faceElement = e;
 	}
-	getToken(f, token, "");
-	numVertices = atoi(token.c_str());
-    
-	// get vertex attributes
-	while (getToken(f, token, "")) {
-		if (token == "property") {
-			getToken(f, t, ""); // token should be "float"
-			getToken(f, t, ""); // attribute name
-			attributes.push_back(t);
-		}
-		else if (token == "face") {
-			getToken(f, t, "");
-			numFaces = atoi(t.c_str());
-			break;
+	if (vertexElement >= 0) {
+		const vector<PlyProperty> &props = elements[vertexElement].properties;
+		for (int i = 0; i < (int)props.size(); i++) {
+			if (props[i].countType != PLY_NONE) continue;
+			attributes.push_back(props[i].name);
+			vertexTypes.push_back(props[i].type);
 		}
+		numVertices = elements[vertexElement].count;
 	}
-    
-	// read to end of header
-	while (getToken(f, token, "")) {
-		if (token == "end_header") break;
+
+	// on a worker, other meshes are already parsing on the other threads
+	int numThreads = (gPlyThreads > 0) ? gPlyThreads : (int)thread::hardware_concurrency();
+	if (ThreadPool::onWorker()) numThreads = 1;
+	bool parallel = !binary && numThreads > 1 && end - p >= PLY_PARALLEL_MIN_BYTES &&
+		readPlyAsciiParallel(p, end, elements, vertexElement, faceElement, numThreads,
+			(int)attributes.size(), vertexData, indices);
+
+	for (int e = 0; e < (int)elements.size() && !truncated && !parallel; e++) {
+		const PlyElement &element = elements[e];
+		const vector<PlyProperty> &props = element.properties;
+
+		if (e == vertexElement) {
+			int rowSize = 0;
+			bool fixed = true, allFloat = true;
+			for (int i = 0; i < (int)props.size(); i++) {
+				if (props[i].countType != PLY_NONE) {
+					fixed = false;
+					continue;
+				}
+				rowSize += plySize(props[i].type);
+				allFloat = allFloat && props[i].type == PLY_FLOAT32;
+			}
+			size_t stride = attributes.size();
+			vertexData.resize((size_t)numVertices * stride);
+			if (binary && fixed && (size_t)(end - p) < (size_t)numVertices * rowSize) {
+				truncated = true;
+			}
+			else if (binary && fixed && allFloat && !swap) {
+				// same layout as the interleaved buffer, copy it straight in
+				if (!vertexData.empty()) memcpy(&vertexData[0], p, vertexData.size() * sizeof(float));
+				p += vertexData.size() * sizeof(float);
+			}
+			else if (binary && fixed && !swap) {
+				// floats and uchars (Blender's colors) converted in place, the rest one value at a time
+				float *row = vertexData.empty() ? NULL : &vertexData[0];
+				for (int v = 0; v < numVertices; v++, row += stride) {
+					for (int a = 0; a < (int)stride; a++) {
+						if (vertexTypes[a] == PLY_FLOAT32) memcpy(&row[a], p, 4);
+						else if (vertexTypes[a] == PLY_UINT8) row[a] = (float)*(const unsigned char*)p;
+						else row[a] = (float)readPlyValue(p, vertexTypes[a], false);
+						p += plySize(vertexTypes[a]);
+					}
+				}
+			}
+			else {
+				for (int v = 0; v < numVertices && !truncated; v++) {
+					float *row = vertexData.empty() ? NULL : &vertexData[(size_t)v * stride];
+					int a = 0;
+					for (int i = 0; i < (int)props.size() && !truncated; i++) {
+						const PlyProperty &prop = props[i];
+						if (!binary) {
+							float val = 0.0f;
+							if (prop.countType == PLY_NONE) {
+								truncated = !f.getFloat(val);
+								row[a++] = val;
+							}
+							else {
+								int n = 0;
+								truncated = !f.getInt(n);
+								for (int j = 0; j < n && !truncated; j++) truncated = !f.getFloat(val);
+							}
+						}
+						else if (prop.countType == PLY_NONE) {
+							if (end - p < plySize(prop.type)) { truncated = true; break; }
+							row[a++] = (float)readPlyValue(p, prop.type, swap);
+							p += plySize(prop.type);
+						}
+						else {
+							if (end - p < plySize(prop.countType)) { truncated = true; break; }
+							int n = (int)readPlyValue(p, prop.countType, swap);
+							p += plySize(prop.countType);
+							if (n < 0 || (size_t)(end - p) < (size_t)n * plySize(prop.type)) { truncated = true; break; }
+							p += (size_t)n * plySize(prop.type);
+						}
+					}
+				}
+			}
+		}
+		else if (e == faceElement) {
+			int list = -1;
+			for (int i = 0; i < (int)props.size(); i++) {
+				if (props[i].countType != PLY_NONE && (props[i].name == "vertex_indices" || props[i].name == "vertex_index")) list = i;
+			}
+			indices.reserve((size_t)element.count * 3);
+			bool simple = binary && !swap && props.size() == 1 && list == 0 && props[0].countType == PLY_UINT8 &&
+				(props[0].type == PLY_INT32 || props[0].type == PLY_UINT32);
+			for (int face = 0; simple && face < element.count; face++) {
+				// list uchar int, the only property: read without going through doubles
+				int n = (end > p) ? *(const unsigned char*)p : 0;
+				if (end - p < 1 + 4 * n) { truncated = true; break; }
+				if (n == 3) {
+					size_t at = indices.size();
+					indices.resize(at + 3);
+					memcpy(&indices[at], p + 1, 12);
+					p += 13;
+					numTriangles++;
+					continue;
+				}
+				faceIndices.resize(n);
+				if (n > 0) memcpy(&faceIndices[0], p + 1, 4 * (size_t)n);
+				p += 1 + 4 * (size_t)n;
+				for (int j = 2; j < n; j++) { // make triangle fan
+					indices.push_back(faceIndices[0]);
+					indices.push_back(faceIndices[j-1]);
+					indices.push_back(faceIndices[j]);
+					numTriangles++;
+				}
+			}
+			for (int face = 0; !simple && face < element.count && !truncated; face++) {
+				faceIndices.clear();
+				for (int i = 0; i < (int)props.size() && !truncated; i++) {
+					const PlyProperty &prop = props[i];
+					if (!binary) {
+						if (prop.countType == PLY_NONE) {
+							float val;
+							truncated = !f.getFloat(val);
+							continue;
+						}
+						int n = 0;
+						truncated = !f.getInt(n);
+						for (int j = 0; j < n && !truncated; j++) {
+							int idx = 0;
+							truncated = !f.getInt(idx);
+							if (i == list) faceIndices.push_back(idx);
+						}
+						continue;
+					}
+					if (prop.countType == PLY_NONE) {
+						if (end - p < plySize(prop.type)) truncated = true;
+						else p += plySize(prop.type);
+						continue;
+					}
+					if (end - p < plySize(prop.countType)) { truncated = true; break; }
+					int n = (int)readPlyValue(p, prop.countType, swap);
+					p += plySize(prop.countType);
+					int size = plySize(prop.type);
+					if (n < 0 || (size_t)(end - p) < (size_t)n * size) { truncated = true; break; }
+					if (i == list) {
+						faceIndices.resize(n);
+						if (size == 4 && prop.type != PLY_FLOAT32 && !swap) {
+							if (n > 0) memcpy(&faceIndices[0], p, (size_t)n * 4);
+						}
+						else {
+							for (int j = 0; j < n; j++) faceIndices[j] = (int)readPlyValue(p + (size_t)j * size, prop.type, swap);
+						}
+					}
+					p += (size_t)n * size;
+				}
+				for (int j = 2; j < (int)faceIndices.size(); j++) { // make triangle fan
+					indices.push_back(faceIndices[0]);
+					indices.push_back(faceIndices[j-1]);
+					indices.push_back(faceIndices[j]);
+					numTriangles++;
+				}
+			}
+		}
+		else {
+			// anything else (edges, materials, ...) is read past
+			for (int row = 0; row < element.count && !truncated; row++) {
+				for (int i = 0; i < (int)props.size() && !truncated; i++) {
+					const PlyProperty &prop = props[i];
+					int n = 1;
+					if (prop.countType != PLY_NONE) {
+						if (!binary) truncated = !f.getInt(n);
+						else if (end - p < plySize(prop.countType)) truncated = true;
+						else {
+							n = (int)readPlyValue(p, prop.countType, swap);
+							p += plySize(prop.countType);
+						}
+					}
+					for (int j = 0; j < n && !truncated; j++) {
+						float val;
+						if (!binary) truncated = !f.getFloat(val);
+						else if (end - p < plySize(prop.type)) truncated = true;
+						else p += plySize(prop.type);
+					}
+				}
+			}
+		}
 	}
-    
-	// get vertices
-	float val;
-	for (int i = 0; i < (int)(numVertices*attributes.size()); i++) {
-		//getToken(f, token, "");
-		//vertexData.push_back((float)atof(token.c_str()));
-		fscanf(f, "%f", &val);
-		vertexData.push_back(val);
+	if (truncated) {
+		ERROR("Ply file " + fileName + " ends early", false);
+		return false;
 	}
-    
-	// divide color values by 255, and flip normal directions if needed
+	for (int i = 0; i < (int)indices.size(); i++) {
+		if (indices[i] < 0 || indices[i] >= numVertices) {
+			ERROR("Ply file " + fileName + " has a face index out of range", false);
+			return false;
+		}
+	}
+
+	// bring integer color values to [0,1] (float colors already are), and
+	// flip normal directions if needed
 	// This deals with issues related to exporting from Blender to ply
 	// usin the y-axis as UP and the z-axis as FRONT.
 	for (int i = 0; i < (int)attributes.size(); i++) {
 		if (attributes[i] == "red" || attributes[i] == "green" || attributes[i] == "blue") {
+			if (vertexTypes[i] >= PLY_FLOAT32) continue;
+			float range = (float)((1ull << (8 * plySize(vertexTypes[i]))) - 1);
 			for (int j = 0; j < numVertices; j++) {
-				vertexData[i + j*attributes.size()] /= 255.0f;
+				vertexData[i + j*attributes.size()] /= range;
 			}
 		}
 		else if (flipZ && (attributes[i] == "z" || attributes[i] == "nz")) {
@@ -506,82 +1597,890 @@ bool TriMesh::readFromPly(const string &fileName, bool flipZ)
 		}
 	}
     
-	// get faces
-	int idx;
-	for (int i = 0; i < numFaces; i++) {
-		faceIndices.clear();
-		getToken(f, token, "");
-		int numVerts = atoi(token.c_str());
-		for (int j = 0; j < numVerts; j++) { // get all vertices in face
-			//getToken(f, t, "");
-			//faceIndices.push_back(atoi(t.c_str()));
-			fscanf(f, "%d", &idx);
-			faceIndices.push_back(idx);
-		}
-		for (int j = 2; j < numVerts; j++) { // make triangle fan
-			indices.push_back(faceIndices[0]);
-			indices.push_back(faceIndices[j-1]);
-			indices.push_back(faceIndices[j]);
-			numTriangles++;
-		}
-	}
 	numIndices = (int)indices.size();
+	numLods = 1;
+	lodCount[0] = numIndices;
+	computeBounds();
     
 	//printf("vertices:%d, triangles:%d, attributes:%d\n",
 	//	vertexData.size()/attributes.size(),
 	//	indices.size()/3,
 	//	attributes.size());
     
-	fclose(f);
 	return true;
 }
 
+void TriMesh::computeBounds(void)
+{
+	const float *vertices = (mappedVertices != NULL) ? mappedVertices :
+		(vertexData.empty() ? NULL : &vertexData[0]);
+	size_t numFloats = (mappedVertices != NULL) ? mappedNumFloats : vertexData.size();
+	int stride = (int)attributes.size();
+	int px = -1, py = -1, pz = -1;
+	for (int i = 0; i < stride; i++) {
+		if (attributes[i] == "x") px = i;
+		else if (attributes[i] == "y") py = i;
+		else if (attributes[i] == "z") pz = i;
+	}
+	sphereRadius = -1.0f;
+	boundsMin = boundsMax = sphereCenter = glm::vec3(0, 0, 0);
+	if (vertices == NULL || px < 0 || py < 0 || pz < 0) return;
+	int numVertices = (int)(numFloats / stride);
+	if (numVertices == 0) return;
+
+	boundsMin = boundsMax = glm::vec3(vertices[px], vertices[py], vertices[pz]);
+	for (int i = 1; i < numVertices; i++) {
+		const float *v = vertices + (size_t)i * stride;
+		glm::vec3 p(v[px], v[py], v[pz]);
+		boundsMin = glm::min(boundsMin, p);
+		boundsMax = glm::max(boundsMax, p);
+	}
+
+	// centered on the box, but sized from the vertices, which is tighter
+	// than the box's half diagonal for anything round
+	sphereCenter = (boundsMin + boundsMax) * 0.5f;
+	float radius2 = 0.0f;
+	for (int i = 0; i < numVertices; i++) {
+		const float *v = vertices + (size_t)i * stride;
+		glm::vec3 d = glm::vec3(v[px], v[py], v[pz]) - sphereCenter;
+		radius2 = fmax(radius2, glm::dot(d, d));
+	}
+	sphereRadius = sqrt(radius2);
+}
+
+//-------------------------------------------------------------------------//
+// Mesh optimization
+//-------------------------------------------------------------------------//
+
+bool gOptimizeMeshes = true;
+MeshOptimizeTotals gMeshOptimizeStats;
+
+void MeshOptimizeTotals::add(const MeshOptimizeStats &stats, int numTriangles)
+{
+	lock_guard<mutex> guard(lock);
+	meshes++;
+	triangles += numTriangles;
+	verticesBefore += stats.verticesBefore;
+	verticesAfter += stats.verticesAfter;
+	missesBefore += (double)stats.acmrBefore * numTriangles;
+	missesAfter += (double)stats.acmrAfter * numTriangles;
+}
+
+// misses in a FIFO vertex cache
+static int vertexCacheMisses(const int *indices, int numIndices, int numVertices, int cacheSize)
+{
+	vector<int> missTime(numVertices, -cacheSize - 1);
+	int misses = 0;
+	for (int i = 0; i < numIndices; i++) {
+		int v = indices[i];
+		if (misses - missTime[v] > cacheSize) missTime[v] = misses++;
+	}
+	return misses;
+}
+
+// Tipsify (Sander, Nehab, Barczak 2007): fan out from a vertex, emitting all
+// its triangles, then move to the neighbour that will stay longest in the
+// cache, falling back to recently used vertices at a dead end
+static void tipsify(int *indices, int numIndices, int numVertices, int cacheSize)
+{
+	int numTriangles = numIndices / 3;
+	vector<int> live(numVertices, 0), adjStart(numVertices + 1, 0), adj(numIndices);
+	for (int i = 0; i < numIndices; i++) live[indices[i]]++;
+	for (int v = 0; v < numVertices; v++) adjStart[v + 1] = adjStart[v] + live[v];
+	vector<int> fill(adjStart.begin(), adjStart.end() - 1);
+	for (int i = 0; i < numIndices; i++) adj[fill[indices[i]]++] = i / 3;
+
+	vector<int> cacheTime(numVertices, 0);
+	vector<unsigned char> emitted(numTriangles, 0);
+	vector<int> deadEnd, candidates, output;
+	output.reserve(numIndices);
+	int time = cacheSize + 1, cursor = 1;
+	int fan = 0;
+	while (fan >= 0) {
+		candidates.clear();
+		for (int a = adjStart[fan]; a < adjStart[fan + 1]; a++) {
+			int t = adj[a];
+			if (emitted[t]) continue;
+			emitted[t] = 1;
+			for (int k = 0; k < 3; k++) {
+				int v = indices[3 * t + k];
+				output.push_back(v);
+				deadEnd.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - cacheTime[v] > cacheSize) cacheTime[v] = time++;
+			}
+		}
+
+		// the candidate still in the cache after its remaining triangles, oldest first
+		fan = -1;
+		int bestPriority = -1;
+		for (int i = 0; i < (int)candidates.size(); i++) {
+			int v = candidates[i];
+			if (live[v] <= 0) continue;
+			int priority = 0;
+			if (time - cacheTime[v] + 2 * live[v] <= cacheSize) priority = time - cacheTime[v];
+			if (priority > bestPriority) {
+				bestPriority = priority;
+				fan = v;
+			}
+		}
+		while (fan < 0 && !deadEnd.empty()) {
+			int v = deadEnd.back();
+			deadEnd.pop_back();
+			if (live[v] > 0) fan = v;
+		}
+		while (fan < 0 && cursor < numVertices) {
+			if (live[cursor] > 0) fan = cursor;
+			cursor++;
+		}
+	}
+	copy(output.begin(), output.end(), indices);
+}
+
+void TriMesh::optimize(MeshOptimizeStats *stats)
+{
+	int stride = (int)attributes.size();
+	if (stride == 0 || vertexData.empty() || numIndices == 0) return;
+	int numVertices = (int)(vertexData.size() / stride);
+	for (int i = 0; i < numIndices; i++) {
+		if (indices[i] < 0 || indices[i] >= numVertices) {
+			ERROR("optimize: index out of range in " + name, false);
+			return;
+		}
+	}
+	if (stats != NULL) {
+		int misses = vertexCacheMisses(&indices[0], numIndices, numVertices, VERTEX_CACHE_SIZE);
+		stats->verticesBefore = numVertices;
+		stats->acmrBefore = misses / (numIndices / 3.0f);
+		stats->atvrBefore = misses / (float)numVertices;
+	}
+
+	// weld vertices whose attributes are all bit for bit the same
+	const float *v = &vertexData[0];
+	size_t bytes = stride * sizeof(float);
+	vector<int> order(numVertices), weld(numVertices);
+	for (int i = 0; i < numVertices; i++) order[i] = i;
+	sort(order.begin(), order.end(), [&](int a, int b) {
+		int c = memcmp(v + (size_t)a * stride, v + (size_t)b * stride, bytes);
+		return c < 0 || (c == 0 && a < b);
+	});
+	for (int i = 0; i < numVertices; i++) {
+		bool same = i > 0 && memcmp(v + (size_t)order[i] * stride, v + (size_t)order[i - 1] * stride, bytes) == 0;
+		weld[order[i]] = same ? weld[order[i - 1]] : order[i];
+	}
+	for (int i = 0; i < numIndices; i++) indices[i] = weld[indices[i]];
+
+	tipsify(&indices[0], numIndices, numVertices, VERTEX_CACHE_SIZE);
+
+	// renumber in order of first use, dropping the welded and unused ones
+	vector<int> remap(numVertices, -1);
+	vector<float> reordered;
+	reordered.reserve(vertexData.size());
+	int next = 0;
+	for (int i = 0; i < numIndices; i++) {
+		int &index = indices[i];
+		if (remap[index] < 0) {
+			remap[index] = next++;
+			reordered.insert(reordered.end(), v + (size_t)index * stride, v + (size_t)(index + 1) * stride);
+		}
+		index = remap[index];
+	}
+	vertexData.swap(reordered);
+	computeBounds();
+
+	if (stats != NULL) {
+		int misses = vertexCacheMisses(&indices[0], numIndices, next, VERTEX_CACHE_SIZE);
+		stats->verticesAfter = next;
+		stats->acmrAfter = misses / (numIndices / 3.0f);
+		stats->atvrAfter = misses / (float)next;
+	}
+}
+
+//-------------------------------------------------------------------------//
+// Levels of detail
+//-------------------------------------------------------------------------//
+
+bool gBuildMeshLods = true;
+float gLodPixelError = 1.0f;
+float gLodMinPixels = 1.0f;
+
+// Sum of squared distances to a set of planes, as a symmetric 4x4 matrix
+class Quadric
+{
+public:
+	double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+	Quadric(void) { a2 = ab = ac = ad = b2 = bc = bd = c2 = cd = d2 = 0.0; }
+	void addPlane(const glm::vec3 &n, float d, double weight) {
+		double a = n.x, b = n.y, c = n.z;
+		a2 += weight * a * a; ab += weight * a * b; ac += weight * a * c; ad += weight * a * d;
+		b2 += weight * b * b; bc += weight * b * c; bd += weight * b * d;
+		c2 += weight * c * c; cd += weight * c * d; d2 += weight * (double)d * d;
+	}
+	void add(const Quadric &q) {
+		a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad; b2 += q.b2;
+		bc += q.bc; bd += q.bd; c2 += q.c2; cd += q.cd; d2 += q.d2;
+	}
+	double error(const glm::vec3 &p) const {
+		double x = p.x, y = p.y, z = p.z;
+		return a2 * x * x + 2.0 * ab * x * y + 2.0 * ac * x * z + 2.0 * ad * x +
+			b2 * y * y + 2.0 * bc * y * z + 2.0 * bd * y +
+			c2 * z * z + 2.0 * cd * z + d2;
+	}
+};
+
+// open edges are held in place by a plane through them, at this weight
+#define LOD_BOUNDARY_WEIGHT 10.0
+
+class LodCollapse
+{
+public:
+	double cost;
+	int from, to; // from moves onto to
+	int fromStamp, toStamp; // stale once either end changes
+
+	bool operator>(const LodCollapse &c) const { return cost > c.cost; }
+};
+
+void TriMesh::buildLods(void)
+{
+	numLods = 1;
+	lodStart[0] = 0;
+	lodCount[0] = numIndices;
+	lodError[0] = 0.0f;
+	indices.resize(numIndices);
+
+	int stride = (int)attributes.size();
+	int px = -1, py = -1, pz = -1;
+	for (int i = 0; i < stride; i++) {
+		if (attributes[i] == "x") px = i;
+		else if (attributes[i] == "y") py = i;
+		else if (attributes[i] == "z") pz = i;
+	}
+	int numTriangles = numIndices / 3;
+	if (numTriangles < MESH_LOD_MIN_TRIANGLES || px < 0 || py < 0 || pz < 0 || vertexData.empty()) return;
+	int numVertices = (int)(vertexData.size() / stride);
+
+	// Vertices split at seams (normals, texture coordinates) share a position.
+	// Collapses work on positions, so seams move as one, and each corner
+	// then takes the vertex at its new position closest to its old one.
+	vector<int> byPosition(numVertices);
+	for (int i = 0; i < numVertices; i++) byPosition[i] = i;
+	const float *v = &vertexData[0];
+	sort(byPosition.begin(), byPosition.end(), [&](int a, int b) {
+		const float *va = v + (size_t)a * stride, *vb = v + (size_t)b * stride;
+		if (va[px] != vb[px]) return va[px] < vb[px];
+		if (va[py] != vb[py]) return va[py] < vb[py];
+		return va[pz] < vb[pz];
+	});
+	vector<int> position(numVertices);
+	vector<glm::vec3> points;
+	vector<int> groupStart; // vertices of position p are byPosition[groupStart[p], groupStart[p + 1])
+	for (int i = 0; i < numVertices; i++) {
+		const float *vi = v + (size_t)byPosition[i] * stride;
+		glm::vec3 p(vi[px], vi[py], vi[pz]);
+		if (points.empty() || p != points.back()) {
+			points.push_back(p);
+			groupStart.push_back(i);
+		}
+		position[byPosition[i]] = (int)points.size() - 1;
+	}
+	int numPositions = (int)points.size();
+	groupStart.push_back(numVertices);
+
+	vector<int> corner(indices.begin(), indices.end()); // vertex per corner
+	vector<int> tri(numIndices); // position per corner
+	vector<unsigned char> triDead(numTriangles, 0);
+	vector< vector<int> > positionTris(numPositions);
+	vector<Quadric> quadrics(numPositions);
+	vector< pair<uint64_t, int> > edges; // (edge key, triangle), to find the open ones
+	int alive = 0;
+	for (int t = 0; t < numTriangles; t++) {
+		for (int k = 0; k < 3; k++) {
+			if (corner[3 * t + k] < 0 || corner[3 * t + k] >= numVertices) {
+				ERROR("LOD: index out of range in " + name, false);
+				return;
+			}
+			tri[3 * t + k] = position[corner[3 * t + k]];
+		}
+		int a = tri[3 * t], b = tri[3 * t + 1], c = tri[3 * t + 2];
+		glm::vec3 n = glm::cross(points[b] - points[a], points[c] - points[a]);
+		float length = glm::length(n);
+		if (a == b || b == c || c == a || length == 0.0f) {
+			triDead[t] = 1;
+			continue;
+		}
+		n /= length;
+		for (int k = 0; k < 3; k++) {
+			int p = tri[3 * t + k], q = tri[3 * t + (k + 1) % 3];
+			quadrics[p].addPlane(n, -glm::dot(n, points[p]), 1.0);
+			positionTris[p].push_back(t);
+			edges.push_back(make_pair(((uint64_t)min(p, q) << 32) | (uint32_t)max(p, q), t));
+		}
+		alive++;
+	}
+	sort(edges.begin(), edges.end());
+	for (int i = 0; i < (int)edges.size(); i++) {
+		bool open = (i == 0 || edges[i - 1].first != edges[i].first) &&
+			(i + 1 == (int)edges.size() || edges[i + 1].first != edges[i].first);
+		if (!open) continue;
+		int t = edges[i].second;
+		int a = (int)(edges[i].first >> 32), b = (int)(edges[i].first & 0xFFFFFFFF);
+		glm::vec3 n = glm::cross(points[tri[3 * t + 1]] - points[tri[3 * t]], points[tri[3 * t + 2]] - points[tri[3 * t]]);
+		glm::vec3 side = glm::cross(points[b] - points[a], n);
+		float length = glm::length(side);
+		if (length == 0.0f) continue;
+		side /= length;
+		float d = -glm::dot(side, points[a]);
+		quadrics[a].addPlane(side, d, LOD_BOUNDARY_WEIGHT);
+		quadrics[b].addPlane(side, d, LOD_BOUNDARY_WEIGHT);
+	}
+	vector<pair<uint64_t, int> >().swap(edges);
+
+	// cheapest collapse first, candidates go stale rather than being removed
+	vector<int> stamp(numPositions, 0);
+	vector<unsigned char> positionDead(numPositions, 0);
+	priority_queue<LodCollapse, vector<LodCollapse>, greater<LodCollapse> > heap;
+	auto pushEdge = [&](int a, int b) {
+		Quadric q = quadrics[a];
+		q.add(quadrics[b]);
+		LodCollapse c;
+		double toB = q.error(points[b]), toA = q.error(points[a]);
+		c.cost = fmax(fmin(toA, toB), 0.0);
+		c.from = (toB <= toA) ? a : b;
+		c.to = (toB <= toA) ? b : a;
+		c.fromStamp = stamp[c.from];
+		c.toStamp = stamp[c.to];
+		heap.push(c);
+	};
+	for (int t = 0; t < numTriangles; t++) {
+		if (triDead[t]) continue;
+		for (int k = 0; k < 3; k++) {
+			int a = tri[3 * t + k], b = tri[3 * t + (k + 1) % 3];
+			if (a < b) pushEdge(a, b);
+		}
+	}
+
+	double maxCost = 0.0;
+	int lastAlive = alive;
+	for (int level = 1; level < MESH_MAX_LODS; level++) {
+		int target = lastAlive / 2;
+		while (alive > target && !heap.empty()) {
+			LodCollapse c = heap.top();
+			heap.pop();
+			if (positionDead[c.from] || positionDead[c.to] ||
+				stamp[c.from] != c.fromStamp || stamp[c.to] != c.toStamp) continue;
+
+			// no triangle may flip over
+			bool flips = false;
+			vector<int> &moving = positionTris[c.from];
+			for (int i = 0; i < (int)moving.size() && !flips; i++) {
+				int t = moving[i];
+				if (triDead[t]) continue;
+				int *ti = &tri[3 * t];
+				if (ti[0] == c.to || ti[1] == c.to || ti[2] == c.to) continue;
+				glm::vec3 p[3], q[3];
+				for (int k = 0; k < 3; k++) {
+					p[k] = points[ti[k]];
+					q[k] = (ti[k] == c.from) ? points[c.to] : p[k];
+				}
+				glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+				glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+				flips = glm::dot(before, after) <= 0.0f;
+			}
+			if (flips) continue;
+
+			maxCost = fmax(maxCost, c.cost);
+			quadrics[c.to].add(quadrics[c.from]);
+			positionDead[c.from] = 1;
+			stamp[c.to]++;
+			vector<int> &survivor = positionTris[c.to];
+			for (int i = 0; i < (int)moving.size(); i++) {
+				int t = moving[i];
+				if (triDead[t]) continue;
+				int *ti = &tri[3 * t];
+				if (ti[0] == c.to || ti[1] == c.to || ti[2] == c.to) {
+					triDead[t] = 1;
+					alive--;
+					continue;
+				}
+				for (int k = 0; k < 3; k++) {
+					if (ti[k] != c.from) continue;
+					ti[k] = c.to;
+
+					// the vertex at the new position most like the old one
+					const float *old = v + (size_t)corner[3 * t + k] * stride;
+					float bestDist = FLT_MAX;
+					for (int g = groupStart[c.to]; g < groupStart[c.to + 1]; g++) {
+						const float *candidate = v + (size_t)byPosition[g] * stride;
+						float dist = 0.0f;
+						for (int a = 0; a < stride; a++) {
+							if (a == px || a == py || a == pz) continue;
+							dist += (candidate[a] - old[a]) * (candidate[a] - old[a]);
+						}
+						if (dist < bestDist) {
+							bestDist = dist;
+							corner[3 * t + k] = byPosition[g];
+						}
+					}
+				}
+				survivor.push_back(t);
+			}
+			vector<int>().swap(moving);
+
+			// drop dead triangles from the survivor and requeue its edges
+			int n = 0;
+			for (int i = 0; i < (int)survivor.size(); i++) {
+				if (!triDead[survivor[i]]) survivor[n++] = survivor[i];
+			}
+			survivor.resize(n);
+			for (int i = 0; i < n; i++) {
+				int *ti = &tri[3 * survivor[i]];
+				for (int k = 0; k < 3; k++) {
+					if (ti[k] != c.to) pushEdge(c.to, ti[k]);
+				}
+			}
+		}
+
+		// stop once collapses stop paying off
+		if (alive > lastAlive * 9 / 10) break;
+		lodStart[level] = (int)indices.size();
+		for (int t = 0; t < numTriangles; t++) {
+			if (triDead[t]) continue;
+			for (int k = 0; k < 3; k++) indices.push_back(corner[3 * t + k]);
+		}
+		lodCount[level] = (int)indices.size() - lodStart[level];
+		lodError[level] = (float)sqrt(maxCost);
+		if (gOptimizeMeshes) tipsify(&indices[lodStart[level]], lodCount[level], numVertices, VERTEX_CACHE_SIZE);
+		numLods = level + 1;
+		lastAlive = alive;
+	}
+}
+
+//-------------------------------------------------------------------------//
+// Meshlets
+//-------------------------------------------------------------------------//
+
+bool gUseMeshlets = true;
+bool gMeshletConeCulling = false;
+
+void TriMesh::buildMeshlets(const float *vertices, const int *faces)
+{
+	meshlets.clear();
+	int stride = (int)attributes.size();
+	int px = -1, py = -1, pz = -1;
+	for (int i = 0; i < stride; i++) {
+		if (attributes[i] == "x") px = i;
+		else if (attributes[i] == "y") py = i;
+		else if (attributes[i] == "z") pz = i;
+	}
+	int numTriangles = numIndices / 3;
+	if (vertices == NULL || faces == NULL || numTriangles < MESHLET_MIN_TRIANGLES || px < 0 || py < 0 || pz < 0) return;
+	int maxIndex = 0;
+	for (int i = 0; i < numIndices; i++) maxIndex = max(maxIndex, faces[i]);
+	auto point = [&](int index) {
+		const float *v = vertices + (size_t)index * stride;
+		return glm::vec3(v[px], v[py], v[pz]);
+	};
+
+	// bounds and normal cone of triangles [first, last)
+	auto finish = [&](int first, int last) {
+		Meshlet m;
+		m.start = 3 * first;
+		m.count = 3 * (last - first);
+		glm::vec3 lo(FLT_MAX), hi(-FLT_MAX), axis(0, 0, 0);
+		for (int i = m.start; i < m.start + m.count; i++) {
+			lo = glm::min(lo, point(faces[i]));
+			hi = glm::max(hi, point(faces[i]));
+		}
+		m.center = (lo + hi) * 0.5f;
+		float radius2 = 0.0f;
+		for (int i = m.start; i < m.start + m.count; i++) {
+			glm::vec3 d = point(faces[i]) - m.center;
+			radius2 = fmax(radius2, glm::dot(d, d));
+		}
+		m.radius = sqrt(radius2);
+
+		vector<glm::vec3> normals;
+		for (int t = first; t < last; t++) {
+			glm::vec3 a = point(faces[3 * t]);
+			glm::vec3 n = glm::cross(point(faces[3 * t + 1]) - a, point(faces[3 * t + 2]) - a);
+			float length = glm::length(n);
+			if (length == 0.0f) continue;
+			normals.push_back(n / length);
+			axis += normals.back();
+		}
+		float length = glm::length(axis);
+		m.coneAxis = (length > 0.0f) ? axis / length : glm::vec3(0, 0, 1);
+		float minDot = (length > 0.0f) ? 1.0f : -1.0f;
+		for (int i = 0; i < (int)normals.size(); i++) minDot = fmin(minDot, glm::dot(m.coneAxis, normals[i]));
+		m.coneCutoff = (minDot > 0.0f) ? sqrt(1.0f - minDot * minDot) : 1.0f;
+		meshlets.push_back(m);
+	};
+
+	// consecutive triangles until either limit is reached
+	vector<int> usedBy(maxIndex + 1, -1);
+	int first = 0, numVertices = 0;
+	for (int t = 0; t < numTriangles; t++) {
+		int added = 0;
+		for (int k = 0; k < 3; k++) {
+			bool repeat = (k > 0 && faces[3 * t + k] == faces[3 * t]) || (k > 1 && faces[3 * t + 2] == faces[3 * t + 1]);
+			if (usedBy[faces[3 * t + k]] != (int)meshlets.size() && !repeat) added++;
+		}
+		if (t - first == MESHLET_MAX_TRIANGLES || numVertices + added > MESHLET_MAX_VERTICES) {
+			finish(first, t);
+			first = t;
+			numVertices = 0;
+			added = 0;
+			for (int k = 0; k < 3; k++) {
+				bool repeat = (k > 0 && faces[3 * t + k] == faces[3 * t]) || (k > 1 && faces[3 * t + 2] == faces[3 * t + 1]);
+				if (!repeat) added++;
+			}
+		}
+		for (int k = 0; k < 3; k++) usedBy[faces[3 * t + k]] = (int)meshlets.size();
+		numVertices += added;
+	}
+	finish(first, numTriangles);
+}
+
+int TriMesh::cullMeshlets(const glm::mat4x4 &world, const float planes[6][4], const glm::vec3 &eye,
+	vector<GLsizei> &counts, vector<const void*> &offsets) const
+{
+	counts.clear();
+	offsets.clear();
+
+	// cones only survive rotation and uniform scale, without a mirror
+	glm::vec3 x(world[0]), y(world[1]), z(world[2]);
+	float x2 = glm::dot(x, x), y2 = glm::dot(y, y), z2 = glm::dot(z, z);
+	float largest = fmax(x2, fmax(y2, z2)), smallest = fmin(x2, fmin(y2, z2));
+	float scale = sqrt(largest);
+	bool cones = gMeshletConeCulling && smallest >= 0.98f * largest && glm::dot(glm::cross(x, y), z) > 0.0f;
+
+	for (int i = 0; i < (int)meshlets.size(); i++) {
+		const Meshlet &m = meshlets[i];
+		glm::vec3 center = glm::vec3(world * glm::vec4(m.center, 1.0f));
+		float radius = m.radius * scale;
+		bool inside = true;
+		for (int p = 0; p < 6 && inside; p++) {
+			inside = planes[p][0] * center.x + planes[p][1] * center.y + planes[p][2] * center.z + planes[p][3] >= -radius;
+		}
+		if (!inside) continue;
+		if (cones && m.coneCutoff < 1.0f) {
+			glm::vec3 axis = glm::normalize(glm::vec3(world * glm::vec4(m.coneAxis, 0.0f)));
+			glm::vec3 toCenter = center - eye;
+			if (glm::dot(toCenter, axis) >= m.coneCutoff * glm::length(toCenter) + radius) continue;
+		}
+		counts.push_back(m.count);
+		offsets.push_back((const void*)((size_t)m.start * indexSize));
+	}
+	gRenderStats.meshletsTested += (int)meshlets.size();
+	gRenderStats.meshletsDrawn += (int)counts.size();
+	return (int)counts.size();
+}
+
+//-------------------------------------------------------------------------//
+// Binary mesh cache.  Layout (all fields 4 bytes, so every block is aligned):
+//   MeshCacheHeader
+//   attribute names, '\0' separated, padded to a multiple of 4 bytes
+//   vertex block, numVertices * numAttributes floats (interleaved)
+//   index block, numIndices ints, every level of detail back to back
+//-------------------------------------------------------------------------//
+
+bool gUseMeshCache = true;
+bool gStreamMeshes = false;
+
+struct MeshCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t flipZ;
+	uint32_t buildFlags; // MESH_CACHE_LODS, MESH_CACHE_OPTIMIZED
+	uint32_t numVertices;
+	uint32_t numAttributes;
+	uint32_t numIndices;
+	uint32_t namesSize;
+	float boundsMin[3];
+	float boundsMax[3];
+	float sphereCenter[3];
+	float sphereRadius;
+	uint32_t numLods;
+	uint32_t lodCount[MESH_MAX_LODS];
+	float lodError[MESH_MAX_LODS];
+};
+
+static const char MESH_CACHE_MAGIC[4] = { 'E', 'B', 'M', 'C' };
+
+// what readFromPly followed by the current settings would have built
+static uint32_t meshCacheBuildFlags(void)
+{
+	return (gBuildMeshLods ? MESH_CACHE_LODS : 0) | (gOptimizeMeshes ? MESH_CACHE_OPTIMIZED : 0);
+}
+
+bool TriMesh::load(const string &fileName, bool flipZ)
+{
+	string fullName;
+	if (!getFullFileName(fileName, fullName)) {
+		ERROR("Could not open file " + fileName, false);
+		return false;
+	}
+
+	// use the cache only if it is at least as new as the ply
+	string cacheName = fullName + MESH_CACHE_EXTENSION;
+	time_t plyTime, cacheTime;
+	if (gUseMeshCache &&
+		getFileModTime(cacheName, cacheTime) &&
+		getFileModTime(fullName, plyTime) &&
+		cacheTime >= plyTime)
+	{
+		if (readFromCache(cacheName, flipZ)) {
+			name = fileName;
+			return true;
+		}
+	}
+
+	if (!readFromPly(fileName, flipZ)) return false;
+	if (gOptimizeMeshes) {
+		MeshOptimizeStats stats;
+		optimize(&stats);
+		gMeshOptimizeStats.add(stats, numIndices / 3);
+	}
+	if (gBuildMeshLods) buildLods();
+	if (gUseMeshCache) writeToCache(cacheName, flipZ);
+	return true;
+}
+
+//-------------------------------------------------------------------------//
+
+bool TriMesh::readFromCache(const string &cacheName, bool flipZ, bool useMmap)
+{
+	// streaming meshes keep the mapping open until they are uploaded
+	bool streaming = useMmap && !keepCPUData;
+	MappedFile localMapped;
+	MappedFile &mapped = streaming ? mappedCache : localMapped;
+	vector<unsigned char> buffer;
+	const unsigned char *data = NULL;
+	size_t size = 0;
+
+	if (useMmap) {
+		if (!mapped.open(cacheName)) return false;
+		data = mapped.data;
+		size = mapped.size;
+	}
+	else {
+		// one read of the whole file
+		FILE *f = fopen(cacheName.c_str(), "rb");
+		if (f == NULL) return false;
+		fseek(f, 0, SEEK_END);
+		long length = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		if (length > 0) {
+			buffer.resize(length);
+			if (fread(&buffer[0], 1, length, f) != (size_t)length) buffer.clear();
+		}
+		fclose(f);
+		if (buffer.empty()) return false;
+		data = &buffer[0];
+		size = buffer.size();
+	}
+
+	// validate the header before trusting any of the sizes
+	MeshCacheHeader header;
+	bool valid = (size >= sizeof(MeshCacheHeader));
+	if (valid) {
+		memcpy(&header, data, sizeof(header));
+		valid = memcmp(header.magic, MESH_CACHE_MAGIC, 4) == 0 &&
+			header.version == MESH_CACHE_VERSION &&
+			header.flipZ == (uint32_t)flipZ &&
+			header.buildFlags == meshCacheBuildFlags() &&
+			(header.namesSize & 3) == 0 &&
+			header.numLods >= 1 && header.numLods <= MESH_MAX_LODS;
+	}
+	size_t lodIndices = 0;
+	for (int i = 0; valid && i < (int)header.numLods; i++) lodIndices += header.lodCount[i];
+	valid = valid && (lodIndices == header.numIndices);
+	size_t numFloats = 0;
+	if (valid) {
+		numFloats = (size_t)header.numVertices * header.numAttributes;
+		size_t expected = sizeof(MeshCacheHeader) + header.namesSize +
+			numFloats * sizeof(float) + (size_t)header.numIndices * sizeof(int);
+		valid = (size == expected);
+	}
+
+	// attribute names, each ending inside the names block
+	const char *names = (const char*)(data + sizeof(MeshCacheHeader));
+	attributes.clear();
+	size_t pos = 0;
+	for (int i = 0; valid && i < (int)header.numAttributes; i++) {
+		const char *nul = (pos < header.namesSize) ?
+			(const char*)memchr(names + pos, '\0', header.namesSize - pos) : NULL;
+		if (nul == NULL) valid = false;
+		else {
+			attributes.push_back(string(names + pos, nul));
+			pos = nul - names + 1;
+		}
+	}
+	if (!valid) {
+		mapped.close();
+		attributes.clear();
+		return false;
+	}
+
+	const float *vertices = (const float*)(data + sizeof(MeshCacheHeader) + header.namesSize);
+	const int *faces = (const int*)(vertices + numFloats);
+	numLods = (int)header.numLods;
+	for (int i = 0; i < numLods; i++) {
+		lodStart[i] = (i == 0) ? 0 : lodStart[i - 1] + lodCount[i - 1];
+		lodCount[i] = (int)header.lodCount[i];
+		lodError[i] = header.lodError[i];
+	}
+	numIndices = lodCount[0];
+	boundsMin = glm::vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+	boundsMax = glm::vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+	sphereCenter = glm::vec3(header.sphereCenter[0], header.sphereCenter[1], header.sphereCenter[2]);
+	sphereRadius = header.sphereRadius;
+
+	// streaming, so leave the data in the mapped file for sendToOpenGL
+	if (streaming) {
+		mappedVertices = vertices;
+		mappedIndices = faces;
+		mappedNumFloats = numFloats;
+		vertexData.clear();
+		indices.clear();
+		return true;
+	}
+
+	// otherwise vertex and index blocks go straight into the arrays
+	vertexData.assign(vertices, vertices + numFloats);
+	indices.assign(faces, faces + header.numIndices);
+	return true;
+}
+
+//-------------------------------------------------------------------------//
+
+bool TriMesh::writeToCache(const string &cacheName, bool flipZ)
+{
+	string names;
+	for (int i = 0; i < (int)attributes.size(); i++) {
+		names += attributes[i];
+		names += '\0';
+	}
+	while (names.length() & 3) names += '\0';
+
+	MeshCacheHeader header;
+	memcpy(header.magic, MESH_CACHE_MAGIC, 4);
+	header.version = MESH_CACHE_VERSION;
+	header.flipZ = (uint32_t)flipZ;
+	header.buildFlags = meshCacheBuildFlags();
+	header.numVertices = attributes.empty() ? 0 : (uint32_t)(vertexData.size() / attributes.size());
+	header.numAttributes = (uint32_t)attributes.size();
+	header.numIndices = (uint32_t)indices.size();
+	header.namesSize = (uint32_t)names.length();
+	for (int i = 0; i < 3; i++) {
+		header.boundsMin[i] = boundsMin[i];
+		header.boundsMax[i] = boundsMax[i];
+		header.sphereCenter[i] = sphereCenter[i];
+	}
+	header.sphereRadius = sphereRadius;
+	header.numLods = (uint32_t)numLods;
+	for (int i = 0; i < MESH_MAX_LODS; i++) {
+		header.lodCount[i] = (i < numLods) ? (uint32_t)lodCount[i] : 0;
+		header.lodError[i] = (i < numLods) ? lodError[i] : 0.0f;
+	}
+
+	FILE *f = fopen(cacheName.c_str(), "wb");
+	if (f == NULL) {
+		ERROR("Could not write mesh cache '" + cacheName + "'", false);
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	if (ok && !names.empty()) ok = fwrite(names.data(), names.length(), 1, f) == 1;
+	if (ok && !vertexData.empty()) ok = fwrite(&vertexData[0], vertexData.size() * sizeof(float), 1, f) == 1;
+	if (ok && !indices.empty()) ok = fwrite(&indices[0], indices.size() * sizeof(int), 1, f) == 1;
+	fclose(f);
+
+	// a partial cache would be rejected on size anyway, but don't leave it around
+	if (!ok) {
+		remove(cacheName.c_str());
+		ERROR("Could not write mesh cache '" + cacheName + "'", false);
+	}
+	return ok;
+}
+
 //-------------------------------------------------------------------------//
 
 void Material::bindMaterial(Transform &T, Camera &camera)
 {
 	glUseProgram(shaderProgram);
+	ShaderProgram *p = getProgram();
+	if (p == NULL) return;
 
 	// MATRICES FROM TRANSFORM
-	GLint loc = glGetUniformLocation(shaderProgram, "uObjectWorldM");
-	if (loc != -1) glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(T.transform));
+	if (p->uObjectWorldM != -1) glUniformMatrix4fv(p->uObjectWorldM, 1, GL_FALSE, glm::value_ptr(T.transform));
 	//
-	loc = glGetUniformLocation(shaderProgram, "uObjectWorldInverseM");
-	if (loc != -1) glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(T.invTransform));
+	if (p->uObjectWorldInverseM != -1) glUniformMatrix4fv(p->uObjectWorldInverseM, 1, GL_FALSE, glm::value_ptr(T.invTransform));
 	//
-	glm::mat4x4 objectWorldViewPerspect = camera.worldViewProject * T.transform;
-	loc = glGetUniformLocation(shaderProgram, "uObjectPerpsectM");
-	if (loc != -1) glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(objectWorldViewPerspect));
+	if (p->uObjectPerpsectM != -1) {
+		glm::mat4x4 objectWorldViewPerspect = camera.worldViewProject * T.transform;
+		glUniformMatrix4fv(p->uObjectPerpsectM, 1, GL_FALSE, glm::value_ptr(objectWorldViewPerspect));
+	}
     
-    loc = glGetUniformLocation(shaderProgram, "uView");
-	if (loc != -1) glUniform4fv(loc, 1, &camera.eye[0]);
+	if (p->uView != -1) glUniform4fv(p->uView, 1, &camera.eye[0]);
+	bindObjectData(p, camera, T.transform, T.invTransform);
+
+	bindColorsAndTextures(p);
+}
 
+void Material::bindColors(ShaderProgram *p)
+{
 	// MATERIAL COLORS
 	for (int i = 0; i < (int) colors.size(); i++) {
 		if (colors[i].id == -1) {
-			loc = glGetUniformLocation(shaderProgram, colors[i].name.c_str());
-			colors[i].id = loc;
+			colors[i].id = p->getUniform(colors[i].name);
 		}
 		if (colors[i].id >= 0) {
 			glUniform4fv(colors[i].id, 1, &colors[i].val[0]);
 		}
 	}
+}
 
+void Material::bindTextures(ShaderProgram *p)
+{
 	// MATERIAL TEXTURES
 	for (int i = 0; i < (int) textures.size(); i++) {
 		if (textures[i].id == -1) {
-			loc = glGetUniformLocation(shaderProgram, textures[i].name.c_str());
-			textures[i].id = loc;
+			textures[i].id = p->getUniform(textures[i].name);
 		}
 		if (textures[i].id >= 0) {
 			//printf("\n%d %d\n", textures[i].id, textures[i].val->samplerId);
 			glActiveTexture(GL_TEXTURE0 + i);
 			glUniform1i(textures[i].id, i);
 			glBindTexture(GL_TEXTURE_2D, textures[i].val->textureId);
-			glBindSampler(textures[i].id, textures[i].val->samplerId);
+			glBindSampler(i, textures[i].val->samplerId); // by unit, like glActiveTexture
 		}
 	}
 }
+
+// materials binding the same textures to the same sampler names share an id
+map<string, int> gTextureSets;
+
+int Material::getTextureSet(void)
+{
+	if (textureSet != -1) return textureSet;
+
+	string key;
+	for (int i = 0; i < (int) textures.size(); i++) {
+		key += textures[i].name;
+		key += '\0';
+		key += to_string(textures[i].val != NULL ? textures[i].val->textureId : 0);
+		key += '\0';
+	}
+	map<string, int>::iterator it = gTextureSets.find(key);
+	if (it == gTextureSets.end()) it = gTextureSets.insert(make_pair(key, (int)gTextureSets.size())).first;
+	textureSet = it->second;
+	return textureSet;
+}
+
 //-------------------------------------------------------------------------//
 
 #define V_POSITION 0
@@ -590,8 +2489,189 @@ void Material::bindMaterial(Transform &T, Camera &camera)
 #define V_COLOR 3
 int NUM_COMPONENTS[] = { 3, 3, 2, 3 };
 
+//-------------------------------------------------------------------------//
+
+bool gCompressVertices = true;
+MeshUploadStats gMeshUploadStats;
+
+static uint16_t floatToHalf(float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	uint32_t sign = (x >> 16) & 0x8000;
+	uint32_t mantissa = x & 0x7FFFFF;
+	if (((x >> 23) & 0xFF) == 0xFF) return (uint16_t)(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+	int exponent = (int)((x >> 23) & 0xFF) - 127 + 15;
+	if (exponent >= 31) return (uint16_t)(sign | 0x7C00);
+
+	// round to nearest even, a carry out of the mantissa bumps the exponent
+	uint32_t half, rest, halfway;
+	if (exponent <= 0) {
+		if (exponent < -10) return (uint16_t)sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		half = mantissa >> shift;
+		rest = mantissa & ((1u << shift) - 1);
+		halfway = 1u << (shift - 1);
+	}
+	else {
+		half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+		rest = mantissa & 0x1FFF;
+		halfway = 0x1000;
+	}
+	if (rest > halfway || (rest == halfway && (half & 1))) half++;
+	return (uint16_t)(sign | half);
+}
+
+void VertexFormat::choose(const TriMesh &mesh, const float *vertices, int numVertices, bool compress)
+{
+	static const char *names[] = { "x", "nx", "s", "red" }; // by location
+	int sourceStride = (int)mesh.attributes.size();
+	attributes.clear();
+	stride = 0;
+	for (int location = 0; location < 4; location++) {
+		int source = -1;
+		for (int i = 0; i < sourceStride; i++) {
+			if (mesh.attributes[i] == names[location]) source = i;
+		}
+		if (source < 0 || source + NUM_COMPONENTS[location] > sourceStride) continue;
+
+		VertexAttribute a;
+		a.location = location;
+		a.source = source;
+		a.components = NUM_COMPONENTS[location];
+		a.type = GL_FLOAT;
+		a.normalized = GL_FALSE;
+		int bytes = a.components * sizeof(float);
+
+		// the range of the values decides what fits
+		float lo = FLT_MAX, hi = -FLT_MAX;
+		for (int v = 0; compress && v < numVertices; v++) {
+			const float *value = vertices + (size_t)v * sourceStride + source;
+			for (int c = 0; c < a.components; c++) {
+				lo = fmin(lo, value[c]);
+				hi = fmax(hi, value[c]);
+			}
+		}
+		float largest = fmax(fabs(lo), fabs(hi));
+		if (!compress || numVertices == 0) {}
+		else if (location == V_POSITION) {
+			// half floats keep 11 bits, so the error grows with distance from the origin
+			if (largest < 65504.0f && largest / 2048.0f <= mesh.sphereRadius * VERTEX_POSITION_TOLERANCE) {
+				a.type = GL_HALF_FLOAT;
+				bytes = a.components * sizeof(uint16_t);
+			}
+		}
+		else if (location == V_NORMAL) {
+			a.type = GL_INT_2_10_10_10_REV;
+			a.normalized = GL_TRUE;
+			a.components = 4;
+			bytes = sizeof(uint32_t);
+		}
+		else if (location == V_ST) {
+			if (lo >= 0.0f && hi <= 1.0f) {
+				a.type = GL_UNSIGNED_SHORT;
+				a.normalized = GL_TRUE;
+				bytes = a.components * sizeof(uint16_t);
+			}
+		}
+		else if (location == V_COLOR) {
+			if (lo >= 0.0f && hi <= 1.0f) {
+				a.type = GL_UNSIGNED_BYTE;
+				a.normalized = GL_TRUE;
+				bytes = a.components;
+			}
+		}
+		a.offset = stride;
+		stride += (bytes + 3) & ~3;
+		attributes.push_back(a);
+	}
+}
+
+bool VertexFormat::matches(int sourceStride) const
+{
+	if (stride != sourceStride * (int)sizeof(float)) return false;
+	for (int i = 0; i < (int)attributes.size(); i++) {
+		const VertexAttribute &a = attributes[i];
+		if (a.type != GL_FLOAT || a.offset != a.source * (int)sizeof(float)) return false;
+	}
+	return true;
+}
+
+void VertexFormat::pack(const float *vertices, int numVertices, int sourceStride, unsigned char *packed) const
+{
+	for (int v = 0; v < numVertices; v++) {
+		const float *src = vertices + (size_t)v * sourceStride;
+		unsigned char *dst = packed + (size_t)v * stride;
+		memset(dst, 0, stride); // padding
+		for (int i = 0; i < (int)attributes.size(); i++) {
+			const VertexAttribute &a = attributes[i];
+			const float *in = src + a.source;
+			unsigned char *out = dst + a.offset;
+			if (a.type == GL_FLOAT) {
+				memcpy(out, in, a.components * sizeof(float));
+			}
+			else if (a.type == GL_HALF_FLOAT) {
+				uint16_t half[4];
+				for (int c = 0; c < a.components; c++) half[c] = floatToHalf(in[c]);
+				memcpy(out, half, a.components * sizeof(uint16_t));
+			}
+			else if (a.type == GL_INT_2_10_10_10_REV) {
+				glm::vec3 n(in[0], in[1], in[2]);
+				float length = glm::length(n);
+				if (length > 0.0f) n /= length;
+				uint32_t bits = 0;
+				for (int c = 0; c < 3; c++) {
+					int q = (int)lround(fmin(fmax(n[c], -1.0f), 1.0f) * 511.0f);
+					bits |= (uint32_t)(q & 0x3FF) << (10 * c);
+				}
+				memcpy(out, &bits, sizeof(bits));
+			}
+			else if (a.type == GL_UNSIGNED_SHORT) {
+				uint16_t q[4];
+				for (int c = 0; c < a.components; c++) q[c] = (uint16_t)lround(fmin(fmax(in[c], 0.0f), 1.0f) * 65535.0f);
+				memcpy(out, q, a.components * sizeof(uint16_t));
+			}
+			else if (a.type == GL_UNSIGNED_BYTE) {
+				for (int c = 0; c < a.components; c++) out[c] = (unsigned char)lround(fmin(fmax(in[c], 0.0f), 1.0f) * 255.0f);
+			}
+		}
+	}
+}
+
+void VertexFormat::bind(void) const
+{
+	for (int i = 0; i < (int)attributes.size(); i++) {
+		const VertexAttribute &a = attributes[i];
+		glEnableVertexAttribArray(a.location);
+		glVertexAttribPointer(a.location, a.components, a.type, a.normalized, stride, (void*)(size_t)a.offset);
+	}
+}
+
+void TriMesh::releaseCPUData(void)
+{
+	vector<float>().swap(vertexData);
+	vector<int>().swap(indices);
+	mappedCache.close();
+	mappedVertices = NULL;
+	mappedIndices = NULL;
+	mappedNumFloats = 0;
+}
+
+//-------------------------------------------------------------------------//
+
 bool TriMesh::sendToOpenGL(void)
 {
+	// upload from the mapped cache when streaming, else from the arrays
+	const float *vertexSrc = mappedVertices;
+	const int *indexSrc = mappedIndices;
+	size_t numFloats = mappedNumFloats;
+	if (vertexSrc == NULL) {
+		vertexSrc = vertexData.empty() ? NULL : &vertexData[0];
+		indexSrc = indices.empty() ? NULL : &indices[0];
+		numFloats = vertexData.size();
+	}
+
 	// Create vertex array object.  The vertex array object
 	// holds the structure of how the vertices are stored. VAOs
 	// also are bound for rendering.
@@ -602,45 +2682,78 @@ bool TriMesh::sendToOpenGL(void)
 	// Make and bind the vertex buffer object.  The vbo
 	// holds the raw data that will be indexed by the vao.
 	//
+	// The vertices are packed as the format says, which also tells the
+	// vertex array what kind of data it holds and where it is located in
+	// the vertex buffer.
+	//
+	int sourceStride = (int)attributes.size();
+	int numVertices = sourceStride ? (int)(numFloats / sourceStride) : 0;
+	format.choose(*this, vertexSrc, numVertices, gCompressVertices);
+	size_t vertexBytes = (size_t)numVertices * format.stride;
+	bool unpacked = format.matches(sourceStride);
+
 	GLuint vbo; // vertex buffer object
 	glGenBuffers(1, &vbo); // generate 1 buffer
 	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferData(GL_ARRAY_BUFFER, vertexData.size()*sizeof(float), &vertexData[0], GL_STATIC_DRAW);
-    
-	// At this point, we have to tell the vertex array what kind
-	// of data it holds, and where it is located in the vertex buffer.
-	// The code here uses the first field of four possible data types
-	// (position, normal, textureCoordinate, color)
-	//
-	int stride = (int)attributes.size() * sizeof(float); // size of a vertex in bytes
-    
-	for (int i = 0; i < (int)attributes.size(); i++) {
-		int bindIndex = -1;
-		//int numComponents = 0;
-        
-		if (attributes[i] == "x") bindIndex = V_POSITION;
-		else if (attributes[i] == "nx") bindIndex = V_NORMAL;
-		else if (attributes[i] == "s") bindIndex = V_ST;
-		else if (attributes[i] == "red") bindIndex = V_COLOR;
-        
-		if (bindIndex >= 0) {
-			//printf("bindIndex = %d\n", bindIndex);
-			glEnableVertexAttribArray(bindIndex);
-			glVertexAttribPointer(bindIndex, NUM_COMPONENTS[bindIndex],
-                                  GL_FLOAT, GL_FALSE, stride, (void*)(i * sizeof(float)));
+	if (unpacked || vertexBytes == 0) {
+		glBufferData(GL_ARRAY_BUFFER, vertexBytes, vertexSrc, GL_STATIC_DRAW);
+	}
+	else {
+		glBufferData(GL_ARRAY_BUFFER, vertexBytes, NULL, GL_STATIC_DRAW);
+		void *dst = glMapBufferRange(GL_ARRAY_BUFFER, 0, vertexBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (dst != NULL) {
+			format.pack(vertexSrc, numVertices, sourceStride, (unsigned char*)dst);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+		}
+		else {
+			vector<unsigned char> packed(vertexBytes);
+			format.pack(vertexSrc, numVertices, sourceStride, &packed[0]);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, vertexBytes, &packed[0]);
 		}
 	}
+	format.bind();
     
 	// unbind the VBO and VAO
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glBindVertexArray(0);
     
-	// Generate the index buffer
+	// Generate the index buffer, 16 bit if every index fits
+	int total = totalIndices();
 	glGenBuffers(1, &ibo);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(int),
-                 &indices[0], GL_STATIC_DRAW);
+	if (numVertices <= 65536) {
+		indexType = GL_UNSIGNED_SHORT;
+		indexSize = sizeof(uint16_t);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, total * sizeof(uint16_t), NULL, GL_STATIC_DRAW);
+		uint16_t *dst = total == 0 ? NULL : (uint16_t*)glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, 0,
+			total * sizeof(uint16_t), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (dst != NULL) {
+			for (int i = 0; i < total; i++) dst[i] = (uint16_t)indexSrc[i];
+			glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+		}
+		else if (total > 0) {
+			vector<uint16_t> shortIndices(indexSrc, indexSrc + total);
+			glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, total * sizeof(uint16_t), &shortIndices[0]);
+		}
+	}
+	else {
+		indexType = GL_UNSIGNED_INT;
+		indexSize = sizeof(int);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, total * sizeof(int),
+                     indexSrc, GL_STATIC_DRAW);
+	}
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0); // unbind
+
+	gMeshUploadStats.meshes++;
+	if (indexType == GL_UNSIGNED_SHORT) gMeshUploadStats.shortIndices++;
+	if (unpacked) gMeshUploadStats.unpacked++;
+	gMeshUploadStats.bytes += vertexBytes + (size_t)total * indexSize;
+	gMeshUploadStats.floatBytes += (numFloats + total) * sizeof(float);
+
+	if (gUseMeshlets) buildMeshlets(vertexSrc, indexSrc);
+
+	// the GPU has its own copy now
+	if (!keepCPUData) releaseCPUData();
     
 	return true;
 }
@@ -653,7 +2766,297 @@ void TriMesh::draw(void)
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo); // bind the indices
     
 	// draw the triangles.  modes: GL_TRIANGLES, GL_LINES, GL_POINTS
-	glDrawElements(GL_TRIANGLES, numIndices, GL_UNSIGNED_INT, (void*)0);
+	glDrawElements(GL_TRIANGLES, numIndices, indexType, (void*)0);
+}
+
+//-------------------------------------------------------------------------//
+// Mesh BVH
+//-------------------------------------------------------------------------//
+
+MeshBVH *TriMesh::getBVH(void)
+{
+	if (bvh == NULL) {
+		MeshBVH *built = new MeshBVH();
+		if (!built->build(*this)) {
+			delete built;
+			return NULL;
+		}
+		bvh = built;
+	}
+	return bvh;
+}
+
+static float boxArea(const glm::vec3 &lo, const glm::vec3 &hi)
+{
+	glm::vec3 d = hi - lo;
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// slab test, tNear is where the ray enters the box
+static inline bool rayHitsBox(const glm::vec3 &lo, const glm::vec3 &hi, const glm::vec3 &origin,
+	const glm::vec3 &invDir, float tMax, float &tNear)
+{
+	tNear = 0.0f;
+	float tFar = tMax;
+	for (int i = 0; i < 3; i++) {
+		float t0 = (lo[i] - origin[i]) * invDir[i];
+		float t1 = (hi[i] - origin[i]) * invDir[i];
+		if (t0 > t1) swap(t0, t1);
+		tNear = fmax(tNear, t0);
+		tFar = fmin(tFar, t1);
+	}
+	return tNear <= tFar;
+}
+
+// Moller-Trumbore, hitting either side
+static inline bool rayHitsTriangle(const glm::vec3 &origin, const glm::vec3 &dir, const glm::vec3 *corner,
+	float &t, float &u, float &v)
+{
+	glm::vec3 e1 = corner[1] - corner[0], e2 = corner[2] - corner[0];
+	glm::vec3 p = glm::cross(dir, e2);
+	float det = glm::dot(e1, p);
+	if (det == 0.0f) return false;
+	float invDet = 1.0f / det;
+	glm::vec3 s = origin - corner[0];
+	u = glm::dot(s, p) * invDet;
+	if (u < 0.0f || u > 1.0f) return false;
+	glm::vec3 q = glm::cross(s, e1);
+	v = glm::dot(dir, q) * invDet;
+	if (v < 0.0f || u + v > 1.0f) return false;
+	t = glm::dot(e2, q) * invDet;
+	return t >= 0.0f;
+}
+
+bool MeshBVH::build(const TriMesh &mesh)
+{
+	nodes.clear();
+	corners.clear();
+	triangles.clear();
+
+	const float *vertices = (mesh.mappedVertices != NULL) ? mesh.mappedVertices :
+		(mesh.vertexData.empty() ? NULL : &mesh.vertexData[0]);
+	const int *indices = (mesh.mappedIndices != NULL) ? mesh.mappedIndices :
+		(mesh.indices.empty() ? NULL : &mesh.indices[0]);
+	size_t numFloats = (mesh.mappedVertices != NULL) ? mesh.mappedNumFloats : mesh.vertexData.size();
+	int stride = (int)mesh.attributes.size();
+	int px = -1, py = -1, pz = -1;
+	for (int i = 0; i < stride; i++) {
+		if (mesh.attributes[i] == "x") px = i;
+		else if (mesh.attributes[i] == "y") py = i;
+		else if (mesh.attributes[i] == "z") pz = i;
+	}
+	if (vertices == NULL || indices == NULL || px < 0 || py < 0 || pz < 0) return false;
+	int numVertices = (int)(numFloats / stride);
+	int numTriangles = mesh.numIndices / 3;
+	if (numTriangles == 0) return false;
+
+	vector<glm::vec3> lo(numTriangles), hi(numTriangles), centroid(numTriangles);
+	vector<int> order(numTriangles);
+	for (int t = 0; t < numTriangles; t++) {
+		for (int k = 0; k < 3; k++) {
+			int index = indices[3 * t + k];
+			if (index < 0 || index >= numVertices) {
+				ERROR("mesh BVH: index out of range in " + mesh.name, false);
+				return false;
+			}
+			const float *v = vertices + (size_t)index * stride;
+			glm::vec3 p(v[px], v[py], v[pz]);
+			corners.push_back(p);
+			lo[t] = (k == 0) ? p : glm::min(lo[t], p);
+			hi[t] = (k == 0) ? p : glm::max(hi[t], p);
+		}
+		centroid[t] = (lo[t] + hi[t]) * 0.5f;
+		order[t] = t;
+	}
+
+	nodes.reserve(2 * numTriangles / MESH_BVH_LEAF_SIZE + 1);
+	buildNode(order, 0, numTriangles, 0, lo, hi, centroid);
+
+	// corners in leaf order
+	vector<glm::vec3> unordered;
+	unordered.swap(corners);
+	corners.resize(unordered.size());
+	for (int i = 0; i < numTriangles; i++) {
+		for (int k = 0; k < 3; k++) corners[3 * i + k] = unordered[3 * order[i] + k];
+	}
+	triangles.swap(order);
+	return true;
+}
+
+int MeshBVH::buildNode(vector<int> &order, int start, int count, int depth, const vector<glm::vec3> &lo,
+	const vector<glm::vec3> &hi, const vector<glm::vec3> &centroid)
+{
+	int index = (int)nodes.size();
+	nodes.push_back(MeshBVHNode());
+	glm::vec3 boxLo(FLT_MAX), boxHi(-FLT_MAX), centerLo(FLT_MAX), centerHi(-FLT_MAX);
+	for (int i = start; i < start + count; i++) {
+		int t = order[i];
+		boxLo = glm::min(boxLo, lo[t]);
+		boxHi = glm::max(boxHi, hi[t]);
+		centerLo = glm::min(centerLo, centroid[t]);
+		centerHi = glm::max(centerHi, centroid[t]);
+	}
+	nodes[index].lo = boxLo;
+	nodes[index].hi = boxHi;
+	nodes[index].start = start;
+	nodes[index].count = count;
+	if (count <= MESH_BVH_LEAF_SIZE || depth >= MESH_BVH_MAX_DEPTH) return index;
+
+	// bin the centroids along each axis and find the cheapest split between bins
+	float bestCost = FLT_MAX;
+	int bestAxis = -1, bestSplit = -1;
+	for (int axis = 0; axis < 3; axis++) {
+		float extent = centerHi[axis] - centerLo[axis];
+		if (extent <= 0.0f) continue;
+		float scale = MESH_BVH_BINS / extent;
+		int binCount[MESH_BVH_BINS];
+		glm::vec3 binLo[MESH_BVH_BINS], binHi[MESH_BVH_BINS];
+		for (int b = 0; b < MESH_BVH_BINS; b++) {
+			binCount[b] = 0;
+			binLo[b] = glm::vec3(FLT_MAX);
+			binHi[b] = glm::vec3(-FLT_MAX);
+		}
+		for (int i = start; i < start + count; i++) {
+			int t = order[i];
+			int b = min(MESH_BVH_BINS - 1, (int)((centroid[t][axis] - centerLo[axis]) * scale));
+			binCount[b]++;
+			binLo[b] = glm::min(binLo[b], lo[t]);
+			binHi[b] = glm::max(binHi[b], hi[t]);
+		}
+
+		// right side areas from a sweep down, then the left side on the way up
+		float rightArea[MESH_BVH_BINS];
+		int rightCount[MESH_BVH_BINS];
+		glm::vec3 sideLo(FLT_MAX), sideHi(-FLT_MAX);
+		int sideCount = 0;
+		for (int b = MESH_BVH_BINS - 1; b > 0; b--) {
+			sideCount += binCount[b];
+			sideLo = glm::min(sideLo, binLo[b]);
+			sideHi = glm::max(sideHi, binHi[b]);
+			rightCount[b] = sideCount;
+			rightArea[b] = sideCount ? boxArea(sideLo, sideHi) : 0.0f;
+		}
+		sideLo = glm::vec3(FLT_MAX);
+		sideHi = glm::vec3(-FLT_MAX);
+		sideCount = 0;
+		for (int b = 0; b < MESH_BVH_BINS - 1; b++) {
+			sideCount += binCount[b];
+			sideLo = glm::min(sideLo, binLo[b]);
+			sideHi = glm::max(sideHi, binHi[b]);
+			if (sideCount == 0 || rightCount[b + 1] == 0) continue;
+			float cost = boxArea(sideLo, sideHi) * sideCount + rightArea[b + 1] * rightCount[b + 1];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = b;
+			}
+		}
+	}
+
+	// a split costs a box test plus its children's triangles weighted by
+	// the chance of reaching them, a leaf costs all of its triangles
+	float area = boxArea(boxLo, boxHi);
+	float splitCost = (area > 0.0f) ? 1.0f + bestCost / area : 1.0f;
+	int mid;
+	if (bestAxis >= 0 && (splitCost < count || count > MESH_BVH_MAX_LEAF)) {
+		float scale = MESH_BVH_BINS / (centerHi[bestAxis] - centerLo[bestAxis]);
+		float base = centerLo[bestAxis];
+		mid = (int)(partition(order.begin() + start, order.begin() + start + count, [&](int t) {
+			return min(MESH_BVH_BINS - 1, (int)((centroid[t][bestAxis] - base) * scale)) <= bestSplit;
+		}) - order.begin());
+	}
+	else if (count > MESH_BVH_MAX_LEAF) {
+		mid = start + count / 2; // every centroid in one spot, any split will do
+	}
+	else return index;
+
+	nodes[index].count = 0;
+	buildNode(order, start, mid - start, depth + 1, lo, hi, centroid); // lands at index + 1
+	int right = buildNode(order, mid, start + count - mid, depth + 1, lo, hi, centroid);
+	nodes[index].start = right;
+	return index;
+}
+
+bool MeshBVH::trace(MeshRay &ray, bool anyHit) const
+{
+	ray.t = ray.maxDist;
+	ray.triangle = -1;
+	if (nodes.empty()) return false;
+	glm::vec3 invDir;
+	for (int i = 0; i < 3; i++) invDir[i] = (ray.dir[i] != 0.0f) ? 1.0f / ray.dir[i] : FLT_MAX;
+
+	int stack[MESH_BVH_MAX_DEPTH + 2];
+	int top = 0;
+	float tNear;
+	if (!rayHitsBox(nodes[0].lo, nodes[0].hi, ray.origin, invDir, ray.t, tNear)) return false;
+	stack[top++] = 0;
+	while (top > 0) {
+		int index = stack[--top];
+		const MeshBVHNode &n = nodes[index];
+		if (n.count > 0) {
+			for (int i = n.start; i < n.start + n.count; i++) {
+				float t, u, v;
+				if (!rayHitsTriangle(ray.origin, ray.dir, &corners[3 * i], t, u, v) || t >= ray.t) continue;
+				ray.t = t;
+				ray.triangle = triangles[i];
+				ray.u = u;
+				ray.v = v;
+				if (anyHit) return true;
+			}
+			continue;
+		}
+
+		// nearer child on top, skipping children the ray misses or reaches too late
+		int left = index + 1, right = n.start;
+		float tLeft, tRight;
+		bool hitLeft = rayHitsBox(nodes[left].lo, nodes[left].hi, ray.origin, invDir, ray.t, tLeft);
+		bool hitRight = rayHitsBox(nodes[right].lo, nodes[right].hi, ray.origin, invDir, ray.t, tRight);
+		if (hitLeft && hitRight) {
+			if (tLeft <= tRight) {
+				stack[top++] = right;
+				stack[top++] = left;
+			}
+			else {
+				stack[top++] = left;
+				stack[top++] = right;
+			}
+		}
+		else if (hitLeft) stack[top++] = left;
+		else if (hitRight) stack[top++] = right;
+	}
+	return ray.triangle >= 0;
+}
+
+bool MeshBVH::intersect(MeshRay &ray) const
+{
+	return trace(ray, false);
+}
+
+bool MeshBVH::occluded(const glm::vec3 &from, const glm::vec3 &to) const
+{
+	MeshRay ray;
+	ray.origin = from;
+	ray.dir = to - from;
+	ray.maxDist = 1.0f;
+	return trace(ray, true);
+}
+
+int MeshBVH::intersect(vector<MeshRay> &rays, const glm::mat4x4 &worldInverse) const
+{
+	int hits = 0;
+	MeshRay local;
+	for (int i = 0; i < (int)rays.size(); i++) {
+		MeshRay &ray = rays[i];
+		local.origin = glm::vec3(worldInverse * glm::vec4(ray.origin, 1.0f));
+		local.dir = glm::vec3(worldInverse * glm::vec4(ray.dir, 0.0f));
+		local.maxDist = ray.maxDist;
+		if (trace(local, false)) hits++;
+		ray.t = local.t;
+		ray.triangle = local.triangle;
+		ray.u = local.u;
+		ray.v = local.v;
+	}
+	return hits;
 }
 
 //-------------------------------------------------------------------------//
@@ -722,6 +3125,7 @@ void Billboard::fixScale(){
 GLuint gLightBufferObject = NULL_HANDLE;
 int gNumLights = 0;
 Light gLights[MAX_LIGHTS];
+bool gLightsChanged = true;
 
 void initLightBuffer() 
 {
@@ -731,6 +3135,488 @@ void initLightBuffer()
 	glBindBuffer(GL_UNIFORM_BUFFER, gLightBufferObject); // bind the new buffer
 	glBufferData(GL_UNIFORM_BUFFER, sizeof(Light) * MAX_LIGHTS, gLights, GL_STREAM_DRAW);
 	glBindBuffer(GL_UNIFORM_BUFFER, 0); // unbind buffer
+	glBindBufferBase(GL_UNIFORM_BUFFER, LIGHT_BUFFER_ID, gLightBufferObject);
+}
+
+//-------------------------------------------------------------------------//
+// Clustered lights
+//-------------------------------------------------------------------------//
+
+vector<Light> gClusterLights;
+bool gUseClusteredLights = true;
+set<GLuint> gClusterPrograms;
+
+static const char *CLUSTER_INCLUDE_SOURCE =
+	"// built in: clustered lights, filled by ClusterGrid every frame\n"
+	"layout(std140) uniform Clusters { vec4 clusterScale; vec4 clusterDepth; ivec4 clusterDims; };\n"
+	"uniform samplerBuffer uClusterLights;\n"
+	"uniform usamplerBuffer uClusterRanges;\n"
+	"uniform usamplerBuffer uClusterIndices;\n"
+	"struct ClusterLight { vec4 position, direction, color, attenuation, coneAngles; };\n"
+	"ClusterLight clusterLight(int i) {\n"
+	"	ClusterLight L;\n"
+	"	L.position = texelFetch(uClusterLights, 5 * i);\n"
+	"	L.direction = texelFetch(uClusterLights, 5 * i + 1);\n"
+	"	L.color = texelFetch(uClusterLights, 5 * i + 2);\n"
+	"	L.attenuation = texelFetch(uClusterLights, 5 * i + 3);\n"
+	"	L.coneAngles = texelFetch(uClusterLights, 5 * i + 4);\n"
+	"	return L;\n"
+	"}\n"
+	"// lights 0 .. numGlobalLights() - 1 reach every fragment\n"
+	"int numGlobalLights() { return clusterDims.w; }\n"
+	"// offset and count in uClusterIndices of the lights for this fragment\n"
+	"uvec2 clusterRange(vec4 fragCoord) {\n"
+	"	float n = clusterDepth.x, f = clusterDepth.y;\n"
+	"	float depth = 2.0 * n * f / (f + n - (2.0 * fragCoord.z - 1.0) * (f - n));\n"
+	"	ivec3 c = ivec3(floor(vec3(fragCoord.xy * clusterScale.xy, log(depth) * clusterScale.z + clusterScale.w)));\n"
+	"	c = clamp(c, ivec3(0), clusterDims.xyz - 1);\n"
+	"	return texelFetch(uClusterRanges, (c.z * clusterDims.y + c.y) * clusterDims.x + c.x).xy;\n"
+	"}\n"
+	"int clusterLightIndex(uint i) { return int(texelFetch(uClusterIndices, int(i)).r); }\n";
+
+// distance at which a light falls below CLUSTER_LIGHT_CUTOFF, -1 if it never does
+static float lightCutoffRange(const Light &light)
+{
+	float brightest = fmax(light.color.r, fmax(light.color.g, light.color.b));
+	float c = light.attenuation.x, l = light.attenuation.y, q = light.attenuation.z;
+	float k = brightest / CLUSTER_LIGHT_CUTOFF; // c + l d + q d^2 at the range
+	if (k <= c) return 0.0f;
+	if (q > 0.0f) return (-l + sqrt(l * l + 4.0f * q * (k - c))) / (2.0f * q);
+	if (l > 0.0f) return (k - c) / l;
+	return -1.0f;
+}
+
+ClusterGrid::ClusterGrid(void)
+{
+	uniformBuffer = lightBuffer = rangeBuffer = indexBuffer = NULL_HANDLE;
+	textures[0] = textures[1] = textures[2] = NULL_HANDLE;
+	lastFovy = lastAspect = -1.0f;
+	memset(&stats, 0, sizeof(stats));
+}
+
+// planes through the eye at each tile boundary, normalized so a*x + b*z is
+// the signed distance of a view space point, positive towards higher tiles
+void ClusterGrid::buildPlanes(float fovy, float aspect)
+{
+	if (fovy == lastFovy && aspect == lastAspect) return;
+	lastFovy = fovy;
+	lastAspect = aspect;
+	float tanY = tan(fovy * 0.5f), tanX = tanY * aspect;
+	int tiles[2] = { CLUSTER_X, CLUSTER_Y };
+	float tans[2] = { tanX, tanY };
+	vector<float> *boundaries[2] = { boundaryX, boundaryY };
+	for (int axis = 0; axis < 2; axis++) {
+		int n = tiles[axis] + 1;
+		boundaries[axis][0].assign((n + 3) & ~3, 0.0f);
+		boundaries[axis][1].assign((n + 3) & ~3, 0.0f);
+		for (int i = 0; i < n; i++) {
+			float slope = (-1.0f + 2.0f * i / tiles[axis]) * tans[axis];
+			float norm = 1.0f / sqrt(1.0f + slope * slope);
+			boundaries[axis][0][i] = norm;
+			boundaries[axis][1][i] = slope * norm;
+		}
+	}
+}
+
+// the range of tiles along one axis that a sphere at (p, z) touches
+static void tileRange(const vector<float> *boundary, int numTiles, float p, float z, float r, int &first, int &last)
+{
+	// distances fall as the index rises, so count planes the sphere is
+	// entirely above (k) and planes it reaches above (m)
+	int n = numTiles + 1;
+	int above = 0, reaches = 0;
+#ifdef USE_SSE
+	static const int bits[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+	__m128 pp = _mm_set1_ps(p), zz = _mm_set1_ps(z), rr = _mm_set1_ps(r), negR = _mm_set1_ps(-r);
+	for (int i = 0; i < n; i += 4) {
+		__m128 d = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&boundary[0][i]), pp), _mm_mul_ps(_mm_loadu_ps(&boundary[1][i]), zz));
+		int valid = (n - i >= 4) ? 15 : (1 << (n - i)) - 1;
+		above += bits[_mm_movemask_ps(_mm_cmpgt_ps(d, rr)) & valid];
+		reaches += bits[_mm_movemask_ps(_mm_cmpge_ps(d, negR)) & valid];
+	}
+#else
+	for (int i = 0; i < n; i++) {
+		float d = boundary[0][i] * p + boundary[1][i] * z;
+		above += (d > r);
+		reaches += (d >= -r);
+	}
+#endif
+	first = max(above - 1, 0);
+	last = min(reaches - 1, numTiles - 1);
+}
+
+void ClusterGrid::assign(const Camera &camera, const vector<Light> &lights)
+{
+	buildPlanes(camera.fovy, camera.aspect);
+	glm::mat4x4 worldView = glm::lookAt(camera.eye, camera.center, camera.vup);
+	float zNear = camera.znear, zFar = camera.zfar;
+	float sliceScale = CLUSTER_Z / log(zFar / zNear);
+
+	// sphere of each clustered light, which follow the globals in lightData
+	offset.assign(CLUSTER_COUNT, 0);
+	count.assign(CLUSTER_COUNT, 0);
+	int numClustered = (int)lightData.size() / 5 - stats.globalLights;
+	lightRange.assign(6 * numClustered, -1);
+	int slot = 0;
+	for (int i = 0; i < (int)lights.size(); i++) {
+		const Light &light = lights[i];
+		int type = (int)light.attenuation.w;
+		float r = lightCutoffRange(light);
+		if ((type != POINT_LIGHT && type != SPOT_LIGHT) || r <= 0.0f) continue;
+		int *range = &lightRange[6 * slot++];
+		glm::vec4 c = worldView * glm::vec4(glm::vec3(light.position), 1.0f);
+		float nearest = -c.z - r, farthest = -c.z + r;
+		if (farthest < zNear || nearest > zFar) continue;
+		int z0 = (nearest <= zNear) ? 0 : (int)(log(nearest / zNear) * sliceScale);
+		int z1 = (farthest >= zFar) ? CLUSTER_Z - 1 : (int)(log(farthest / zNear) * sliceScale);
+		int x0 = 0, x1 = CLUSTER_X - 1, y0 = 0, y1 = CLUSTER_Y - 1;
+		if (c.z + r < 0.0f) { // the tile planes only mean something in front of the eye
+			tileRange(boundaryX, CLUSTER_X, c.x, c.z, r, x0, x1);
+			tileRange(boundaryY, CLUSTER_Y, c.y, c.z, r, y0, y1);
+		}
+		if (x0 > x1 || y0 > y1) continue;
+		range[0] = x0; range[1] = x1; range[2] = y0; range[3] = y1;
+		range[4] = max(z0, 0); range[5] = min(z1, CLUSTER_Z - 1);
+		for (int z = range[4]; z <= range[5]; z++) {
+			for (int y = y0; y <= y1; y++) {
+				for (int x = x0; x <= x1; x++) count[(z * CLUSTER_Y + y) * CLUSTER_X + x]++;
+			}
+		}
+	}
+
+	// capped lists, packed by prefix sum
+	unsigned int total = 0;
+	stats.maxPerCluster = stats.overflows = 0;
+	for (int i = 0; i < CLUSTER_COUNT; i++) {
+		if (count[i] > CLUSTER_MAX_LIGHTS) {
+			count[i] = CLUSTER_MAX_LIGHTS;
+			stats.overflows++;
+		}
+		offset[i] = total;
+		total += count[i];
+		stats.maxPerCluster = max(stats.maxPerCluster, (int)count[i]);
+		count[i] = 0;
+	}
+	indices.resize(total);
+	for (int k = 0; k < numClustered; k++) {
+		const int *range = &lightRange[6 * k];
+		if (range[0] < 0) continue;
+		for (int z = range[4]; z <= range[5]; z++) {
+			for (int y = range[2]; y <= range[3]; y++) {
+				for (int x = range[0]; x <= range[1]; x++) {
+					int cluster = (z * CLUSTER_Y + y) * CLUSTER_X + x;
+					unsigned int end = (cluster + 1 < CLUSTER_COUNT) ? offset[cluster + 1] : total;
+					if (offset[cluster] + count[cluster] == end) continue; // capped
+					indices[offset[cluster] + count[cluster]++] = stats.globalLights + k;
+				}
+			}
+		}
+	}
+	stats.references = (int)total;
+}
+
+void ClusterGrid::upload(bool lightsChanged)
+{
+	if (uniformBuffer == NULL_HANDLE) {
+		glGenBuffers(1, &uniformBuffer);
+		glGenBuffers(1, &lightBuffer);
+		glGenBuffers(1, &rangeBuffer);
+		glGenBuffers(1, &indexBuffer);
+		glGenTextures(3, textures);
+		lightsChanged = true;
+	}
+	if (lightsChanged) {
+		glBindBuffer(GL_TEXTURE_BUFFER, lightBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, max((size_t)1, lightData.size()) * sizeof(glm::vec4),
+			lightData.empty() ? NULL : &lightData[0], GL_STATIC_DRAW);
+	}
+
+	// offset and count side by side, then the indices; both orphaned each frame
+	rangeData.resize(2 * CLUSTER_COUNT);
+	for (int i = 0; i < CLUSTER_COUNT; i++) {
+		rangeData[2 * i] = offset[i];
+		rangeData[2 * i + 1] = count[i];
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, rangeBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, rangeData.size() * sizeof(unsigned int), &rangeData[0], GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, indexBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, max((size_t)1, indices.size()) * sizeof(unsigned int),
+		indices.empty() ? NULL : &indices[0], GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	GLuint buffers[3] = { lightBuffer, rangeBuffer, indexBuffer };
+	GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+	for (int i = 0; i < 3; i++) {
+		glActiveTexture(GL_TEXTURE0 + CLUSTER_TEXTURE_UNIT + i);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+		if (lightsChanged) glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+	}
+	glActiveTexture(GL_TEXTURE0);
+}
+
+void ClusterGrid::update(const Camera &camera, const vector<Light> &lights, bool lightsChanged)
+{
+	double start = WALL_TIME();
+
+	// globals first, so shaders can loop over them before the cluster's list
+	if (lightsChanged || uniformBuffer == NULL_HANDLE) {
+		lightData.clear();
+		stats.lights = (int)lights.size();
+		stats.globalLights = stats.culledLights = 0;
+		for (int pass = 0; pass < 2; pass++) {
+			for (int i = 0; i < (int)lights.size(); i++) {
+				const Light &light = lights[i];
+				int type = (int)light.attenuation.w;
+				float r = lightCutoffRange(light);
+				bool global = (type != POINT_LIGHT && type != SPOT_LIGHT) || r < 0.0f;
+				if (pass == 0 && r == 0.0f && !global) stats.culledLights++; // never bright enough to matter
+				if ((pass == 0) != global || (!global && r == 0.0f)) continue;
+				if (global) stats.globalLights++;
+				glm::vec4 texels[5] = { light.position, light.direction, light.color, light.attenuation, light.coneAngles };
+				lightData.insert(lightData.end(), texels, texels + 5);
+			}
+		}
+	}
+	assign(camera, lights);
+	upload(lightsChanged);
+
+	struct {
+		glm::vec4 scale, depth;
+		int dims[4];
+	} block;
+	float logRatio = log(camera.zfar / camera.znear);
+	float width = camera.viewportHeight * camera.aspect;
+	block.scale = glm::vec4(CLUSTER_X / fmax(width, 1.0f), CLUSTER_Y / fmax(camera.viewportHeight, 1.0f),
+		CLUSTER_Z / logRatio, -CLUSTER_Z * log(camera.znear) / logRatio);
+	block.depth = glm::vec4(camera.znear, camera.zfar, 0, 0);
+	block.dims[0] = CLUSTER_X;
+	block.dims[1] = CLUSTER_Y;
+	block.dims[2] = CLUSTER_Z;
+	block.dims[3] = stats.globalLights;
+	if (gUseFrameData) gFrameData.bind(CLUSTER_BUFFER_ID, &block, sizeof(block));
+	else {
+		glBindBuffer(GL_UNIFORM_BUFFER, uniformBuffer);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(block), &block, GL_STREAM_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glBindBufferBase(GL_UNIFORM_BUFFER, CLUSTER_BUFFER_ID, uniformBuffer);
+	}
+
+	stats.assignTime = WALL_TIME() - start;
+}
+
+//-------------------------------------------------------------------------//
+// Frame data
+//-------------------------------------------------------------------------//
+
+bool gUseFrameData = true;
+bool gPersistentFrameData = true;
+FrameAllocator gFrameData;
+
+#define FRAME_STRING(x) #x
+#define FRAME_NUMBER(x) FRAME_STRING(x)
+
+static const char *FRAME_INCLUDE_SOURCE =
+	"// built in: per-frame constants, written through gFrameData\n"
+	"layout(std140) uniform Camera {\n"
+	"	mat4 uViewPerspectM;\n"
+	"	vec4 uView; // towards the eye, w = 0\n"
+	"	vec4 uEye;\n"
+	"};\n"
+	"struct ObjectData { mat4 world, worldInverse, worldViewPerspect; };\n"
+	"layout(std140) uniform Object { ObjectData objects[" FRAME_NUMBER(FRAME_OBJECT_BATCH) "]; };\n"
+	"uniform int uObjectIndex;\n"
+	"#define uObjectWorldM objects[uObjectIndex].world\n"
+	"#define uObjectWorldInverseM objects[uObjectIndex].worldInverse\n"
+	"#define uObjectPerpsectM objects[uObjectIndex].worldViewPerspect\n";
+
+const char *getBuiltinInclude(const string &fileName)
+{
+	if (fileName == CLUSTER_INCLUDE) return CLUSTER_INCLUDE_SOURCE;
+	if (fileName == FRAME_INCLUDE) return FRAME_INCLUDE_SOURCE;
+	return NULL;
+}
+
+FrameAllocator::FrameAllocator(void)
+{
+	buffer = NULL_HANDLE;
+	mapped = NULL;
+	regionSize = head = end = 0;
+	alignment = 256;
+	for (int i = 0; i < FRAMES_IN_FLIGHT; i++) fences[i] = NULL;
+	region = 0;
+	objectOffset = 0;
+	numObjects = FRAME_OBJECT_BATCH;
+}
+
+void FrameAllocator::release(void)
+{
+	retire();
+	for (int i = 0; i < (int)retired.size(); i++) {
+		// draws already queued keep the old storage alive until they finish
+		if (retired[i].fence != NULL) glDeleteSync(retired[i].fence);
+		glDeleteBuffers(1, &retired[i].buffer);
+	}
+	retired.clear();
+	regionSize = head = end = 0;
+	region = 0;
+	numObjects = FRAME_OBJECT_BATCH;
+}
+
+// stops allocating from the buffer, which is deleted once the frames using it are done
+void FrameAllocator::retire(void)
+{
+	for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+		if (fences[i] != NULL) glDeleteSync(fences[i]);
+		fences[i] = NULL;
+	}
+	if (buffer == NULL_HANDLE) return;
+	if (mapped != NULL) {
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		glUnmapBuffer(GL_UNIFORM_BUFFER);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+	RetiredBuffer old = { buffer, NULL };
+	retired.push_back(old);
+	buffer = NULL_HANDLE;
+	mapped = NULL;
+}
+
+// a new buffer for the current region onwards, the old one must be retired
+void FrameAllocator::create(GLsizeiptr size)
+{
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	if (alignment < 1) alignment = 256;
+	regionSize = size;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	if (gPersistentFrameData && GLEW_ARB_buffer_storage) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_UNIFORM_BUFFER, size * FRAMES_IN_FLIGHT, NULL, flags);
+		mapped = (unsigned char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, size * FRAMES_IN_FLIGHT, flags);
+		if (mapped == NULL) ERROR("could not map the frame data buffer", false);
+	}
+	if (mapped == NULL) glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	head = (mapped != NULL) ? region * size : 0;
+	end = head + size;
+}
+
+void FrameAllocator::beginFrame(void)
+{
+	for (int i = 0; i < (int)retired.size(); i++) {
+		GLsync fence = retired[i].fence;
+		if (fence == NULL || glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) continue;
+		glDeleteSync(fence);
+		glDeleteBuffers(1, &retired[i].buffer);
+		retired.erase(retired.begin() + i--);
+	}
+	if (buffer == NULL_HANDLE) create(FRAME_BUFFER_SIZE);
+	if (mapped == NULL) {
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		glBufferData(GL_UNIFORM_BUFFER, regionSize, NULL, GL_STREAM_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		head = 0;
+		end = regionSize;
+		numObjects = FRAME_OBJECT_BATCH;
+		return;
+	}
+
+	region = (region + 1) % FRAMES_IN_FLIGHT;
+	GLsync fence = fences[region];
+	if (fence != NULL) {
+		if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+			double start = WALL_TIME();
+			while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+			stats.stallTime += WALL_TIME() - start;
+			stats.stalls++;
+		}
+		glDeleteSync(fence);
+		fences[region] = NULL;
+	}
+	head = region * regionSize;
+	end = head + regionSize;
+	numObjects = FRAME_OBJECT_BATCH;
+}
+
+void FrameAllocator::endFrame(void)
+{
+	for (int i = 0; i < (int)retired.size(); i++) {
+		if (retired[i].fence == NULL) retired[i].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+	if (mapped == NULL) return;
+	if (fences[region] != NULL) glDeleteSync(fences[region]);
+	fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// aligned space for bytes in this frame's region, in a bigger buffer if it is full
+GLsizeiptr FrameAllocator::allocate(GLsizeiptr bytes)
+{
+	if (buffer == NULL_HANDLE) create(FRAME_BUFFER_SIZE);
+	GLsizeiptr offset = (head + alignment - 1) / alignment * alignment;
+	if (offset + bytes > end) {
+		// this frame's blocks so far stay bound in the old buffer, and the
+		// Object block is started over in the new one
+		GLsizeiptr size = regionSize;
+		while (size < FRAME_BUFFER_MAX_SIZE && size < 2 * regionSize) size *= 2;
+		while (size < bytes) size *= 2;
+		retire();
+		create(size);
+		stats.grows++;
+		numObjects = FRAME_OBJECT_BATCH;
+		offset = head;
+	}
+	head = offset + bytes;
+	return offset;
+}
+
+void FrameAllocator::write(GLsizeiptr offset, const void *data, GLsizeiptr bytes)
+{
+	if (mapped != NULL) memcpy(mapped + offset, data, bytes);
+	else {
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, offset, bytes, data);
+	}
+	stats.bytes += bytes;
+}
+
+void FrameAllocator::bind(GLuint index, const void *data, GLsizeiptr bytes)
+{
+	GLsizeiptr offset = allocate(bytes);
+	write(offset, data, bytes);
+	glBindBufferRange(GL_UNIFORM_BUFFER, index, buffer, offset, bytes);
+}
+
+int FrameAllocator::bindObject(const glm::mat4x4 matrices[3])
+{
+	// a new block is bound only every FRAME_OBJECT_BATCH objects; draws
+	// already queued read their own slots of it
+	GLsizeiptr stride = 3 * sizeof(glm::mat4x4);
+	if (numObjects == FRAME_OBJECT_BATCH || buffer == NULL_HANDLE) {
+		objectOffset = allocate(FRAME_OBJECT_BATCH * stride);
+		numObjects = 0;
+		glBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BUFFER_ID, buffer, objectOffset, FRAME_OBJECT_BATCH * stride);
+	}
+	write(objectOffset + numObjects * stride, matrices, stride);
+	return numObjects++;
+}
+
+void bindCameraData(const Camera &camera)
+{
+	struct {
+		glm::mat4x4 viewPerspect;
+		glm::vec4 view, eye;
+	} block;
+	block.viewPerspect = camera.worldViewProject;
+	block.view = glm::vec4(glm::normalize(camera.eye - camera.center), 0);
+	block.eye = glm::vec4(camera.eye, 1);
+	gFrameData.bind(CAMERA_BUFFER_ID, &block, sizeof(block));
+}
+
+void bindObjectData(ShaderProgram *p, const Camera &camera, const glm::mat4x4 &world, const glm::mat4x4 &worldInverse)
+{
+	if (!gUseFrameData || p->uObjectIndex == -1) return;
+	glm::mat4x4 matrices[3] = { world, worldInverse, camera.worldViewProject * world };
+	glUniform1i(p->uObjectIndex, gFrameData.bindObject(matrices));
 }
 //-------------------------------------------------------------------------//
 // Node Stuff
@@ -782,84 +3668,1369 @@ void Node::draw(Camera &camera)
     else printf("Error! Null Mesh.");
 }
 
+glm::mat4x4 Node::getWorldTransform(void)
+{
+    this->meshInst->T.refreshTransform();
+    if (this->parent == NULL) return this->meshInst->T.transform;
+    return this->parent->getWorldTransform() * this->meshInst->T.transform;
+}
+
 void Material::bindNodeMaterial(Node* node, Camera &camera)
 {
     glUseProgram(shaderProgram);
+    ShaderProgram *p = getProgram();
+    if (p == NULL) return;
     
-    GLint loc;
+    glm::mat4x4 world = node->getWorldTransform();
+    glm::mat4x4 worldInverse = glm::inverse(world);
     
-    
-    if(node->parent == NULL)
-    {
-        loc = glGetUniformLocation(shaderProgram, "uObjectWorldM");
-        if (loc != -1) glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(node->meshInst->T.transform));
-        //
-        loc = glGetUniformLocation(shaderProgram, "uObjectWorldInverseM");
-        if (loc != -1) glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(node->meshInst->T.invTransform));
-        //
-        glm::mat4x4 objectWorldViewPerspect = camera.worldViewProject * node->meshInst->T.transform;
-        loc = glGetUniformLocation(shaderProgram, "uObjectPerpsectM");
-        if (loc != -1) glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(objectWorldViewPerspect));
-        
-        
-    }
-    else
-    {
-        loc = glGetUniformLocation(shaderProgram, "uObjectWorldM");
-        if (loc != -1) glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(node->parent->meshInst->T.transform * node->meshInst->T.transform ));
-        //
-        loc = glGetUniformLocation(shaderProgram, "uObjectWorldInverseM");
-        if (loc != -1) glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(node->meshInst->T.invTransform * node->parent->meshInst->T.invTransform));
-        //
-        glm::mat4x4 objectWorldViewPerspect = camera.worldViewProject * node->parent->meshInst->T.transform * node->meshInst->T.transform;
-        loc = glGetUniformLocation(shaderProgram, "uObjectPerpsectM");
-        if (loc != -1) glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(objectWorldViewPerspect));
-        
-        node->meshInst->T.transform = node->parent->meshInst->T.transform * node->meshInst->T.transform;
-        
-        if(node->name == "childofChild")
-        {
-            
-        }
+    if (p->uObjectWorldM != -1) glUniformMatrix4fv(p->uObjectWorldM, 1, GL_FALSE, glm::value_ptr(world));
+    //
+    if (p->uObjectWorldInverseM != -1) glUniformMatrix4fv(p->uObjectWorldInverseM, 1, GL_FALSE, glm::value_ptr(worldInverse));
+    //
+    if (p->uObjectPerpsectM != -1) {
+        glm::mat4x4 objectWorldViewPerspect = camera.worldViewProject * world;
+        glUniformMatrix4fv(p->uObjectPerpsectM, 1, GL_FALSE, glm::value_ptr(objectWorldViewPerspect));
     }
     
-    // MATERIAL COLORS
-    for (int i = 0; i < (int) colors.size(); i++) {
-        if (colors[i].id == -1) {
-            loc = glGetUniformLocation(shaderProgram, colors[i].name.c_str());
-            colors[i].id = loc;
-        }
-        if (colors[i].id >= 0) {
-            glUniform4fv(colors[i].id, 1, &colors[i].val[0]);
-        }
+    if (p->uView != -1) {
+        glm::vec4 cameraNormal = glm::vec4(glm::normalize(camera.eye - camera.center), 0);
+        glUniform4fv(p->uView, 1, glm::value_ptr(cameraNormal));
     }
+    bindObjectData(p, camera, world, worldInverse);
     
-    loc = glGetUniformLocation(shaderProgram, "uView");
-    
-    glm::vec4 cameraNormal = glm::vec4(glm::normalize(camera.eye - camera.center), 0);
-    
-    if(loc != 0) glUniform4fv(loc, 1, glm::value_ptr(cameraNormal));
+    bindColorsAndTextures(p);
+}
+
+
+
+
+
+
+//-------------------------------------------------------------------------//
+// Transform Hierarchy
+//-------------------------------------------------------------------------//
+
+void TransformHierarchy::build(map<string, Node*> &sceneNodes)
+{
+	nodes.clear();
+	parents.clear();
+
+	// same order the scene has always drawn in: roots by name, then children
+	for (auto& x : sceneNodes) {
+		if (x.second->parent == NULL) addSubtree(x.second, -1);
+	}
+
+	worlds.resize(nodes.size());
+	worldInverses.resize(nodes.size());
+	dirty.assign(nodes.size(), 1);
+	versions.assign(nodes.size(), 0);
+	rebuilt = true;
+}
+
+void TransformHierarchy::addSubtree(Node *node, int parent)
+{
+	int index = (int)nodes.size();
+	node->transformIndex = index;
+	nodes.push_back(node);
+	parents.push_back(parent);
+	for (int i = 0; i < (int)node->children.size(); i++) {
+		addSubtree(node->children[i], index);
+	}
+}
+
+int TransformHierarchy::update(void)
+{
+	int numUpdated = 0;
+	for (int i = 0; i < (int)nodes.size(); i++) {
+		Transform &T = nodes[i]->meshInst->T;
+		int parent = parents[i];
+
+		// a fresh build leaves everything dirty once.  Rotations and scripts
+		// refresh transforms themselves, so the version says what changed,
+		// not refreshTransform's return value.
+		T.refreshTransform();
+		bool changed = (T.version != versions[i]) || rebuilt;
+		versions[i] = T.version;
+		if (parent >= 0 && dirty[parent]) changed = true;
+		dirty[i] = changed;
+		if (!changed) continue;
+
+		if (parent >= 0) {
+			worlds[i] = worlds[parent] * T.transform;
+			worldInverses[i] = T.invTransform * worldInverses[parent];
+		}
+		else {
+			worlds[i] = T.transform;
+			worldInverses[i] = T.invTransform;
+		}
+		numUpdated++;
+	}
+	rebuilt = false;
+	return numUpdated;
+}
+
+//-------------------------------------------------------------------------//
+// Frustum Culling
+//-------------------------------------------------------------------------//
+
+void FrustumCuller::update(TransformHierarchy &hierarchy)
+{
+	int n = hierarchy.size();
+	int padded = (n + 3) & ~3;
+	bool resized = ((int)meshes.size() != n);
+	if (resized) {
+		centerX.assign(padded, 0.0f);
+		centerY.assign(padded, 0.0f);
+		centerZ.assign(padded, 0.0f);
+		radius.assign(padded, 0.0f);
+		meshes.assign(n, NULL);
+		visible.assign(padded, 1);
+	}
+
+	for (int i = 0; i < n; i++) {
+		TriMesh *mesh = hierarchy.nodes[i]->meshInst->triMesh;
+		if (!resized && !hierarchy.dirty[i] && mesh == meshes[i]) continue;
+		meshes[i] = mesh;
+
+		// no bounds means never culled
+		if (mesh == NULL || mesh->sphereRadius < 0.0f) {
+			centerX[i] = centerY[i] = centerZ[i] = 0.0f;
+			radius[i] = FLT_MAX;
+			continue;
+		}
+
+		// the sphere grows by the largest axis scale of the world matrix
+		const glm::mat4x4 &world = hierarchy.worlds[i];
+		glm::vec4 center = world * glm::vec4(mesh->sphereCenter, 1.0f);
+		float scale2 = fmax(glm::dot(glm::vec3(world[0]), glm::vec3(world[0])),
+			fmax(glm::dot(glm::vec3(world[1]), glm::vec3(world[1])),
+			glm::dot(glm::vec3(world[2]), glm::vec3(world[2]))));
+		centerX[i] = center.x;
+		centerY[i] = center.y;
+		centerZ[i] = center.z;
+		radius[i] = mesh->sphereRadius * sqrt(scale2);
+	}
+}
+
+// Gribb & Hartmann
+void frustumPlanes(const glm::mat4x4 &worldViewProject, float planes[6][4])
+{
+	const glm::mat4x4 &m = worldViewProject;
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 4; j++) {
+			planes[2 * i][j] = m[j][3] + m[j][i];
+			planes[2 * i + 1][j] = m[j][3] - m[j][i];
+		}
+	}
+	for (int p = 0; p < 6; p++) {
+		float length = sqrt(planes[p][0] * planes[p][0] + planes[p][1] * planes[p][1] + planes[p][2] * planes[p][2]);
+		if (length > 0.0f) for (int j = 0; j < 4; j++) planes[p][j] /= length;
+	}
+}
+
+int FrustumCuller::cull(const glm::mat4x4 &worldViewProject)
+{
+	float planes[6][4];
+	frustumPlanes(worldViewProject, planes);
+
+	// a sphere is out if it is entirely behind any one plane
+	int n = (int)meshes.size();
+	int numVisible = 0;
+	for (int i = 0; i < n; i += 4) {
+#ifdef USE_SSE
+		__m128 x = _mm_loadu_ps(&centerX[i]);
+		__m128 y = _mm_loadu_ps(&centerY[i]);
+		__m128 z = _mm_loadu_ps(&centerZ[i]);
+		__m128 negR = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&radius[i]));
+		__m128 outside = _mm_setzero_ps();
+		for (int p = 0; p < 6; p++) {
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(planes[p][0])),
+				_mm_mul_ps(y, _mm_set1_ps(planes[p][1]))),
+				_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(planes[p][2])), _mm_set1_ps(planes[p][3])));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(d, negR));
+		}
+		int mask = _mm_movemask_ps(outside);
+		for (int k = 0; k < 4; k++) visible[i + k] = !((mask >> k) & 1);
+#else
+		for (int k = 0; k < 4; k++) {
+			bool inside = true;
+			for (int p = 0; p < 6 && inside; p++) {
+				float d = planes[p][0] * centerX[i + k] + planes[p][1] * centerY[i + k] +
+					planes[p][2] * centerZ[i + k] + planes[p][3];
+				inside = (d >= -radius[i + k]);
+			}
+			visible[i + k] = inside;
+		}
+#endif
+		int count = (n - i < 4) ? n - i : 4;
+		for (int k = 0; k < count; k++) numVisible += visible[i + k];
+	}
+	return numVisible;
+}
+
+//-------------------------------------------------------------------------//
+// Scene BVH
+//-------------------------------------------------------------------------//
+
+void nodeWorldBounds(Node *node, const glm::mat4x4 &world, glm::vec3 &lo, glm::vec3 &hi)
+{
+	TriMesh *mesh = node->meshInst->triMesh;
+	glm::vec3 origin = glm::vec3(world[3]);
+	if (mesh == NULL || mesh->sphereRadius < 0.0f) {
+		lo = hi = origin;
+		return;
+	}
+
+	// transformed box center plus the absolute matrix applied to the extents
+	glm::vec3 center = (mesh->boundsMin + mesh->boundsMax) * 0.5f;
+	glm::vec3 extent = (mesh->boundsMax - mesh->boundsMin) * 0.5f;
+	glm::vec3 worldCenter = glm::vec3(world * glm::vec4(center, 1.0f));
+	glm::vec3 worldExtent;
+	for (int i = 0; i < 3; i++) {
+		worldExtent[i] = fabs(world[0][i]) * extent.x + fabs(world[1][i]) * extent.y + fabs(world[2][i]) * extent.z;
+	}
+	lo = worldCenter - worldExtent;
+	hi = worldCenter + worldExtent;
+}
+
+static bool boxContains(const glm::vec3 &lo, const glm::vec3 &hi, const glm::vec3 &innerLo, const glm::vec3 &innerHi)
+{
+	return lo.x <= innerLo.x && lo.y <= innerLo.y && lo.z <= innerLo.z &&
+		hi.x >= innerHi.x && hi.y >= innerHi.y && hi.z >= innerHi.z;
+}
+
+static float boxDistance2(const glm::vec3 &lo, const glm::vec3 &hi, const glm::vec3 &p)
+{
+	glm::vec3 d = glm::max(glm::max(lo - p, p - hi), glm::vec3(0, 0, 0));
+	return glm::dot(d, d);
+}
+
+int SceneBVH::allocate(void)
+{
+	if (freeList == BVH_NULL) {
+		tree.push_back(BVHNode());
+		tree.back().height = -1;
+		tree.back().parent = BVH_NULL;
+		freeList = (int)tree.size() - 1;
+	}
+	int index = freeList;
+	freeList = tree[index].parent;
+	BVHNode &n = tree[index];
+	n.parent = n.left = n.right = BVH_NULL;
+	n.height = 0;
+	n.node = NULL;
+	return index;
+}
+
+void SceneBVH::release(int index)
+{
+	tree[index].height = -1;
+	tree[index].node = NULL;
+	tree[index].parent = freeList;
+	freeList = index;
+}
+
+int SceneBVH::insertLeaf(Node *node, const glm::vec3 &lo, const glm::vec3 &hi)
+{
+	int leaf = allocate();
+	BVHNode &n = tree[leaf];
+	n.node = node;
+	n.boundsLo = lo;
+	n.boundsHi = hi;
+	glm::vec3 margin = (hi - lo) * BVH_FAT_FRACTION + glm::vec3(BVH_FAT_MIN, BVH_FAT_MIN, BVH_FAT_MIN);
+	n.lo = lo - margin;
+	n.hi = hi + margin;
+	attach(leaf);
+	node->bvhProxy = leaf;
+	numLeaves++;
+	return leaf;
+}
+
+void SceneBVH::removeLeaf(int leaf)
+{
+	if (tree[leaf].node != NULL && tree[leaf].node->bvhProxy == leaf) tree[leaf].node->bvhProxy = -1;
+	detach(leaf);
+	release(leaf);
+	numLeaves--;
+}
+
+void SceneBVH::moveLeaf(int leaf, const glm::vec3 &lo, const glm::vec3 &hi)
+{
+	BVHNode &n = tree[leaf];
+	n.boundsLo = lo;
+	n.boundsHi = hi;
+	if (boxContains(n.lo, n.hi, lo, hi)) return; // still inside its fat box
+
+	detach(leaf);
+	glm::vec3 margin = (hi - lo) * BVH_FAT_FRACTION + glm::vec3(BVH_FAT_MIN, BVH_FAT_MIN, BVH_FAT_MIN);
+	tree[leaf].lo = lo - margin;
+	tree[leaf].hi = hi + margin;
+	attach(leaf);
+}
+
+void SceneBVH::attach(int leaf)
+{
+	if (root == BVH_NULL) {
+		root = leaf;
+		tree[root].parent = BVH_NULL;
+		return;
+	}
+
+	// walk down towards the sibling that adds the least surface area
+	glm::vec3 leafLo = tree[leaf].lo, leafHi = tree[leaf].hi;
+	int index = root;
+	while (!tree[index].isLeaf()) {
+		const BVHNode &n = tree[index];
+		float area = boxArea(n.lo, n.hi);
+		float combinedArea = boxArea(glm::min(n.lo, leafLo), glm::max(n.hi, leafHi));
+
+		// pairing here makes a new parent; going lower grows this node anyway
+		float cost = 2.0f * combinedArea;
+		float inheritance = 2.0f * (combinedArea - area);
+
+		float childCost[2];
+		int children[2] = { n.left, n.right };
+		for (int c = 0; c < 2; c++) {
+			const BVHNode &child = tree[children[c]];
+			float grown = boxArea(glm::min(child.lo, leafLo), glm::max(child.hi, leafHi));
+			childCost[c] = (child.isLeaf() ? grown : grown - boxArea(child.lo, child.hi)) + inheritance;
+		}
+		if (cost < childCost[0] && cost < childCost[1]) break;
+		index = (childCost[0] < childCost[1]) ? children[0] : children[1];
+	}
+	int sibling = index;
+
+	int oldParent = tree[sibling].parent;
+	int newParent = allocate();
+	tree[newParent].parent = oldParent;
+	tree[newParent].lo = glm::min(tree[sibling].lo, leafLo);
+	tree[newParent].hi = glm::max(tree[sibling].hi, leafHi);
+	tree[newParent].height = tree[sibling].height + 1;
+	tree[newParent].left = sibling;
+	tree[newParent].right = leaf;
+	tree[sibling].parent = newParent;
+	tree[leaf].parent = newParent;
+	if (oldParent == BVH_NULL) root = newParent;
+	else if (tree[oldParent].left == sibling) tree[oldParent].left = newParent;
+	else tree[oldParent].right = newParent;
+
+	refitFrom(tree[leaf].parent);
+}
+
+void SceneBVH::detach(int leaf)
+{
+	if (leaf == root) {
+		root = BVH_NULL;
+		return;
+	}
+	int parent = tree[leaf].parent;
+	int grandParent = tree[parent].parent;
+	int sibling = (tree[parent].left == leaf) ? tree[parent].right : tree[parent].left;
+
+	// the sibling takes the parent's place
+	if (grandParent == BVH_NULL) {
+		root = sibling;
+		tree[sibling].parent = BVH_NULL;
+	}
+	else {
+		if (tree[grandParent].left == parent) tree[grandParent].left = sibling;
+		else tree[grandParent].right = sibling;
+		tree[sibling].parent = grandParent;
+	}
+	release(parent);
+	tree[leaf].parent = BVH_NULL;
+	if (grandParent != BVH_NULL) refitFrom(grandParent);
+}
+
+void SceneBVH::refitFrom(int index)
+{
+	while (index != BVH_NULL) {
+		index = balance(index);
+		BVHNode &n = tree[index];
+		const BVHNode &left = tree[n.left];
+		const BVHNode &right = tree[n.right];
+		n.height = 1 + max(left.height, right.height);
+		n.lo = glm::min(left.lo, right.lo);
+		n.hi = glm::max(left.hi, right.hi);
+		index = n.parent;
+	}
+}
+
+// If one child of a is two levels taller than the other, rotate the taller
+// child up into a's place.  Returns the index now at the top of the subtree.
+int SceneBVH::balance(int a)
+{
+	BVHNode &A = tree[a];
+	if (A.isLeaf() || A.height < 2) return a;
+
+	int b = A.left, c = A.right;
+	int lean = tree[c].height - tree[b].height;
+	if (lean >= -1 && lean <= 1) return a;
+
+	// c (or b) goes up, a comes down and takes the shorter grandchild
+	int up = (lean > 1) ? c : b;
+	int stay = (lean > 1) ? b : c;
+	BVHNode &U = tree[up];
+	int f = U.left, g = U.right;
+
+	U.left = a;
+	U.parent = A.parent;
+	A.parent = up;
+	if (U.parent == BVH_NULL) root = up;
+	else if (tree[U.parent].left == a) tree[U.parent].left = up;
+	else tree[U.parent].right = up;
+
+	int keep = (tree[f].height > tree[g].height) ? f : g;
+	int give = (keep == f) ? g : f;
+	U.right = keep;
+	if (lean > 1) A.right = give;
+	else A.left = give;
+	tree[give].parent = a;
+
+	const BVHNode &S = tree[stay];
+	const BVHNode &G = tree[give];
+	A.lo = glm::min(S.lo, G.lo);
+	A.hi = glm::max(S.hi, G.hi);
+	A.height = 1 + max(S.height, G.height);
+	const BVHNode &K = tree[keep];
+	U.lo = glm::min(A.lo, K.lo);
+	U.hi = glm::max(A.hi, K.hi);
+	U.height = 1 + max(A.height, K.height);
+	return up;
+}
+
+void SceneBVH::update(TransformHierarchy &hierarchy, bool rebuilt)
+{
+	glm::vec3 lo, hi;
+	if (!rebuilt) {
+		for (int i = 0; i < hierarchy.size(); i++) {
+			if (!hierarchy.dirty[i]) continue;
+			Node *node = hierarchy.nodes[i];
+			nodeWorldBounds(node, hierarchy.worlds[i], lo, hi);
+			if (node->bvhProxy >= 0) moveLeaf(node->bvhProxy, lo, hi);
+			else insertLeaf(node, lo, hi);
+		}
+		return;
+	}
+
+	// the node set changed: keep leaves of nodes still there, add new
+	// ones and drop the rest.  Copied nodes carry a proxy that isn't theirs.
+	vector<unsigned char> seen(tree.size(), 0);
+	for (int i = 0; i < hierarchy.size(); i++) {
+		Node *node = hierarchy.nodes[i];
+		nodeWorldBounds(node, hierarchy.worlds[i], lo, hi);
+		int proxy = node->bvhProxy;
+		if (proxy >= 0 && proxy < (int)seen.size() && tree[proxy].height == 0 && tree[proxy].node == node) {
+			seen[proxy] = 1;
+			moveLeaf(proxy, lo, hi);
+		}
+		else {
+			// may reuse a slot freed earlier, which mustn't look unseen below
+			int leaf = insertLeaf(node, lo, hi);
+			if (leaf < (int)seen.size()) seen[leaf] = 1;
+		}
+	}
+	for (int i = 0; i < (int)seen.size(); i++) {
+		if (!seen[i] && tree[i].height == 0 && tree[i].node != NULL) removeLeaf(i);
+	}
+}
+
+void SceneBVH::queryFrustum(const glm::mat4x4 &worldViewProject, vector<Node*> &result) const
+{
+	if (root == BVH_NULL) return;
+	const glm::mat4x4 &m = worldViewProject;
+	glm::vec4 planes[6];
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 4; j++) {
+			planes[2 * i][j] = m[j][3] + m[j][i];
+			planes[2 * i + 1][j] = m[j][3] - m[j][i];
+		}
+	}
+
+	// a box is out if its corner furthest along a plane's normal is behind it
+	vector<int> stack(1, root);
+	while (!stack.empty()) {
+		int index = stack.back();
+		stack.pop_back();
+		const BVHNode &n = tree[index];
+		glm::vec3 lo = n.isLeaf() ? n.boundsLo : n.lo;
+		glm::vec3 hi = n.isLeaf() ? n.boundsHi : n.hi;
+		bool outside = false;
+		for (int p = 0; p < 6 && !outside; p++) {
+			glm::vec3 corner(planes[p].x > 0 ? hi.x : lo.x, planes[p].y > 0 ? hi.y : lo.y, planes[p].z > 0 ? hi.z : lo.z);
+			outside = (glm::dot(glm::vec3(planes[p]), corner) + planes[p].w < 0.0f);
+		}
+		if (outside) continue;
+		if (n.isLeaf()) result.push_back(n.node);
+		else {
+			stack.push_back(n.left);
+			stack.push_back(n.right);
+		}
+	}
+}
+
+void SceneBVH::querySphere(const glm::vec3 &center, float radius, vector<Node*> &result) const
+{
+	if (root == BVH_NULL) return;
+	float radius2 = radius * radius;
+	vector<int> stack(1, root);
+	while (!stack.empty()) {
+		int index = stack.back();
+		stack.pop_back();
+		const BVHNode &n = tree[index];
+		if (n.isLeaf()) {
+			if (boxDistance2(n.boundsLo, n.boundsHi, center) <= radius2) result.push_back(n.node);
+		}
+		else if (boxDistance2(n.lo, n.hi, center) <= radius2) {
+			stack.push_back(n.left);
+			stack.push_back(n.right);
+		}
+	}
+}
+
+void SceneBVH::queryNearest(const glm::vec3 &point, int k, vector<Node*> &result) const
+{
+	if (root == BVH_NULL || k <= 0) return;
+
+	// best first: a box is never closer than anything inside it, so leaves
+	// come off the queue in distance order
+	typedef pair<float, int> Entry;
+	priority_queue<Entry, vector<Entry>, greater<Entry> > open;
+	open.push(Entry(boxDistance2(tree[root].lo, tree[root].hi, point), root));
+	int found = 0;
+	while (!open.empty() && found < k) {
+		int index = open.top().second;
+		open.pop();
+		const BVHNode &n = tree[index];
+		if (n.isLeaf()) {
+			result.push_back(n.node); // queued with its real bounds, see below
+			found++;
+			continue;
+		}
+		int children[2] = { n.left, n.right };
+		for (int c = 0; c < 2; c++) {
+			const BVHNode &child = tree[children[c]];
+			float d = child.isLeaf() ? boxDistance2(child.boundsLo, child.boundsHi, point) :
+				boxDistance2(child.lo, child.hi, point);
+			open.push(Entry(d, children[c]));
+		}
+	}
+}
+
+void SceneBVH::queryRay(const glm::vec3 &origin, const glm::vec3 &dir, float maxDist, vector<RayHit> &result) const
+{
+	if (root == BVH_NULL) return;
+	glm::vec3 invDir;
+	for (int i = 0; i < 3; i++) invDir[i] = (dir[i] != 0.0f) ? 1.0f / dir[i] : FLT_MAX;
+
+	size_t first = result.size();
+	vector<int> stack(1, root);
+	while (!stack.empty()) {
+		int index = stack.back();
+		stack.pop_back();
+		const BVHNode &n = tree[index];
+		const glm::vec3 &lo = n.isLeaf() ? n.boundsLo : n.lo;
+		const glm::vec3 &hi = n.isLeaf() ? n.boundsHi : n.hi;
+
+		// slab test
+		float tNear = 0.0f, tFar = maxDist;
+		for (int i = 0; i < 3 && tNear <= tFar; i++) {
+			float t0 = (lo[i] - origin[i]) * invDir[i];
+			float t1 = (hi[i] - origin[i]) * invDir[i];
+			if (t0 > t1) swap(t0, t1);
+			tNear = fmax(tNear, t0);
+			tFar = fmin(tFar, t1);
+		}
+		if (tNear > tFar) continue;
+
+		if (n.isLeaf()) {
+			RayHit hit;
+			hit.node = n.node;
+			hit.triangle = -1;
+			hit.t = tNear;
+			result.push_back(hit);
+		}
+		else {
+			stack.push_back(n.left);
+			stack.push_back(n.right);
+		}
+	}
+	sort(result.begin() + first, result.end(), [](const RayHit &a, const RayHit &b) { return a.t < b.t; });
+}
+
+//-------------------------------------------------------------------------//
+// Collision
+//-------------------------------------------------------------------------//
+
+static inline uint64_t pairKey(int a, int b)
+{
+	if (a > b) swap(a, b);
+	return ((uint64_t)a << 32) | (uint32_t)b;
+}
+
+int Broadphase::addBody(Node *node)
+{
+	int index;
+	if (!freeBodies.empty()) {
+		index = freeBodies.back();
+		freeBodies.pop_back();
+	}
+	else {
+		index = (int)bodies.size();
+		bodies.push_back(SAPBody());
+	}
+	SAPBody &body = bodies[index];
+	body.node = node;
+	body.alive = true;
+	body.eventStart = body.eventCount = 0;
+	node->collisionBody = index;
+
+	// new endpoints start past everything, the next sort moves them in
+	for (int axis = 0; axis < 3; axis++) {
+		SAPEndpoint e;
+		e.value = FLT_MAX;
+		e.data = (uint32_t)index << 1;
+		endpoints[axis].push_back(e);
+		e.data |= 1;
+		endpoints[axis].push_back(e);
+	}
+	return index;
+}
+
+void Broadphase::removeBodies(vector<int> &dead)
+{
+	if (dead.empty()) return;
+	for (int i = 0; i < (int)dead.size(); i++) {
+		SAPBody &body = bodies[dead[i]];
+		body.alive = false;
+		if (body.node->collisionBody == dead[i]) body.node->collisionBody = -1;
+	}
+	for (unordered_set<uint64_t>::iterator it = pairs.begin(); it != pairs.end(); ) {
+		if (!bodies[(int)(*it >> 32)].alive || !bodies[(int)(*it & 0xFFFFFFFF)].alive) it = pairs.erase(it);
+		else it++;
+	}
+	for (int axis = 0; axis < 3; axis++) {
+		vector<SAPEndpoint> &e = endpoints[axis];
+		int n = 0;
+		for (int i = 0; i < (int)e.size(); i++) {
+			if (bodies[e[i].data >> 1].alive) e[n++] = e[i];
+		}
+		e.resize(n);
+	}
+}
+
+bool Broadphase::overlaps(int a, int b) const
+{
+	const SAPBody &A = bodies[a];
+	const SAPBody &B = bodies[b];
+	if (A.lo.x > B.hi.x || B.lo.x > A.hi.x || A.lo.y > B.hi.y || B.lo.y > A.hi.y ||
+		A.lo.z > B.hi.z || B.lo.z > A.hi.z) return false;
+	// a node and its parent are expected to touch
+	return A.node->parent != B.node && B.node->parent != A.node;
+}
+
+void Broadphase::sortAxis(int axis)
+{
+	vector<SAPEndpoint> &e = endpoints[axis];
+	for (int j = 1; j < (int)e.size(); j++) {
+		SAPEndpoint key = e[j];
+		int i = j - 1;
+		while (i >= 0 && e[i].value > key.value) {
+			// key moves left past e[i]
+			int keyBody = key.data >> 1, otherBody = e[i].data >> 1;
+			bool keyIsMax = (key.data & 1) != 0, otherIsMax = (e[i].data & 1) != 0;
+			if (!keyIsMax && otherIsMax) {
+				// started overlapping on this axis
+				if (overlaps(keyBody, otherBody)) pairs.insert(pairKey(keyBody, otherBody));
+			}
+			else if (keyIsMax && !otherIsMax) {
+				// stopped overlapping on this axis
+				pairs.erase(pairKey(keyBody, otherBody));
+			}
+			e[i + 1] = e[i];
+			i--;
+		}
+		e[i + 1] = key;
+	}
+}
+
+// from scratch, for when most of the bodies are new
+void Broadphase::rebuildPairs(void)
+{
+	for (int axis = 0; axis < 3; axis++) {
+		sort(endpoints[axis].begin(), endpoints[axis].end(),
+			[](const SAPEndpoint &a, const SAPEndpoint &b) { return a.value < b.value; });
+	}
+
+	// sweep x, checking each box against the ones open when it starts
+	pairs.clear();
+	vector<int> open;
+	vector<int> openSlot(bodies.size(), -1);
+	vector<SAPEndpoint> &e = endpoints[0];
+	for (int i = 0; i < (int)e.size(); i++) {
+		int body = e[i].data >> 1;
+		if (e[i].data & 1) {
+			int slot = openSlot[body];
+			openSlot[open.back()] = slot;
+			open[slot] = open.back();
+			open.pop_back();
+		}
+		else {
+			for (int j = 0; j < (int)open.size(); j++) {
+				if (overlaps(body, open[j])) pairs.insert(pairKey(body, open[j]));
+			}
+			openSlot[body] = (int)open.size();
+			open.push_back(body);
+		}
+	}
+}
+
+void Broadphase::update(TransformHierarchy &hierarchy, bool rebuilt)
+{
+	// pairs as they were, to tell begin and stay from end
+	lastPairs = pairs;
+
+	vector<unsigned char> seen;
+	if (rebuilt) seen.assign(bodies.size(), 0);
+	int added = 0;
+	for (int i = 0; i < hierarchy.size(); i++) {
+		Node *node = hierarchy.nodes[i];
+		int b = node->collisionBody;
+		// copied nodes carry a body that isn't theirs
+		if (b < 0 || b >= (int)bodies.size() || !bodies[b].alive || bodies[b].node != node) {
+			b = addBody(node);
+			added++;
+		}
+		if (b < (int)seen.size()) seen[b] = 1;
+		nodeWorldBounds(node, hierarchy.worlds[i], bodies[b].lo, bodies[b].hi);
+	}
+
+	vector<int> dead;
+	for (int b = 0; b < (int)seen.size(); b++) {
+		if (!seen[b] && bodies[b].alive) dead.push_back(b);
+	}
+	removeBodies(dead);
+
+	for (int axis = 0; axis < 3; axis++) {
+		vector<SAPEndpoint> &e = endpoints[axis];
+		for (int i = 0; i < (int)e.size(); i++) {
+			const SAPBody &body = bodies[e[i].data >> 1];
+			e[i].value = (e[i].data & 1) ? body.hi[axis] : body.lo[axis];
+		}
+	}
+	if (added * 8 > numBodies()) rebuildPairs();
+	else for (int axis = 0; axis < 3; axis++) sortAxis(axis);
+
+	buildEvents();
+
+	// dead bodies were kept until their end events were made
+	for (int i = 0; i < (int)dead.size(); i++) {
+		bodies[dead[i]].node = NULL;
+		freeBodies.push_back(dead[i]);
+	}
+}
+
+void Broadphase::buildEvents(void)
+{
+	events.clear();
+	vector<int> eventBodies; // two per event
+	for (unordered_set<uint64_t>::iterator it = pairs.begin(); it != pairs.end(); it++) {
+		int a = (int)(*it >> 32), b = (int)(*it & 0xFFFFFFFF);
+		ContactEvent event;
+		event.a = bodies[a].node;
+		event.b = bodies[b].node;
+		event.type = lastPairs.count(*it) ? CONTACT_STAY : CONTACT_BEGIN;
+		events.push_back(event);
+		eventBodies.push_back(a);
+		eventBodies.push_back(b);
+	}
+	for (unordered_set<uint64_t>::iterator it = lastPairs.begin(); it != lastPairs.end(); it++) {
+		if (pairs.count(*it)) continue;
+		int a = (int)(*it >> 32), b = (int)(*it & 0xFFFFFFFF);
+		ContactEvent event;
+		event.a = bodies[a].node;
+		event.b = bodies[b].node;
+		event.type = CONTACT_END;
+		events.push_back(event);
+		eventBodies.push_back(a);
+		eventBodies.push_back(b);
+	}
+
+	// group the event indices by body, so each body's contacts are a slice
+	for (int b = 0; b < (int)bodies.size(); b++) bodies[b].eventCount = 0;
+	for (int i = 0; i < (int)eventBodies.size(); i++) bodies[eventBodies[i]].eventCount++;
+	int start = 0;
+	for (int b = 0; b < (int)bodies.size(); b++) {
+		bodies[b].eventStart = start;
+		start += bodies[b].eventCount;
+		bodies[b].eventCount = 0;
+	}
+	eventsByBody.resize(eventBodies.size());
+	for (int i = 0; i < (int)eventBodies.size(); i++) {
+		SAPBody &body = bodies[eventBodies[i]];
+		eventsByBody[body.eventStart + body.eventCount++] = i / 2;
+	}
+}
+
+void Broadphase::getContacts(Node *node, vector<ContactEvent> &result) const
+{
+	int b = node->collisionBody;
+	if (b < 0 || b >= (int)bodies.size() || bodies[b].node != node) return;
+	const SAPBody &body = bodies[b];
+	for (int i = 0; i < body.eventCount; i++) {
+		ContactEvent event = events[eventsByBody[body.eventStart + i]];
+		if (event.a != node) swap(event.a, event.b);
+		result.push_back(event);
+	}
+}
+
+//-------------------------------------------------------------------------//
+// Render Queue
+//-------------------------------------------------------------------------//
+
+RenderStats gRenderStats;
+
+void RenderQueue::clear(void)
+{
+	packets.clear();
+	instances.clear();
+	worlds.clear();
+	worldInverses.clear();
+}
+
+void RenderQueue::add(TriMeshInstance *instance, const glm::mat4x4 &world, const glm::mat4x4 &worldInverse, int lod)
+{
+	Material &mat = instance->mat;
+	DrawPacket packet;
+	packet.key = ((uint64_t)(mat.shaderProgram & 0xFFFF) << RQ_PROGRAM_SHIFT) |
+		((uint64_t)(mat.getTextureSet() & 0xFFFFFF) << RQ_TEXTURES_SHIFT) |
+		((uint64_t)(instance->triMesh->vao & 0xFFFF) << RQ_VAO_SHIFT) |
+		(uint64_t)(lod & RQ_LOD_MASK);
+	packet.transform = (uint32_t)instances.size();
+	packets.push_back(packet);
+	instances.push_back(instance);
+	worlds.push_back(world);
+	worldInverses.push_back(worldInverse);
+}
+
+void RenderQueue::sort(void)
+{
+	int n = (int)packets.size();
+	sorted.resize(n);
+	if (n == 0) return;
+
+	// LSD radix sort, one byte per pass.  All eight histograms come from a
+	// single read of the keys, and bytes every key agrees on are skipped.
+	static uint32_t counts[8][256];
+	memset(counts, 0, sizeof(counts));
+	for (int i = 0; i < n; i++) {
+		uint64_t key = packets[i].key;
+		for (int b = 0; b < 8; b++) counts[b][(key >> (b * 8)) & 0xFF]++;
+	}
+
+	vector<DrawPacket> *src = &packets, *dst = &sorted;
+	for (int b = 0; b < 8; b++) {
+		int shift = b * 8;
+		if (counts[b][(packets[0].key >> shift) & 0xFF] == (uint32_t)n) continue;
+
+		uint32_t offset = 0;
+		for (int i = 0; i < 256; i++) {
+			uint32_t count = counts[b][i];
+			counts[b][i] = offset;
+			offset += count;
+		}
+		for (int i = 0; i < n; i++) {
+			const DrawPacket &packet = (*src)[i];
+			(*dst)[counts[b][(packet.key >> shift) & 0xFF]++] = packet;
+		}
+		swap(src, dst);
+	}
+	if (src != &sorted) sorted.swap(packets);
+}
+
+void RenderQueue::submit(Camera &camera)
+{
+	sort();
+
+	float planes[6][4];
+	frustumPlanes(camera.worldViewProject, planes);
+	glm::vec4 cameraNormal = glm::vec4(glm::normalize(camera.eye - camera.center), 0);
+	ShaderProgram *p = NULL;
+	Material *currentMaterial = NULL;
+	GLuint currentProgram = NULL_HANDLE;
+	GLuint currentVao = NULL_HANDLE;
+	int currentTextures = -1;
+	bool first = true;
+
+	for (int i = 0; i < (int)sorted.size(); i++) {
+		int index = sorted[i].transform;
+		TriMeshInstance *instance = instances[index];
+		Material &mat = instance->mat;
+
+		// the key only groups draws; what gets skipped is decided on the real state
+		if (first || mat.shaderProgram != currentProgram) {
+			glUseProgram(mat.shaderProgram);
+			currentProgram = mat.shaderProgram;
+			p = mat.getProgram();
+			if (p != NULL && p->uView != -1) glUniform4fv(p->uView, 1, glm::value_ptr(cameraNormal));
+			currentMaterial = NULL;
+			currentTextures = -1;
+			first = false;
+			gRenderStats.programBinds++;
+		}
+		if (p == NULL) continue;
+
+		if (p->isInstanced()) {
+			if (p->uViewPerspectM != -1 && currentMaterial == NULL) {
+				glUniformMatrix4fv(p->uViewPerspectM, 1, GL_FALSE, glm::value_ptr(camera.worldViewProject));
+			}
+			i = drawInstanced(p, i) - 1;
+			currentMaterial = &instances[sorted[i].transform]->mat;
+			currentTextures = currentMaterial->getTextureSet();
+			currentVao = instances[sorted[i].transform]->triMesh->vao;
+			continue;
+		}
+
+		if (mat.getTextureSet() != currentTextures) {
+			mat.bindTextures(p);
+			currentTextures = mat.getTextureSet();
+			gRenderStats.textureBinds++;
+		}
+		if (&mat != currentMaterial) {
+			mat.bindColors(p);
+			currentMaterial = &mat;
+		}
+
+		const glm::mat4x4 &world = worlds[index];
+		if (p->uObjectWorldM != -1) glUniformMatrix4fv(p->uObjectWorldM, 1, GL_FALSE, glm::value_ptr(world));
+		if (p->uObjectWorldInverseM != -1) {
+			glUniformMatrix4fv(p->uObjectWorldInverseM, 1, GL_FALSE, glm::value_ptr(worldInverses[index]));
+		}
+		if (p->uObjectPerpsectM != -1) {
+			glm::mat4x4 objectWorldViewPerspect = camera.worldViewProject * world;
+			glUniformMatrix4fv(p->uObjectPerpsectM, 1, GL_FALSE, glm::value_ptr(objectWorldViewPerspect));
+		}
+		bindObjectData(p, camera, world, worldInverses[index]);
+
+		TriMesh *mesh = instance->triMesh;
+		if (mesh->vao != currentVao) {
+			glBindVertexArray(mesh->vao);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+			currentVao = mesh->vao;
+			gRenderStats.vaoBinds++;
+		}
+		int lod = (int)(sorted[i].key & RQ_LOD_MASK);
+		if (lod == 0 && !mesh->meshlets.empty()) {
+			int drawn = mesh->cullMeshlets(world, planes, camera.eye, multiCounts, multiOffsets);
+			if (drawn > 0) {
+				glMultiDrawElements(GL_TRIANGLES, &multiCounts[0], mesh->indexType, &multiOffsets[0], drawn);
+				gRenderStats.drawCalls++;
+			}
+			for (int m = 0; m < drawn; m++) gRenderStats.trianglesSubmitted += multiCounts[m] / 3;
+			continue;
+		}
+		glDrawElements(GL_TRIANGLES, mesh->lodCount[lod], mesh->indexType, (void*)((size_t)mesh->lodStart[lod] * mesh->indexSize));
+		gRenderStats.drawCalls++;
+		gRenderStats.trianglesSubmitted += mesh->lodCount[lod] / 3;
+	}
+	gRenderStats.packets += (int)sorted.size();
+}
+
+static bool sameColors(const Material &a, const Material &b)
+{
+	if (a.colors.size() != b.colors.size()) return false;
+	for (int i = 0; i < (int)a.colors.size(); i++) {
+		if (a.colors[i].name != b.colors[i].name || a.colors[i].val != b.colors[i].val) return false;
+	}
+	return true;
+}
+
+// draws the run of packets starting at first that can share one instanced
+// call, returns the index of the first packet after the run
+int RenderQueue::drawInstanced(ShaderProgram *p, int first)
+{
+	TriMeshInstance *base = instances[sorted[first].transform];
+	Material &mat = base->mat;
+	TriMesh *mesh = base->triMesh;
+
+	int last = first + 1;
+	while (last < (int)sorted.size()) {
+		TriMeshInstance *next = instances[sorted[last].transform];
+		if (sorted[last].key != sorted[first].key || next->mat.shaderProgram != mat.shaderProgram ||
+			next->triMesh != mesh || next->mat.getTextureSet() != mat.getTextureSet() ||
+			!sameColors(next->mat, mat)) break;
+		last++;
+	}
+	int count = last - first;
+
+	// world matrices first, then the inverses if the shader wants them
+	bool inverses = (p->aInstanceWorldInverseM != -1);
+	instanceData.resize(inverses ? 2 * count : count);
+	for (int i = 0; i < count; i++) {
+		int index = sorted[first + i].transform;
+		instanceData[i] = worlds[index];
+		if (inverses) instanceData[count + i] = worldInverses[index];
+	}
+
+	// orphan the old storage rather than wait for draws still reading it
+	size_t bytes = instanceData.size() * sizeof(glm::mat4x4);
+	if (instanceBuffer == NULL_HANDLE) glGenBuffers(1, &instanceBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+	if (bytes > instanceBufferSize) instanceBufferSize = bytes;
+	glBufferData(GL_ARRAY_BUFFER, instanceBufferSize, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, &instanceData[0]);
+
+	mat.bindTextures(p);
+	mat.bindColors(p);
+	glBindVertexArray(mesh->vao);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+
+	// a mat4 attribute takes four consecutive locations, one per column
+	GLint locations[2] = { p->aInstanceWorldM, p->aInstanceWorldInverseM };
+	for (int m = 0; m < (inverses ? 2 : 1); m++) {
+		size_t offset = (size_t)m * count * sizeof(glm::mat4x4);
+		for (int c = 0; c < 4; c++) {
+			glEnableVertexAttribArray(locations[m] + c);
+			glVertexAttribPointer(locations[m] + c, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4x4),
+				(void*)(offset + c * sizeof(glm::vec4)));
+			glVertexAttribDivisor(locations[m] + c, 1);
+		}
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	int lod = (int)(sorted[first].key & RQ_LOD_MASK);
+	glDrawElementsInstanced(GL_TRIANGLES, mesh->lodCount[lod], mesh->indexType,
+		(void*)((size_t)mesh->lodStart[lod] * mesh->indexSize), count);
+	gRenderStats.trianglesSubmitted += mesh->lodCount[lod] / 3 * count;
+
+	// the VAO belongs to the mesh, leave it as non-instanced draws expect it
+	for (int m = 0; m < (inverses ? 2 : 1); m++) {
+		for (int c = 0; c < 4; c++) {
+			glVertexAttribDivisor(locations[m] + c, 0);
+			glDisableVertexAttribArray(locations[m] + c);
+		}
+	}
+
+	gRenderStats.textureBinds++;
+	gRenderStats.vaoBinds++;
+	gRenderStats.drawCalls++;
+	gRenderStats.instancedDraws++;
+	gRenderStats.instances += count;
+	return last;
+}
+
+
+
+//***************************************************************
+//Move Script Functions
+//***************************************************************
+
+/*void MoveScript::setValue(string property, void* value)
+ {
+    if(property == "move")
+    {
+        glm::vec3* vecptr = (glm::vec3*) value;
+        this->transVec = *vecptr;
+ 
+    }
+    else if(property == "scale")
+    {
+        glm::vec3* vecptr = (glm::vec3*) value;
+        this->scaleVec = *vecptr;
+ 
+ 
+    }
+    else if(property == "rotate")
+    {
+        glm::quat* quatptr = (glm::quat*) value;
+        this->rotQuat = *quatptr;
+ 
+    }
+ }*/
+
+//***************************************************************
+//Control Script Functions
+//***************************************************************
+
+void ControlScript::setValue(string property, void* value)
+ {
+ 
+ 
+     if(property == "scene")
+     {
+         this->scene = (Scene*) value;
+ 
+ 
+         cout << "Scene script success!!! Player Name: " << scene->nodes["player"]->name << endl;
+     }
+     else if(property == "width")
+     {
+         float* floatPtr = (float*) value;
+         this->width = *floatPtr;
+ 
+         cout << "Script Width: " << width << endl;
+     }
+     else if(property == "height")
+     {
+         float* floatPtr = (float*) value;
+         this->height = *floatPtr;
+     }
+     else if(property == "window")
+     {
+         gWindow = (GLFWwindow*) value;
+     }
+ 
+ 
+ }
+ 
+ 
+ void* ControlScript::getValue(string property)
+ {
+     void* value;
+ 
+     if(property == "scene")
+    {
+        value = this->scene;
+    }
+    else if(property == "height")
+    {
+        value = &this->height;
+    }
+    else if(property == "width")
+    {
+        value = &this->width;
+    }
+ 
+     return value;
+ }
+ 
+ 
+ 
+ void ControlScript::keyboardControls()
+ {
+ 
+     bool playerPresent = false;
+ 
+     if(scene->nodes["player"] != NULL && (firstPerson || thirdPerson))
+     {
+         playerPresent = true;
+     }
+ 
+ 
+     const float r = 0.01f;
+ 
+     if (glfwGetKey(gWindow, 'W'))
+     {
+ 
+         if(playerPresent)
+         {
+             scene->nodes["player"]->meshInst->T.translateLocal(glm::vec3(0, 0, -1), scene->camera);
+         }
+         else
+         {
+             scene->camera.translateLocal(glm::vec3(0,0,-1));
+         }
+         scene->camera.refreshTransform((float)width, (float)height);
+ 
+     }
+ 
+     if (glfwGetKey(gWindow, 'S'))
+     {
+         if(playerPresent)
+         {
+             scene->nodes["player"]->meshInst->T.translateLocal(glm::vec3(0, 0, 1), scene->camera);
+         }
+         else
+         {
+             scene->camera.translateLocal(glm::vec3(0,0,1));
+         }
+         scene->camera.refreshTransform((float)width, (float)height);
+ 
+     }
+ 
+     if (glfwGetKey(gWindow, 'D'))
+     {
+         if(playerPresent)
+         {
+             scene->nodes["player"]->meshInst->T.translateLocal(glm::vec3(.2, 0, 0), scene->camera);
+         }
+         else
+         {
+             scene->camera.translateLocal(glm::vec3(.2,0,0));
+         }
+         scene->camera.refreshTransform((float)width, (float)height);
+ 
+     }
+ 
+     if (glfwGetKey(gWindow, 'A'))
+     {
+         if(playerPresent)
+         {
+             scene->nodes["player"]->meshInst->T.translateLocal(glm::vec3(-.2, 0, 0), scene->camera);
+         }
+         else
+         {
+             scene->camera.translateLocal(glm::vec3(-.2,0,0));
+         }
+         scene->camera.refreshTransform((float)width, (float)height);
+ 
+     }
+     if (glfwGetKey(gWindow, GLFW_KEY_DOWN))
+     {
+         if(playerPresent)
+         {
+             scene->nodes["player"]->meshInst->T.rotateLocal(glm::vec3(1,0,0), -.01);
+         }
+         else
+         {
+             scene->camera.rotateLocal(glm::vec3(1, 0, 0) , -.01);
+         }
+         scene->camera.refreshTransform((float)width, (float)height);
+     }
+     if (glfwGetKey(gWindow, GLFW_KEY_UP))
+     {
+        if(playerPresent)
+        {
+            scene->nodes["player"]->meshInst->T.rotateLocal(glm::vec3(1,0,0), .01);
+        }
+        else
+        {
+            scene->camera.rotateLocal(glm::vec3(1, 0, 0), .01);
+        }
+         scene->camera.refreshTransform((float)width, (float)height);
+     }
+ 
+     if (glfwGetKey(gWindow, GLFW_KEY_LEFT))
+     {
+ 
+        if(playerPresent)
+        {
+            scene->nodes["player"]->meshInst->T.rotateGlobal(glm::vec3(0 ,1, 0), r);
+        }
+        else
+        {
+            scene->camera.rotateGlobal(glm::vec3(0,1,0), r);
+        }
+         scene->camera.refreshTransform((float)width, (float)height);
+     }
+     if (glfwGetKey(gWindow, GLFW_KEY_RIGHT))
+     {
+ 
+ 
+         if(playerPresent)
+         {
+             scene->nodes["player"]->meshInst->T.rotateGlobal(glm::vec3(0,1,0), -r);
+         }
+         else
+         {
+             scene->camera.rotateGlobal(glm::vec3(0,1,0), -r);
+         }
+         
+         scene->camera.refreshTransform((float)width, (float)height);
+     }
+     if (glfwGetKey(gWindow, GLFW_KEY_X) == GLFW_PRESS)
+     {
+         //gScene.nextCamera(gWidth, gHeight);
+     }
+     
+     if(glfwGetKey(gWindow, GLFW_KEY_SPACE) == GLFW_PRESS)// && glfwGetKey(gWindow, GLFW_KEY_SPACE) == GLFW_PRESS)
+     {
+         //SLEEP(20);
+         if(playerPresent && glfwGetKey(gWindow, GLFW_KEY_SPACE) == GLFW_RELEASE)
+         {
+             if(scene->baseNodes["baseNodeBullet"] != NULL)
+             {
+                 MoveScript* MS = new MoveScript();
+                 MS->maxDist = 50;
+                 MS->followSpeed = 1.0;
+                 MS->scene = scene;
+                 MS->useBulletTrans = true;
+                 
+                 SpawnScript* newSpawn = new SpawnScript();
+                 newSpawn->camera = &scene->camera;
+                 newSpawn->scene = scene;
+                 newSpawn->moveScript = MS;
+                 newSpawn->copyNode = scene->baseNodes["baseNodeBullet"];
+                 newSpawn->spawnBullet();
+             }
+         }
+     }
+ 
+     scene->camera.refreshTransform((float)width, (float)height);
+ }
+
+void ControlScript::firstPersonControls()
+{
+    if(scene->nodes["player"] != NULL)
+    {
+        scene->camera.eye = scene->nodes["player"]->meshInst->T.translation + ( scene->nodes["player"]->meshInst->T.rotation * glm::vec3(0,0,1)) * 20.0f + 2.0f * glm::vec3(0,1,0);
+        scene->camera.center = scene->nodes["player"]->meshInst->T.translation + 2.0f * glm::vec3(0,1,0);
+        scene->camera.refreshTransform(width, height);
+        
+        //cout << scene->camera.center.x << endl << "eye = " << scene->camera.eye.z << endl;
+    }
+
+}
+
+void ControlScript::thirdPersonControls()
+{
+    if(scene->nodes["player"] != NULL)
+    {
+        scene->camera.eye = scene->nodes["player"]->meshInst->T.translation + (scene->nodes["player"]->meshInst->T.rotation * glm::vec3(0,0,1)) * 5.0f + 5.0f * glm::vec3(0,1,0);
+        scene->camera.center = scene->nodes["player"]->meshInst->T.translation + 1.0f * glm::vec3(0,1,0);
+        scene->camera.refreshTransform(width, height);
+        
+        
+    }
     
+}
+
+void ControlScript::runScripts(){
     
-    //printVec(colors[0]);
+    if(keyboard)
+    {
+        keyboardControls();
+    }
     
-    // MATERIAL TEXTURES
-    for (int i = 0; i < (int) textures.size(); i++) {
-        if (textures[i].id == -1) {
-            loc = glGetUniformLocation(shaderProgram, textures[i].name.c_str());
-            textures[i].id = loc;
-        }
-        if (textures[i].id >= 0) {
-            //printf("\n%d %d\n", textures[i].id, textures[i].val->samplerId);
-            glActiveTexture(GL_TEXTURE0 + i);
-            glUniform1i(textures[i].id, i);
-            glBindTexture(GL_TEXTURE_2D, textures[i].val->textureId);
-            glBindSampler(textures[i].id, textures[i].val->samplerId);
-        }
+    if(thirdPerson)
+    {
+        thirdPersonControls();
+        //cout << "third" << endl;
+    }
+    else
+    {
+        firstPersonControls();
+        //cout << "first" << endl;
     }
 }
 
 
+void ControlScript::useKeyboard(bool option){
+    
+    this->keyboard = option;
+}
+
+void ControlScript::useFirstPerson(bool option)
+{
+    this->firstPerson = option;
+    
+    if(firstPerson && thirdPerson)
+    {
+        this->thirdPerson = false;
+    }
+}
+
+void ControlScript::useThirdPerson(bool option)
+{
+    this->thirdPerson = option;
+    
+    if(firstPerson && thirdPerson)
+    {
+        this->firstPerson = false;
+    }
+    
+}
 
 
 
@@ -867,777 +5038,2245 @@ void Material::bindNodeMaterial(Node* node, Camera &camera)
 //***************************************************************
 //Move Script Functions
 //***************************************************************
+void MoveScript::setValue(string property, void* value)
+{
+    if(property == "node")
+    {
+        this->node = (Node*)value;
+        
+    }
+    else if(property == "translate")
+    {
+        glm::vec3* vecPtr = (glm::vec3*) value;
+        this->transVec = *vecPtr;
+    }
+    else if(property == "scale")
+    {
+        glm::vec3* vecPtr = (glm::vec3*) value;
+        this->scaleVec = *vecPtr;
+    }
+    else if(property == "target")
+    {
+        this->targetNode = (Node*)value;
+    }
+    else if(property == "minTrans")
+    {
+        float* min = (float*) value;
+        this->minTransX = *min;
+        minTransX = minTransY = minTransZ;
+    }
+    else if(property == "followDist")
+    {
+        float* follow = (float*) value;
+        this->followDist = *follow;
+    }
+    else if(property == "followSpeed")
+    {
+        float* follow = (float*) value;
+        this->followSpeed = *follow;
+    }
+}
 
-/*void MoveScript::setValue(string property, void* value)
- {
-    if(property == "move")
+void MoveScript::setValue(string property, void* value1, void* value2)
+{
+    if(property == "rotate")
     {
-        glm::vec3* vecptr = (glm::vec3*) value;
-        this->transVec = *vecptr;
- 
+        glm::vec3* vecPtr = (glm::vec3*) value1;
+        this->axis = *vecPtr;
+        
+        float* flPtr = (float*) value2;
+        this->angle = *flPtr;
+    }
+}
+
+
+
+void MoveScript::setValue(string property1, string property2, void* value)
+{
+    if(property1 == "maxTrans")
+    {
+        float* max = (float*) value;
+        
+        
+        
+        if(property2 == "X" || property2 == "x")
+        {
+            this->maxTransX = *max;
+        }
+        else if(property2 == "Y" || property2 == "y")
+        {
+            this->maxTransY = *max;
+        }
+        else if(property2 =="Z" || property2 == "z")
+        {
+            this->maxTransZ = *max;
+        }
+    }
+
+}
+
+
+
+void MoveScript::globalRotate()
+{
+    node->meshInst->T.rotateGlobal(axis, angle);
+}
+
+void MoveScript::localRotate()
+{
+    node->meshInst->T.scale = scaleVec;
+}
+
+void MoveScript::localTrans()
+{
+    node->meshInst->T.translateLocal(transVec);
+}
+
+void MoveScript::globalTrans()
+{
+    node->meshInst->T.translateGlobal(transVec);
+}
+void MoveScript::setScale()
+{
+    node->meshInst->T.scale = scaleVec;
+}
+
+void MoveScript::localTransLimited()
+{
+    if(!minSet)
+    {
+        this->minTransX = node->meshInst->T.translation.x;
+        this->minTransY = node->meshInst->T.translation.y;
+        this->minTransZ = node->meshInst->T.translation.z;
+        minSet = true;
+        //cout << "reached it" << endl;
+    }
+    
+    globalTrans();
+    
+    if(this->minTransZ > node->meshInst->T.translation.z)
+    {
+        transVec.z = -transVec.z;
+    }
+    else if(this->maxTransZ < node->meshInst->T.translation.z)
+    {
+        transVec.z = -transVec.z;
     }
-    else if(property == "scale")
+    
+    if(this->minTransX > node->meshInst->T.translation.x)
     {
-        glm::vec3* vecptr = (glm::vec3*) value;
-        this->scaleVec = *vecptr;
- 
- 
+        transVec.x = -transVec.x;
     }
-    else if(property == "rotate")
+    else if(this->maxTransX < node->meshInst->T.translation.x)
     {
-        glm::quat* quatptr = (glm::quat*) value;
-        this->rotQuat = *quatptr;
- 
+        transVec.x = -transVec.x;
     }
- }*/
-
-//***************************************************************
-//Control Script Functions
-//***************************************************************
-
-void ControlScript::setValue(string property, void* value)
- {
- 
- 
-     if(property == "scene")
-     {
-         this->scene = (Scene*) value;
- 
- 
-         cout << "Scene script success!!! Player Name: " << scene->nodes["player"]->name << endl;
-     }
-     else if(property == "width")
-     {
-         float* floatPtr = (float*) value;
-         this->width = *floatPtr;
- 
-         cout << "Script Width: " << width << endl;
-     }
-     else if(property == "height")
-     {
-         float* floatPtr = (float*) value;
-         this->height = *floatPtr;
-     }
-     else if(property == "window")
-     {
-         gWindow = (GLFWwindow*) value;
-     }
- 
- 
- }
- 
- 
- void* ControlScript::getValue(string property)
- {
-     void* value;
- 
-     if(property == "scene")
+    
+    if(this->minTransY > node->meshInst->T.translation.y)
     {
-        value = this->scene;
+        transVec.y = -transVec.y;
     }
-    else if(property == "height")
+    else if(this->maxTransY < node->meshInst->T.translation.y)
     {
-        value = &this->height;
+        transVec.y = -transVec.y;
     }
-    else if(property == "width")
+    
+    node->meshInst->T.refreshTransform();
+    //camera->refreshTransform(600, 600);
+}
+
+void MoveScript::followPlayer()
+{
+    //cout << "Player y = " << playerNode->meshInst->T.translation.z << endl;
+    //cout << "Node y = " << node->meshInst->T.translation.z << endl;
+
+    
+    float zDist = node->meshInst->T.translation.z - targetNode->meshInst->T.translation.z;
+    float yDist = node->meshInst->T.translation.y - targetNode->meshInst->T.translation.y;
+    float xDist = node->meshInst->T.translation.x - targetNode->meshInst->T.translation.x;
+   // cout << "yDist = " << yDist << " X Dist = " << xDist << endl;
+
+    if(abs(zDist) <= followDist)
     {
-        value = &this->width;
+        //return;
     }
- 
-     return value;
- }
- 
- 
- 
- void ControlScript::keyboardControls()
- {
- 
-     bool playerPresent = false;
- 
-     if(scene->nodes["player"] != NULL && (firstPerson || thirdPerson))
-     {
-         playerPresent = true;
-     }
- 
- 
-     const float r = 0.01f;
- 
-     if (glfwGetKey(gWindow, 'W'))
-     {
- 
-         if(playerPresent)
-         {
-             scene->nodes["player"]->meshInst->T.translateLocal(glm::vec3(0, 0, -1), scene->camera);
-         }
-         else
-         {
-             scene->camera.translateLocal(glm::vec3(0,0,-1));
-         }
-         scene->camera.refreshTransform((float)width, (float)height);
- 
-     }
- 
-     if (glfwGetKey(gWindow, 'S'))
-     {
-         if(playerPresent)
-         {
-             scene->nodes["player"]->meshInst->T.translateLocal(glm::vec3(0, 0, 1), scene->camera);
-         }
-         else
-         {
-             scene->camera.translateLocal(glm::vec3(0,0,1));
-         }
-         scene->camera.refreshTransform((float)width, (float)height);
- 
-     }
- 
-     if (glfwGetKey(gWindow, 'D'))
-     {
-         if(playerPresent)
-         {
-             scene->nodes["player"]->meshInst->T.translateLocal(glm::vec3(.2, 0, 0), scene->camera);
-         }
-         else
-         {
-             scene->camera.translateLocal(glm::vec3(.2,0,0));
-         }
-         scene->camera.refreshTransform((float)width, (float)height);
- 
-     }
- 
-     if (glfwGetKey(gWindow, 'A'))
-     {
-         if(playerPresent)
-         {
-             scene->nodes["player"]->meshInst->T.translateLocal(glm::vec3(-.2, 0, 0), scene->camera);
-         }
-         else
-         {
-             scene->camera.translateLocal(glm::vec3(-.2,0,0));
-         }
-         scene->camera.refreshTransform((float)width, (float)height);
- 
-     }
-     if (glfwGetKey(gWindow, GLFW_KEY_DOWN))
-     {
-         if(playerPresent)
-         {
-             scene->nodes["player"]->meshInst->T.rotateLocal(glm::vec3(1,0,0), -.01);
-         }
-         else
-         {
-             scene->camera.rotateLocal(glm::vec3(1, 0, 0) , -.01);
-         }
-         scene->camera.refreshTransform((float)width, (float)height);
-     }
-     if (glfwGetKey(gWindow, GLFW_KEY_UP))
-     {
-        if(playerPresent)
+    else
+    {
+        if(zDist < 0)
         {
-            scene->nodes["player"]->meshInst->T.rotateLocal(glm::vec3(1,0,0), .01);
+            node->meshInst->T.translation.z += followSpeed;
         }
         else
         {
-            scene->camera.rotateLocal(glm::vec3(1, 0, 0), .01);
+            node->meshInst->T.translation.z -= followSpeed;
         }
-         scene->camera.refreshTransform((float)width, (float)height);
-     }
- 
-     if (glfwGetKey(gWindow, GLFW_KEY_LEFT))
-     {
- 
-        if(playerPresent)
+    }
+    
+    if(abs(yDist) <= followDist)
+    {
+       // cout << "return y" << endl;
+        //eturn;
+    }
+    else
+    {
+        if(yDist < 0)
         {
-            scene->nodes["player"]->meshInst->T.rotateGlobal(glm::vec3(0 ,1, 0), r);
+            node->meshInst->T.translation.y += followSpeed;
         }
         else
         {
-            scene->camera.rotateGlobal(glm::vec3(0,1,0), r);
-        }
-         scene->camera.refreshTransform((float)width, (float)height);
-     }
-     if (glfwGetKey(gWindow, GLFW_KEY_RIGHT))
-     {
- 
- 
-         if(playerPresent)
-         {
-             scene->nodes["player"]->meshInst->T.rotateGlobal(glm::vec3(0,1,0), -r);
-         }
-         else
-         {
-             scene->camera.rotateGlobal(glm::vec3(0,1,0), -r);
-         }
-         
-         scene->camera.refreshTransform((float)width, (float)height);
-     }
-     if (glfwGetKey(gWindow, GLFW_KEY_X) == GLFW_PRESS)
-     {
-         //gScene.nextCamera(gWidth, gHeight);
-     }
-     
-     if(glfwGetKey(gWindow, GLFW_KEY_SPACE) == GLFW_PRESS)// && glfwGetKey(gWindow, GLFW_KEY_SPACE) == GLFW_PRESS)
-     {
-         //SLEEP(20);
-         if(playerPresent && glfwGetKey(gWindow, GLFW_KEY_SPACE) == GLFW_RELEASE)
-         {
-             if(scene->baseNodes["baseNodeBullet"] != NULL)
-             {
-                 MoveScript* MS = new MoveScript();
-                 MS->maxDist = 50;
-                 MS->followSpeed = 1.0;
-                 MS->scene = scene;
-                 MS->useBulletTrans = true;
-                 
-                 SpawnScript* newSpawn = new SpawnScript();
-                 newSpawn->camera = &scene->camera;
-                 newSpawn->scene = scene;
-                 newSpawn->moveScript = MS;
-                 newSpawn->copyNode = scene->baseNodes["baseNodeBullet"];
-                 newSpawn->spawnBullet();
-             }
-         }
-     }
- 
-     scene->camera.refreshTransform((float)width, (float)height);
- }
-
-void ControlScript::firstPersonControls()
-{
-    if(scene->nodes["player"] != NULL)
+            node->meshInst->T.translation.y -= followSpeed;
+        }
+        
+       // cout << "player changed dir node z = " << node->meshInst->T.translation.z << endl;
+    }
+ 
+    if(abs(xDist) <= followDist)
     {
-        scene->camera.eye = scene->nodes["player"]->meshInst->T.translation + ( scene->nodes["player"]->meshInst->T.rotation * glm::vec3(0,0,1)) * 20.0f + 2.0f * glm::vec3(0,1,0);
-        scene->camera.center = scene->nodes["player"]->meshInst->T.translation + 2.0f * glm::vec3(0,1,0);
-        scene->camera.refreshTransform(width, height);
+        //cout << "return x" << endl;
+        //return;
+        
+    }
+    else
+    {
+        if(xDist < 0)
+        {
+            node->meshInst->T.translation.x += followSpeed;
+        }
+        else
+        {
+            node->meshInst->T.translation.x -= followSpeed;
+        }
         
-        //cout << scene->camera.center.x << endl << "eye = " << scene->camera.eye.z << endl;
     }
+    
+}
 
+void MoveScript::faceTarget()
+{
+    glm::vec3 objToCamProj;
+    float angleY, angleX;
+    
+    objToCamProj = glm::vec3(targetNode->meshInst->T.translation);
+    objToCamProj = glm::normalize(objToCamProj);
+    angleY = -atan2(objToCamProj.x, objToCamProj.z);
+    angleX = asin(objToCamProj.y);
+    node->meshInst->T.rotation = glm::quat(sin(angleY / 2), glm::vec3(0, cos(angleY / 2), 0));
+    node->meshInst->T.rotation *= glm::quat(cos(angleX / 2), glm::vec3(sin(angleX / 2), 0, 0));
 }
 
-void ControlScript::thirdPersonControls()
+
+void MoveScript::bulletTranslation()
 {
     if(scene->nodes["player"] != NULL)
     {
-        scene->camera.eye = scene->nodes["player"]->meshInst->T.translation + (scene->nodes["player"]->meshInst->T.rotation * glm::vec3(0,0,1)) * 5.0f + 5.0f * glm::vec3(0,1,0);
-        scene->camera.center = scene->nodes["player"]->meshInst->T.translation + 1.0f * glm::vec3(0,1,0);
-        scene->camera.refreshTransform(width, height);
+        node->meshInst->T.translateLocal(glm::vec3(0,0,-followSpeed), scene->camera);
+        distCounter += followSpeed;
         
+        // stop at the first thing hit that isn't the player or another bullet
+        vector<ContactEvent> contacts;
+        scene->broadphase.getContacts(node, contacts);
+        for(int i = 0; i < (int)contacts.size() && hitNode == NULL; i++)
+        {
+            if(contacts[i].type != CONTACT_BEGIN || contacts[i].b == scene->nodes["player"]) continue;
+            map<string,MoveScript*>::iterator other = scene->moveScripts.find(contacts[i].b->name);
+            if(other != scene->moveScripts.end() && other->second->useBulletTrans) continue;
+            hitNode = contacts[i].b;
+        }
         
+        if(distCounter >= maxDist || hitNode != NULL)
+        {
+            scene->nodes.erase(node->name);
+            scene->hierarchyChanged = true;
+            useBulletTrans = false;
+            //delete this;
+        }
     }
     
+    
 }
 
-void ControlScript::runScripts(){
-    
-    if(keyboard)
+void MoveScript::runScripts()
+{
+    if(useFaceTarget)
     {
-        keyboardControls();
+        faceTarget();
     }
-    
-    if(thirdPerson)
+    if(useGlobalRotate)
     {
-        thirdPersonControls();
-        //cout << "third" << endl;
+        globalRotate();
     }
-    else
+    if(useLocalRotate)
     {
-        firstPersonControls();
-        //cout << "first" << endl;
+        localRotate();
+    }
+    if(useLocalTrans)
+    {
+        localTrans();
+    }
+    if(useGlobalTrans)
+    {
+        globalTrans();
+    }
+    if(useSetScale)
+    {
+        setScale();
+    }
+    if(useLimitedTrans)
+    {
+        localTransLimited();
+    }
+    if(useFollowPlayer)
+    {
+        followPlayer();
+    }
+    if(useBulletTrans)
+    {
+        bulletTranslation();
     }
+
 }
 
+//*****************
+//Scene Functions
+//****************
+
 
-void ControlScript::useKeyboard(bool option){
-    
-    this->keyboard = option;
+float Scene::particleTimeStep(void)
+{
+    if (gParticleTimeStep > 0.0f) return gParticleTimeStep;
+    double now = WALL_TIME();
+    float dt = (lastParticleTime < 0.0) ? 1.0f / PARTICLE_FRAME_RATE : (float)(now - lastParticleTime);
+    lastParticleTime = now;
+    return fmin(dt, PARTICLE_MAX_STEP);
 }
 
-void ControlScript::useFirstPerson(bool option)
+int Scene::selectLod(int i)
 {
-    this->firstPerson = option;
+    Node *node = hierarchy.nodes[i];
+    TriMesh *mesh = node->meshInst->triMesh;
+    if(camera.viewportHeight <= 0.0f || mesh->sphereRadius <= 0.0f) return 0;
     
-    if(firstPerson && thirdPerson)
+    // pixels per world unit at the nearest point of the node's sphere
+    glm::vec3 center(culler.centerX[i], culler.centerY[i], culler.centerZ[i]);
+    float radius = culler.radius[i];
+    float distance = glm::length(center - camera.eye) - radius;
+    if(distance <= camera.znear)
     {
-        this->thirdPerson = false;
+        node->lodLevel = 0;
+        gRenderStats.lodNodes[0]++;
+        return 0;
     }
+    float pixelsPerUnit = camera.viewportHeight / (2.0f * tan(camera.fovy * 0.5f)) / distance;
+    if(2.0f * radius * pixelsPerUnit < gLodMinPixels) return -1;
+    
+    // mesh errors are in object space, the world sphere gives the scale
+    float errorPixels = pixelsPerUnit * radius / mesh->sphereRadius;
+    int level = min(node->lodLevel, mesh->numLods - 1);
+    while(level > 0 && mesh->lodError[level] * errorPixels > gLodPixelError * (1.0f + LOD_HYSTERESIS)) level--;
+    while(level + 1 < mesh->numLods && mesh->lodError[level + 1] * errorPixels < gLodPixelError * (1.0f - LOD_HYSTERESIS)) level++;
+    node->lodLevel = level;
+    gRenderStats.lodNodes[level]++;
+    return level;
 }
 
-void ControlScript::useThirdPerson(bool option)
+bool Scene::raycast(const glm::vec3 &origin, const glm::vec3 &dir, float maxDist, RayHit &hit, Node *ignore)
 {
-    this->thirdPerson = option;
+    hit.node = NULL;
+    hit.t = maxDist;
+    hit.triangle = -1;
     
-    if(firstPerson && thirdPerson)
+    // candidates come nearest bounds first, so stop once they start past the best hit
+    vector<RayHit> candidates;
+    raycastNodes(origin, dir, maxDist, candidates);
+    for(int i = 0; i < (int)candidates.size() && candidates[i].t < hit.t; i++)
     {
-        this->firstPerson = false;
+        Node *node = candidates[i].node;
+        if(node == ignore) continue;
+        MeshBVH *meshBVH = (node->meshInst->triMesh != NULL) ? node->meshInst->triMesh->getBVH() : NULL;
+        if(meshBVH == NULL)
+        {
+            hit = candidates[i];
+            continue;
+        }
+        const glm::mat4x4 &worldInverse = hierarchy.worldInverses[node->transformIndex];
+        MeshRay ray;
+        ray.origin = glm::vec3(worldInverse * glm::vec4(origin, 1.0f));
+        ray.dir = glm::vec3(worldInverse * glm::vec4(dir, 0.0f));
+        ray.maxDist = hit.t;
+        if(meshBVH->intersect(ray))
+        {
+            hit.node = node;
+            hit.t = ray.t;
+            hit.triangle = ray.triangle;
+        }
     }
-    
+    return hit.node != NULL;
 }
 
+bool Scene::lineOfSight(const glm::vec3 &from, const glm::vec3 &to, Node *ignoreA, Node *ignoreB)
+{
+    float dist = glm::length(to - from);
+    if(dist == 0.0f) return true;
+    
+    vector<RayHit> candidates;
+    raycastNodes(from, (to - from) / dist, dist, candidates);
+    for(int i = 0; i < (int)candidates.size(); i++)
+    {
+        Node *node = candidates[i].node;
+        if(node == ignoreA || node == ignoreB) continue;
+        MeshBVH *meshBVH = (node->meshInst->triMesh != NULL) ? node->meshInst->triMesh->getBVH() : NULL;
+        if(meshBVH == NULL) return false;
+        const glm::mat4x4 &worldInverse = hierarchy.worldInverses[node->transformIndex];
+        if(meshBVH->occluded(glm::vec3(worldInverse * glm::vec4(from, 1.0f)),
+                             glm::vec3(worldInverse * glm::vec4(to, 1.0f)))) return false;
+    }
+    return true;
+}
 
+bool Scene::pick(double cursorX, double cursorY, int width, int height, RayHit &hit)
+{
+    glm::vec3 origin, dir;
+    camera.refreshTransform(width, height);
+    camera.pickRay(cursorX, cursorY, width, height, origin, dir);
+    return raycast(origin, dir, camera.zfar, hit);
+}
 
-
-//***************************************************************
-//Move Script Functions
-//***************************************************************
-void MoveScript::setValue(string property, void* value)
+void Scene::runScripts()
 {
-    if(property == "node")
+    updateCollisions();
+    
+    for(int i = 0; i < spawnScripts.size(); i++)
     {
-        this->node = (Node*)value;
-        
+        spawnScripts[i]->runScripts();
     }
-    else if(property == "translate")
+    for(int i = 0; i < controlScripts.size(); i++)
     {
-        glm::vec3* vecPtr = (glm::vec3*) value;
-        this->transVec = *vecPtr;
+        controlScripts[i]->runScripts();
     }
-    else if(property == "scale")
+    
+    for(auto& x : moveScripts)
     {
-        glm::vec3* vecPtr = (glm::vec3*) value;
-        this->scaleVec = *vecPtr;
+        
+        x.second->runScripts();
+        int i = 0;
     }
-    else if(property == "target")
+
+    
+    
+   
+}
+
+
+//*****************
+//SpawnScript Functions
+//****************
+
+
+void SpawnScript::spawnNode()
+{  
+    std::ostringstream oss;
+    oss << numOfSpawn;
+    //cout << "spawn Num = " << spawnNum << endl;
+    name = name + oss.str();
+    Node* newNode = copyNode;
+    node = new Node();
+    *node = *newNode;
+    node->name = name;
+    TriMeshInstance* newInst = copyNode->meshInst;
+    node->meshInst = new TriMeshInstance;
+    *node->meshInst = *newInst;
+    node->meshInst->T.translation = spawnloc;
+    
+    if(didSpawnBullet)
     {
-        this->targetNode = (Node*)value;
+        node->meshInst->T.rotation = scene->nodes["player"]->meshInst->T.rotation;
     }
-    else if(property == "minTrans")
+    
+    if(moveScript != NULL)
     {
-        float* min = (float*) value;
-        this->minTransX = *min;
-        minTransX = minTransY = minTransZ;
+        attachMoveScript();
     }
-    else if(property == "followDist")
+    
+    scene->nodes[name] = this->node;
+    scene->hierarchyChanged = true;
+    int i = 0;
+}
+
+void SpawnScript::attachMoveScript()
+{
+    MoveScript* ms = moveScript;
+    MoveScript* newMS = new MoveScript();
+    
+    *newMS = *ms;
+    newMS->node = node;
+    moveScript = newMS;
+    
+    scene->moveScripts[name] = moveScript;
+    
+    cout << name << endl;
+}
+
+void SpawnScript::spawnBullet()
+{
+    if(scene->nodes["player"] != NULL)
     {
-        float* follow = (float*) value;
-        this->followDist = *follow;
+        spawnloc = scene->nodes["player"]->meshInst->T.translation;
+        didSpawnBullet = true;
+        spawnNode();
     }
-    else if(property == "followSpeed")
+}
+
+void SpawnScript::runScripts()
+{
+
+    if(this->useSpawn)
     {
-        float* follow = (float*) value;
-        this->followSpeed = *follow;
+        spawnNode();
     }
+
+}
+
+
+
+int SpawnScript::spawnNum = 0;
+
+//*****************
+//Particle System Functions
+//****************
+
+float gParticleTimeStep = 0.0f;
+
+partSys::partSys(glm::vec3 Pos, glm::vec3 _Vel, glm::vec3 _Accel, glm::vec3 _VelMag, Billboard _bb, float _duration, float _life, int _type){
+	Origin = Pos;
+	Vel = _Vel;
+	Accel = _Accel;
+	VelMag = _VelMag;
+	bb = _bb;
+	duration = _duration;
+	lifeSpan = _life;
+	rate = PARTICLE_FRAME_RATE; // one per frame, as before rates existed
+	type = _type;
+	count = 0;
+	age = 0.0f;
+	emitCarry = 0.0f;
+	startColor = endColor = glm::vec4(1, 1, 1, 1);
+	gpu = false;
+	TriMesh *quad = bb.triMesh;
+	startSize = endSize = bb.T.scale.x * ((quad != NULL && quad->sphereRadius > 0.0f) ? quad->boundsMax.x - quad->boundsMin.x : 1.0f);
+}
+
+void partSys::reserve(int n){
+	if (n <= (int)life.size()) return;
+	int capacity = max(n, 2 * (int)life.size());
+	capacity = (capacity + 3) & ~3;
+	vector<float> *arrays[] = { &posX, &posY, &posZ, &velX, &velY, &velZ, &life };
+	for (int i = 0; i < 7; i++) arrays[i]->resize(capacity, 0.0f);
+}
+
+void partSys::emit(int n){
+	n = min(n, MAX_PARTICLES - count);
+	if (n <= 0) return;
+	reserve(count + n);
+	for (int i = count; i < count + n; i++){
+		posX[i] = Origin.x;
+		posY[i] = Origin.y;
+		posZ[i] = Origin.z;
+		velX[i] = glm::linearRand(-VelMag.x, VelMag.x);
+		velY[i] = (type == PS_FOUNTAIN) ? glm::linearRand(0.0f, VelMag.y) : glm::linearRand(-VelMag.y, VelMag.y);
+		velZ[i] = glm::linearRand(-VelMag.z, VelMag.z);
+		life[i] = lifeSpan;
+	}
+	count += n;
+}
+
+void partSys::update(float dt){
+	float step = dt * PARTICLE_FRAME_RATE;
+	if (gpu){
+		age += step; // the particles moved in ParticleRenderer::simulate
+		return;
+	}
+	int n = (count + 3) & ~3; // the padding is integrated too, and ignored
+#ifdef USE_SSE
+	__m128 s = _mm_set1_ps(step);
+	__m128 ax = _mm_set1_ps(Accel.x * step), ay = _mm_set1_ps(Accel.y * step), az = _mm_set1_ps(Accel.z * step);
+	for (int i = 0; i < n; i += 4){
+		__m128 vx = _mm_loadu_ps(&velX[i]), vy = _mm_loadu_ps(&velY[i]), vz = _mm_loadu_ps(&velZ[i]);
+		_mm_storeu_ps(&posX[i], _mm_add_ps(_mm_loadu_ps(&posX[i]), _mm_mul_ps(vx, s)));
+		_mm_storeu_ps(&posY[i], _mm_add_ps(_mm_loadu_ps(&posY[i]), _mm_mul_ps(vy, s)));
+		_mm_storeu_ps(&posZ[i], _mm_add_ps(_mm_loadu_ps(&posZ[i]), _mm_mul_ps(vz, s)));
+		_mm_storeu_ps(&velX[i], _mm_add_ps(vx, ax));
+		_mm_storeu_ps(&velY[i], _mm_add_ps(vy, ay));
+		_mm_storeu_ps(&velZ[i], _mm_add_ps(vz, az));
+		_mm_storeu_ps(&life[i], _mm_sub_ps(_mm_loadu_ps(&life[i]), s));
+	}
+#else
+	for (int i = 0; i < n; i++){
+		posX[i] += velX[i] * step;
+		posY[i] += velY[i] * step;
+		posZ[i] += velZ[i] * step;
+		velX[i] += Accel.x * step;
+		velY[i] += Accel.y * step;
+		velZ[i] += Accel.z * step;
+		life[i] -= step;
+	}
+#endif
+
+	// swap remove, order does not matter
+	for (int i = 0; i < count;){
+		if (life[i] >= 0.0f){
+			i++;
+			continue;
+		}
+		count--;
+		posX[i] = posX[count];
+		posY[i] = posY[count];
+		posZ[i] = posZ[count];
+		velX[i] = velX[count];
+		velY[i] = velY[count];
+		velZ[i] = velZ[count];
+		life[i] = life[count];
+	}
+
+	// emit while the system lasts, carrying fractions over to the next step
+	if (age <= duration){
+		emitCarry += rate * dt;
+		int born = (int)emitCarry;
+		emitCarry -= born;
+		emit(born);
+	}
+	age += step;
 }
 
-void MoveScript::setValue(string property, void* value1, void* value2)
+//-------------------------------------------------------------------------//
+
+static const char *PARTICLE_VERTEX_SHADER =
+	"#version 410 core\n"
+	"layout(location=0) in vec2 vCorner;\n"
+	"layout(location=1) in vec4 aParticle; // position, size\n"
+	"layout(location=2) in vec4 aParticleColor;\n"
+	"uniform mat4 uViewPerspectM;\n"
+	"uniform vec3 uBillboardRight, uBillboardUp;\n"
+	"out vec2 fST; out vec4 fColor;\n"
+	"void main(){\n"
+	"	vec3 p = aParticle.xyz + (vCorner.x * uBillboardRight + vCorner.y * uBillboardUp) * aParticle.w;\n"
+	"	gl_Position = uViewPerspectM * vec4(p, 1);\n"
+	"	fST = vCorner + 0.5; fColor = aParticleColor;\n"
+	"}\n";
+
+static const char *PARTICLE_FRAGMENT_SHADER =
+	"#version 410 core\n"
+	"in vec2 fST; in vec4 fColor;\n"
+	"uniform sampler2D uTexture;\n"
+	"uniform int uUseTexture;\n"
+	"out vec4 outColor;\n"
+	"void main(){ outColor = (uUseTexture != 0) ? fColor * texture(uTexture, fST) : fColor; }\n";
+
+ParticleRenderer::ParticleRenderer(void)
 {
-    if(property == "rotate")
-    {
-        glm::vec3* vecPtr = (glm::vec3*) value1;
-        this->axis = *vecPtr;
-        
-        float* flPtr = (float*) value2;
-        this->angle = *flPtr;
-    }
+	program = vao = quadBuffer = indexBuffer = instanceBuffer = NULL_HANDLE;
+	instanceBufferSize = 0;
+	updateProgram = gpuDrawProgram = NULL_HANDLE;
+}
+
+bool ParticleRenderer::init(void)
+{
+	if (program != NULL_HANDLE) return true;
+	GLuint vs = compileShader(PARTICLE_VERTEX_SHADER, GL_VERTEX_SHADER, "particle vertex shader");
+	GLuint fs = compileShader(PARTICLE_FRAGMENT_SHADER, GL_FRAGMENT_SHADER, "particle fragment shader");
+	if (vs == NULL_HANDLE || fs == NULL_HANDLE) return false;
+	program = createShaderProgram(vs, fs);
+	if (program == NULL_HANDLE) return false;
+
+	// one unit quad shared by every particle
+	const float corners[] = { -0.5f, -0.5f, 0.5f, -0.5f, 0.5f, 0.5f, -0.5f, 0.5f };
+	const unsigned short quad[] = { 0, 1, 2, 0, 2, 3 };
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+	glGenBuffers(1, &quadBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, quadBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+	glGenBuffers(1, &indexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+
+	glGenBuffers(1, &instanceBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(ParticleInstance), (void*)0);
+	glVertexAttribDivisor(1, 1);
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(ParticleInstance), (void*)(4 * sizeof(float)));
+	glVertexAttribDivisor(2, 1);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	return true;
 }
 
+void ParticleRenderer::draw(partSys &system, Camera &camera)
+{
+	if (system.gpu) {
+		drawGpu(system, camera);
+		return;
+	}
+	int count = system.count;
+	if (count == 0 || !init()) return;
+
+	instanceData.resize(count);
+	float fade = (system.lifeSpan > 0.0f) ? 1.0f / system.lifeSpan : 0.0f;
+	for (int i = 0; i < count; i++) {
+		float t = glm::clamp(1.0f - system.life[i] * fade, 0.0f, 1.0f);
+		glm::vec4 color = system.startColor + (system.endColor - system.startColor) * t;
+		ParticleInstance &p = instanceData[i];
+		p.x = system.posX[i];
+		p.y = system.posY[i];
+		p.z = system.posZ[i];
+		p.size = system.startSize + (system.endSize - system.startSize) * t;
+		for (int c = 0; c < 4; c++) p.color[c] = (unsigned char)(glm::clamp(color[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+	}
+
+	// orphan the old storage rather than wait for draws still reading it
+	size_t bytes = instanceData.size() * sizeof(ParticleInstance);
+	glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+	if (bytes > instanceBufferSize) instanceBufferSize = bytes;
+	glBufferData(GL_ARRAY_BUFFER, instanceBufferSize, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, &instanceData[0]);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
+	glUseProgram(program);
+	drawInstances(system, camera, getShaderProgram(program), vao, count);
+}
 
-void MoveScript::setValue(string property1, string property2, void* value)
+// camera, billboard axes and texture, then the instanced quads, with p in use
+void ParticleRenderer::drawInstances(partSys &system, Camera &camera, ShaderProgram *p, GLuint instanceVao, int count)
 {
-    if(property1 == "maxTrans")
-    {
-        float* max = (float*) value;
-        
-        
-        
-        if(property2 == "X" || property2 == "x")
-        {
-            this->maxTransX = *max;
-        }
-        else if(property2 == "Y" || property2 == "y")
-        {
-            this->maxTransY = *max;
-        }
-        else if(property2 =="Z" || property2 == "z")
-        {
-            this->maxTransZ = *max;
-        }
-    }
+	// the camera's axes, or its right axis kept level for upright billboards
+	glm::vec3 zz = glm::normalize(camera.eye - camera.center);
+	glm::vec3 right = glm::normalize(glm::cross(camera.vup, zz));
+	glm::vec3 up = glm::cross(zz, right);
+	if (system.bb.type == 0) {
+		up = glm::vec3(0, 1, 0);
+		glm::vec3 level(right.x, 0.0f, right.z);
+		if (glm::dot(level, level) > 0.0f) right = glm::normalize(level);
+	}
+
+	glUniformMatrix4fv(p->uViewPerspectM, 1, GL_FALSE, glm::value_ptr(camera.worldViewProject));
+	glUniform3fv(p->getUniform("uBillboardRight"), 1, &right[0]);
+	glUniform3fv(p->getUniform("uBillboardUp"), 1, &up[0]);
+	vector< NameIdVal<RGBAImage*> > &textures = system.bb.mat.textures;
+	bool textured = !textures.empty() && textures[0].val != NULL && textures[0].val->textureId != NULL_HANDLE;
+	glUniform1i(p->getUniform("uUseTexture"), textured ? 1 : 0);
+	if (textured) {
+		glActiveTexture(GL_TEXTURE0);
+		glUniform1i(p->getUniform("uTexture"), 0);
+		glBindTexture(GL_TEXTURE_2D, textures[0].val->textureId);
+		gRenderStats.textureBinds++;
+	}
+
+	glBindVertexArray(instanceVao);
+	glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, (void*)0, count);
+	glBindVertexArray(0);
 
+	gRenderStats.programBinds++;
+	gRenderStats.vaoBinds++;
+	gRenderStats.drawCalls++;
+	gRenderStats.instancedDraws++;
+	gRenderStats.instances += count;
 }
 
+//-------------------------------------------------------------------------//
 
+// One slot per vertex, rasterizer off; the outputs are the next frame's slots
+static const char *PARTICLE_UPDATE_SHADER =
+	"#version 410 core\n"
+	"layout(location=0) in vec4 vPositionLife;\n"
+	"layout(location=1) in vec3 vVelocity;\n"
+	"layout(location=2) in uint vSeed;\n"
+	"uniform vec3 uOrigin, uAccel, uVelMag;\n"
+	"uniform int uType, uEmitting;\n"
+	"uniform float uStep, uLifeSpan;\n"
+	"out vec4 tfPositionLife; out vec3 tfVelocity; flat out uint tfSeed;\n"
+	"uint hash(uint x){ x ^= x >> 16; x *= 0x7feb352du; x ^= x >> 15; x *= 0x846ca68bu; x ^= x >> 16; return x; }\n"
+	"float random(inout uint s){ s = hash(s); return float(s >> 8) * (1.0 / 16777216.0); }\n"
+	"void main(){\n"
+	"	vec3 p = vPositionLife.xyz, v = vVelocity;\n"
+	"	float life = vPositionLife.w;\n"
+	"	uint seed = vSeed;\n"
+	"	bool spawn = false;\n"
+	"	if (life > 0.0) { p += v * uStep; v += uAccel * uStep; life -= uStep; spawn = (life <= 0.0); }\n"
+	"	else if (life > -1e29) { life += uStep; spawn = (life >= 0.0); }\n"
+	"	if (spawn && uEmitting == 0) life = -1e30;\n"
+	"	else if (spawn) {\n"
+	"		life += uLifeSpan;\n"
+	"		p = uOrigin;\n"
+	"		v.x = mix(-uVelMag.x, uVelMag.x, random(seed));\n"
+	"		v.y = (uType == 0) ? uVelMag.y * random(seed) : mix(-uVelMag.y, uVelMag.y, random(seed));\n"
+	"		v.z = mix(-uVelMag.z, uVelMag.z, random(seed));\n"
+	"	}\n"
+	"	tfPositionLife = vec4(p, life); tfVelocity = v; tfSeed = seed;\n"
+	"}\n";
+
+// same quad as PARTICLE_VERTEX_SHADER, with size and color worked out from life
+static const char *PARTICLE_GPU_VERTEX_SHADER =
+	"#version 410 core\n"
+	"layout(location=0) in vec2 vCorner;\n"
+	"layout(location=1) in vec4 aPositionLife;\n"
+	"uniform mat4 uViewPerspectM;\n"
+	"uniform vec3 uBillboardRight, uBillboardUp;\n"
+	"uniform vec4 uStartColor, uEndColor;\n"
+	"uniform float uStartSize, uEndSize, uLifeSpan;\n"
+	"out vec2 fST; out vec4 fColor;\n"
+	"void main(){\n"
+	"	float t = clamp(1.0 - aPositionLife.w / uLifeSpan, 0.0, 1.0);\n"
+	"	float size = (aPositionLife.w > 0.0) ? mix(uStartSize, uEndSize, t) : 0.0;\n"
+	"	vec3 p = aPositionLife.xyz + (vCorner.x * uBillboardRight + vCorner.y * uBillboardUp) * size;\n"
+	"	gl_Position = uViewPerspectM * vec4(p, 1);\n"
+	"	fST = vCorner + 0.5; fColor = clamp(mix(uStartColor, uEndColor, t), 0.0, 1.0);\n"
+	"}\n";
+
+#define GPU_PARTICLE_BYTES (8 * sizeof(float))
+
+void GpuParticleState::release(void)
+{
+	if (buffers[0] == NULL_HANDLE) return;
+	glDeleteBuffers(2, buffers);
+	glDeleteVertexArrays(2, updateVaos);
+	glDeleteVertexArrays(2, drawVaos);
+	buffers[0] = buffers[1] = updateVaos[0] = updateVaos[1] = drawVaos[0] = drawVaos[1] = NULL_HANDLE;
+	capacity = 0;
+}
 
-void MoveScript::globalRotate()
+bool ParticleRenderer::initGpu(partSys &system)
 {
-    node->meshInst->T.rotateGlobal(axis, angle);
+	GpuParticleState &state = system.gpuState;
+	if (state.buffers[0] != NULL_HANDLE) return true;
+	if (!init()) return false;
+	if (updateProgram == NULL_HANDLE) {
+		// varyings have to be named before linking, so no createShaderProgram
+		GLuint vs = compileShader(PARTICLE_UPDATE_SHADER, GL_VERTEX_SHADER, "particle update shader");
+		if (vs == NULL_HANDLE) return false;
+		GLuint handle = glCreateProgram();
+		glAttachShader(handle, vs);
+		const char *varyings[] = { "tfPositionLife", "tfVelocity", "tfSeed" };
+		glTransformFeedbackVaryings(handle, 3, varyings, GL_INTERLEAVED_ATTRIBS);
+		glLinkProgram(handle);
+		int linked;
+		glGetProgramiv(handle, GL_LINK_STATUS, &linked);
+		if (!linked) {
+			ERROR("could not link the particle update shader", false);
+			deleteShaderProgram(handle);
+			return false;
+		}
+		setupShaderProgram(handle);
+		updateProgram = handle;
+	}
+	if (gpuDrawProgram == NULL_HANDLE) {
+		gpuDrawProgram = createShaderProgram(compileShader(PARTICLE_GPU_VERTEX_SHADER, GL_VERTEX_SHADER, "gpu particle vertex shader"),
+			compileShader(PARTICLE_FRAGMENT_SHADER, GL_FRAGMENT_SHADER, "particle fragment shader"));
+		if (gpuDrawProgram == NULL_HANDLE) return false;
+	}
+
+	// enough slots for rate particles a second, each living lifeSpan frames
+	double slots = ceil(system.rate * system.lifeSpan / PARTICLE_FRAME_RATE);
+	state.capacity = (int)fmax(1.0, fmin(slots, (double)MAX_GPU_PARTICLES));
+	struct Slot {
+		float position[3], life;
+		float velocity[3];
+		unsigned int seed;
+	};
+	vector<Slot> slots0(state.capacity);
+	unsigned int base = (unsigned int)rand() * 2654435761u;
+	for (int i = 0; i < state.capacity; i++) {
+		Slot &s = slots0[i];
+		s.position[0] = system.Origin.x;
+		s.position[1] = system.Origin.y;
+		s.position[2] = system.Origin.z;
+		s.life = -system.lifeSpan * (i + 1) / state.capacity; // births spread over one life
+		s.velocity[0] = s.velocity[1] = s.velocity[2] = 0.0f;
+		s.seed = base + (unsigned int)i;
+	}
+
+	glGenBuffers(2, state.buffers);
+	glGenVertexArrays(2, state.updateVaos);
+	glGenVertexArrays(2, state.drawVaos);
+	for (int b = 0; b < 2; b++) {
+		glBindBuffer(GL_ARRAY_BUFFER, state.buffers[b]);
+		glBufferData(GL_ARRAY_BUFFER, (size_t)state.capacity * GPU_PARTICLE_BYTES, (b == 0) ? &slots0[0] : NULL, GL_DYNAMIC_COPY);
+
+		glBindVertexArray(state.updateVaos[b]);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, GPU_PARTICLE_BYTES, (void*)0);
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, GPU_PARTICLE_BYTES, (void*)(4 * sizeof(float)));
+		glEnableVertexAttribArray(2);
+		glVertexAttribIPointer(2, 1, GL_UNSIGNED_INT, GPU_PARTICLE_BYTES, (void*)(7 * sizeof(float)));
+
+		glBindVertexArray(state.drawVaos[b]);
+		glBindBuffer(GL_ARRAY_BUFFER, quadBuffer);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, state.buffers[b]);
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, GPU_PARTICLE_BYTES, (void*)0);
+		glVertexAttribDivisor(1, 1);
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	state.current = 0;
+	return true;
 }
 
-void MoveScript::localRotate()
+void ParticleRenderer::simulate(partSys &system, float dt)
 {
-    node->meshInst->T.scale = scaleVec;
+	if (!system.gpu || !initGpu(system)) return;
+	GpuParticleState &state = system.gpuState;
+
+	glUseProgram(updateProgram);
+	ShaderProgram *p = getShaderProgram(updateProgram);
+	glUniform3fv(p->getUniform("uOrigin"), 1, &system.Origin[0]);
+	glUniform3fv(p->getUniform("uAccel"), 1, &system.Accel[0]);
+	glUniform3fv(p->getUniform("uVelMag"), 1, &system.VelMag[0]);
+	glUniform1i(p->getUniform("uType"), system.type);
+	glUniform1i(p->getUniform("uEmitting"), (system.age <= system.duration) ? 1 : 0);
+	glUniform1f(p->getUniform("uStep"), dt * PARTICLE_FRAME_RATE);
+	glUniform1f(p->getUniform("uLifeSpan"), system.lifeSpan);
+
+	// read the current buffer, write the other one
+	int next = 1 - state.current;
+	glEnable(GL_RASTERIZER_DISCARD);
+	glBindVertexArray(state.updateVaos[state.current]);
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, state.buffers[next]);
+	glBeginTransformFeedback(GL_POINTS);
+	glDrawArrays(GL_POINTS, 0, state.capacity);
+	glEndTransformFeedback();
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+	glBindVertexArray(0);
+	glDisable(GL_RASTERIZER_DISCARD);
+	state.current = next;
+	gRenderStats.programBinds++;
+	gRenderStats.drawCalls++;
 }
 
-void MoveScript::localTrans()
+void ParticleRenderer::drawGpu(partSys &system, Camera &camera)
 {
-    node->meshInst->T.translateLocal(transVec);
+	if (!initGpu(system)) return;
+	GpuParticleState &state = system.gpuState;
+	glUseProgram(gpuDrawProgram);
+	ShaderProgram *p = getShaderProgram(gpuDrawProgram);
+	glUniform4fv(p->getUniform("uStartColor"), 1, &system.startColor[0]);
+	glUniform4fv(p->getUniform("uEndColor"), 1, &system.endColor[0]);
+	glUniform1f(p->getUniform("uStartSize"), system.startSize);
+	glUniform1f(p->getUniform("uEndSize"), system.endSize);
+	glUniform1f(p->getUniform("uLifeSpan"), system.lifeSpan);
+	drawInstances(system, camera, p, state.drawVaos[state.current], state.capacity);
 }
 
-void MoveScript::globalTrans()
+//*****************
+//Benchmarks
+//****************
+
+void benchLoadMesh(const string &fileName, int iterations)
 {
-    node->meshInst->T.translateGlobal(transVec);
+	string fullName;
+	if (!getFullFileName(fileName, fullName)) {
+		ERROR("Could not open file " + fileName, false);
+		return;
+	}
+	if (iterations < 1) iterations = 1;
+	string cacheName = fullName + MESH_CACHE_EXTENSION;
+	size_t numFloats = 0, numIndices = 0;
+
+	// ASCII parse of the ply
+	double start = WALL_TIME();
+	for (int i = 0; i < iterations; i++) {
+		TriMesh mesh;
+		mesh.readFromPly(fileName);
+		if (i == 0) {
+			mesh.writeToCache(cacheName, false);
+			numFloats = mesh.vertexData.size();
+			numIndices = mesh.indices.size();
+		}
+	}
+	double asciiTime = (WALL_TIME() - start) / iterations;
+
+	// binary cache, single read
+	start = WALL_TIME();
+	for (int i = 0; i < iterations; i++) {
+		TriMesh mesh;
+		if (!mesh.readFromCache(cacheName, false, false) ||
+			mesh.vertexData.size() != numFloats || mesh.indices.size() != numIndices) {
+			ERROR("binary mesh cache mismatch", false);
+		}
+	}
+	double readTime = (WALL_TIME() - start) / iterations;
+
+	// binary cache, mmap
+	start = WALL_TIME();
+	for (int i = 0; i < iterations; i++) {
+		TriMesh mesh;
+		if (!mesh.readFromCache(cacheName, false, true) ||
+			mesh.vertexData.size() != numFloats || mesh.indices.size() != numIndices) {
+			ERROR("mapped mesh cache mismatch", false);
+		}
+	}
+	double mmapTime = (WALL_TIME() - start) / iterations;
+
+	printf("loadMesh '%s': %d floats, %d indices, %d iterations\n",
+		fileName.c_str(), (int)numFloats, (int)numIndices, iterations);
+	printf("  ascii ply    %9.3f ms\n", asciiTime * 1000.0);
+	printf("  binary read  %9.3f ms  (%.1fx)\n", readTime * 1000.0, asciiTime / readTime);
+	printf("  binary mmap  %9.3f ms  (%.1fx)\n", mmapTime * 1000.0, asciiTime / mmapTime);
 }
-void MoveScript::setScale()
+
+//-------------------------------------------------------------------------//
+
+void benchTokenizer(const string &fileName, const string &oneCharTokens, int iterations)
 {
-    node->meshInst->T.scale = scaleVec;
+	if (iterations < 1) iterations = 1;
+	string fullName;
+	if (!getFullFileName(fileName, fullName)) {
+		ERROR("Could not open file " + fileName, false);
+		return;
+	}
+	struct stat st;
+	stat(fullName.c_str(), &st);
+	double megabytes = (double)st.st_size / (1024.0 * 1024.0);
+
+	// old path: getc per character, sscanf per number
+	int oldTokens = 0, oldNumbers = 0;
+	double oldSum = 0.0;
+	double start = WALL_TIME();
+	for (int i = 0; i < iterations; i++) {
+		FILE *f = fopen(fullName.c_str(), "rb");
+		string token;
+		oldTokens = oldNumbers = 0;
+		oldSum = 0.0;
+		while (getToken(f, token, oneCharTokens)) {
+			oldTokens++;
+			if (isdigit((unsigned char)token[0]) || token[0] == '-') {
+				float val = 0.0f;
+				sscanf(token.c_str(), "%f", &val);
+				oldSum += val;
+				oldNumbers++;
+			}
+		}
+		fclose(f);
+	}
+	double oldTime = (WALL_TIME() - start) / iterations;
+
+	// new path: mapped buffer, class table, from_chars
+	int newTokens = 0, newNumbers = 0;
+	double newSum = 0.0;
+	start = WALL_TIME();
+	for (int i = 0; i < iterations; i++) {
+		MappedFile file;
+		file.open(fullName);
+		Tokenizer t;
+		t.setBuffer((const char*)file.data, file.size);
+		string_view token;
+		newTokens = newNumbers = 0;
+		newSum = 0.0;
+		while (t.next(token, oneCharTokens)) {
+			newTokens++;
+			if (isdigit((unsigned char)token[0]) || token[0] == '-') {
+				float val = 0.0f;
+				from_chars(token.data(), token.data() + token.length(), val);
+				newSum += val;
+				newNumbers++;
+			}
+		}
+	}
+	double newTime = (WALL_TIME() - start) / iterations;
+
+	printf("tokenize '%s': %.2f MB, %d tokens, %d numbers\n",
+		fileName.c_str(), megabytes, newTokens, newNumbers);
+	if (oldTokens != newTokens || oldNumbers != newNumbers || oldSum != newSum) {
+		printf("  MISMATCH: getToken found %d tokens, %d numbers\n", oldTokens, oldNumbers);
+	}
+	printf("  getToken   %9.3f ms  %8.1f MB/s\n", oldTime * 1000.0, megabytes / oldTime);
+	printf("  Tokenizer  %9.3f ms  %8.1f MB/s  (%.1fx)\n", newTime * 1000.0, megabytes / newTime, oldTime / newTime);
 }
 
-void MoveScript::localTransLimited()
+//-------------------------------------------------------------------------//
+
+static int gBenchWidth = 0, gBenchHeight = 0; // framebuffer of the bench window
+
+// the window, context and light buffer every GL benchmark starts from
+static void setupBenchWindow(int width, int height, const char *title)
 {
-    if(!minSet)
-    {
-        this->minTransX = node->meshInst->T.translation.x;
-        this->minTransY = node->meshInst->T.translation.y;
-        this->minTransZ = node->meshInst->T.translation.z;
-        minSet = true;
-        //cout << "reached it" << endl;
-    }
-    
-    globalTrans();
-    
-    if(this->minTransZ > node->meshInst->T.translation.z)
-    {
-        transVec.z = -transVec.z;
-    }
-    else if(this->maxTransZ < node->meshInst->T.translation.z)
-    {
-        transVec.z = -transVec.z;
-    }
-    
-    if(this->minTransX > node->meshInst->T.translation.x)
-    {
-        transVec.x = -transVec.x;
-    }
-    else if(this->maxTransX < node->meshInst->T.translation.x)
-    {
-        transVec.x = -transVec.x;
-    }
-    
-    if(this->minTransY > node->meshInst->T.translation.y)
-    {
-        transVec.y = -transVec.y;
-    }
-    else if(this->maxTransY < node->meshInst->T.translation.y)
-    {
-        transVec.y = -transVec.y;
-    }
-    
-    node->meshInst->T.refreshTransform();
-    //camera->refreshTransform(600, 600);
+	GLFWwindow *window = createOpenGLWindow(width, height, title);
+	initLightBuffer();
+	glfwGetFramebufferSize(window, &gBenchWidth, &gBenchHeight);
 }
 
-void MoveScript::followPlayer()
+// points a benchmark's camera and refreshes it for the bench window
+static void aimBenchCamera(Camera &camera, const glm::vec3 &eye, const glm::vec3 &center,
+	float znear, float zfar, float fovy = 1.0f)
 {
-    //cout << "Player y = " << playerNode->meshInst->T.translation.z << endl;
-    //cout << "Node y = " << node->meshInst->T.translation.z << endl;
+	camera.eye = eye;
+	camera.center = center;
+	camera.vup = glm::vec3(0, 1, 0);
+	camera.fovy = fovy;
+	camera.znear = znear;
+	camera.zfar = zfar;
+	camera.refreshTransform((float)gBenchWidth, (float)gBenchHeight);
+}
 
-    
-    float zDist = node->meshInst->T.translation.z - targetNode->meshInst->T.translation.z;
-    float yDist = node->meshInst->T.translation.y - targetNode->meshInst->T.translation.y;
-    float xDist = node->meshInst->T.translation.x - targetNode->meshInst->T.translation.x;
-   // cout << "yDist = " << yDist << " X Dist = " << xDist << endl;
+//-------------------------------------------------------------------------//
 
-    if(abs(zDist) <= followDist)
-    {
-        //return;
-    }
-    else
-    {
-        if(zDist < 0)
-        {
-            node->meshInst->T.translation.z += followSpeed;
-        }
-        else
-        {
-            node->meshInst->T.translation.z -= followSpeed;
-        }
-    }
-    
-    if(abs(yDist) <= followDist)
-    {
-       // cout << "return y" << endl;
-        //eturn;
-    }
-    else
-    {
-        if(yDist < 0)
-        {
-            node->meshInst->T.translation.y += followSpeed;
-        }
-        else
-        {
-            node->meshInst->T.translation.y -= followSpeed;
-        }
-        
-       // cout << "player changed dir node z = " << node->meshInst->T.translation.z << endl;
-    }
- 
-    if(abs(xDist) <= followDist)
-    {
-        //cout << "return x" << endl;
-        //return;
-        
-    }
-    else
-    {
-        if(xDist < 0)
-        {
-            node->meshInst->T.translation.x += followSpeed;
-        }
-        else
-        {
-            node->meshInst->T.translation.x -= followSpeed;
-        }
-        
-    }
-    
+void benchDrawNodes(const string &meshFile, const string &vsFile, const string &fsFile,
+	int numNodes, int numFrames)
+{
+	if (numNodes < 1) numNodes = 1;
+	if (numFrames < 1) numFrames = 1;
+
+	setupBenchWindow(640, 480, "benchDrawNodes");
+
+	TriMesh *mesh = new TriMesh();
+	mesh->load(meshFile);
+	mesh->sendToOpenGL();
+	GLuint program = createShaderProgram(loadShader(vsFile, GL_VERTEX_SHADER),
+		loadShader(fsFile, GL_FRAGMENT_SHADER));
+	if (program == NULL_HANDLE) return;
+
+	// a square grid of nodes in front of the camera
+	Scene scene;
+	scene.backgroundColor = glm::vec3(0, 0, 0);
+	int side = (int)ceil(sqrt((double)numNodes));
+	for (int i = 0; i < numNodes; i++) {
+		TriMeshInstance instance;
+		instance.setMesh(mesh);
+		instance.mat.shaderProgram = program;
+		instance.setTranslation(glm::vec3(2.0f * (i % side - side / 2), 2.0f * (i / side - side / 2), 0.0f));
+		Node *node = new Node();
+		node->meshInst = new TriMeshInstance(instance);
+		ostringstream name;
+		name << "node" << i;
+		node->name = name.str();
+		scene.addNode(node);
+	}
+	aimBenchCamera(scene.camera, glm::vec3(0, 0, 2.5f * side), glm::vec3(0, 0, 0), 0.1f, 10.0f * side);
+
+	// what the per draw lookups used to cost
+	const char *names[] = { "uObjectWorldM", "uObjectWorldInverseM", "uObjectPerpsectM", "uView" };
+	ShaderProgram *p = getShaderProgram(program);
+	GLint sum = 0;
+	double start = WALL_TIME();
+	for (int i = 0; i < numNodes; i++) {
+		for (int j = 0; j < 4; j++) sum += glGetUniformLocation(program, names[j]);
+	}
+	double lookupTime = WALL_TIME() - start;
+	start = WALL_TIME();
+	for (int i = 0; i < numNodes; i++) {
+		sum += p->uObjectWorldM + p->uObjectWorldInverseM + p->uObjectPerpsectM + p->uView;
+	}
+	double cachedTime = WALL_TIME() - start;
+
+	// frame cost, CPU submission separately from waiting on the GPU
+	scene.render();
+	glFinish();
+	double submitTime = 0.0, finishTime = 0.0;
+	for (int i = 0; i < numFrames; i++) {
+		start = WALL_TIME();
+		scene.render();
+		double mid = WALL_TIME();
+		glFinish();
+		submitTime += mid - start;
+		finishTime += WALL_TIME() - mid;
+	}
+
+	printf("drawNodes: %d nodes, %d frames (%d)\n", numNodes, numFrames, (int)(sum & 1));
+	printf("  glGetUniformLocation x4/node  %9.3f ms per frame\n", lookupTime * 1000.0);
+	printf("  cached slots x4/node          %9.3f ms per frame\n", cachedTime * 1000.0);
+	printf("  render submit                 %9.3f ms per frame (%.2f us per node)\n",
+		submitTime * 1000.0 / numFrames, submitTime * 1e6 / numFrames / numNodes);
+	printf("  glFinish                      %9.3f ms per frame\n", finishTime * 1000.0 / numFrames);
+	printf("  per frame: %d packets, %d draws, %d program binds, %d texture binds, %d vao binds\n",
+		gRenderStats.packets, gRenderStats.drawCalls, gRenderStats.programBinds,
+		gRenderStats.textureBinds, gRenderStats.vaoBinds);
+	printf("  instanced: %d draws covering %d packets\n", gRenderStats.instancedDraws, gRenderStats.instances);
+	printf("  culling: %d visible, %d culled\n", gRenderStats.visibleNodes, gRenderStats.culledNodes);
+	printf("  triangles: %d submitted of %d at full detail, nodes per level %d/%d/%d/%d, %d too small\n",
+		gRenderStats.trianglesSubmitted, gRenderStats.trianglesFull, gRenderStats.lodNodes[0],
+		gRenderStats.lodNodes[1], gRenderStats.lodNodes[2], gRenderStats.lodNodes[3], gRenderStats.tooSmallNodes);
 }
 
-void MoveScript::faceTarget()
+//-------------------------------------------------------------------------//
+
+void benchShaderCache(const string &vsFile, const string &fsFile, int iterations)
 {
-    glm::vec3 objToCamProj;
-    float angleY, angleX;
-    
-    objToCamProj = glm::vec3(targetNode->meshInst->T.translation);
-    objToCamProj = glm::normalize(objToCamProj);
-    angleY = -atan2(objToCamProj.x, objToCamProj.z);
-    angleX = asin(objToCamProj.y);
-    node->meshInst->T.rotation = glm::quat(sin(angleY / 2), glm::vec3(0, cos(angleY / 2), 0));
-    node->meshInst->T.rotation *= glm::quat(cos(angleX / 2), glm::vec3(sin(angleX / 2), 0, 0));
+	if (iterations < 1) iterations = 1;
+
+	setupBenchWindow(640, 480, "benchShaderCache");
+	if (!shaderBinariesSupported()) {
+		ERROR("driver exposes no program binary formats", false);
+		return;
+	}
+
+	string vsCode, fsCode;
+	if (!loadShaderSource(vsFile, vsCode) || !loadShaderSource(fsFile, fsCode)) return;
+	uint64_t binaryKey = programBinaryKey(hashString(fsCode, hashString(string(1, '\0'), hashString(vsCode))));
+	string cacheName = programBinaryFileName(binaryKey);
+
+	// compile and link from source, no cache involved
+	gUseShaderCache = false;
+	double start = WALL_TIME();
+	for (int i = 0; i < iterations; i++) {
+		deleteShaderProgram(buildShaderProgram(vsCode, fsCode, vsFile, fsFile));
+	}
+	glFinish();
+	double sourceTime = (WALL_TIME() - start) / iterations;
+
+	// cold cache: compile, link and write the binary out
+	gUseShaderCache = true;
+	start = WALL_TIME();
+	for (int i = 0; i < iterations; i++) {
+		remove(cacheName.c_str());
+		GLuint program = buildShaderProgram(vsCode, fsCode, vsFile, fsFile);
+		saveProgramBinary(cacheName, binaryKey, program);
+		deleteShaderProgram(program);
+	}
+	glFinish();
+	double coldTime = (WALL_TIME() - start) / iterations;
+
+	// warm cache: hand the stored binary straight back to the driver
+	int failures = 0;
+	start = WALL_TIME();
+	for (int i = 0; i < iterations; i++) {
+		GLuint program = loadProgramBinary(cacheName, binaryKey);
+		if (program == NULL_HANDLE) failures++;
+		deleteShaderProgram(program);
+	}
+	glFinish();
+	double warmTime = (WALL_TIME() - start) / iterations;
+
+	printf("benchShaderCache %s + %s, %d iterations\n", vsFile.c_str(), fsFile.c_str(), iterations);
+	printf("  driver     %s / %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+	printf("  source     %9.3f ms\n", sourceTime * 1000.0);
+	printf("  cold cache %9.3f ms\n", coldTime * 1000.0);
+	printf("  warm cache %9.3f ms  (%.1fx)%s\n", warmTime * 1000.0, sourceTime / warmTime,
+		failures ? "  BINARY REJECTED" : "");
+}
+
+//-------------------------------------------------------------------------//
+
+void benchSceneBVH(int numNodes, int numQueries)
+{
+	if (numNodes < 1) numNodes = 1;
+	if (numQueries < 1) numQueries = 1;
+
+	// only the bounds of the mesh matter, it is never uploaded
+	TriMesh mesh;
+	mesh.boundsMin = glm::vec3(-1, -1, -1);
+	mesh.boundsMax = glm::vec3(1, 1, 1);
+	mesh.sphereCenter = glm::vec3(0, 0, 0);
+	mesh.sphereRadius = sqrt(3.0f);
+	TriMeshInstance instance;
+	instance.setMesh(&mesh);
+
+	// scatter the nodes at a fixed density, so queries find similar counts at any size
+	float side = 4.0f * (float)cbrt((double)numNodes);
+	srand(1);
+	map<string, Node*> nodes;
+	for (int i = 0; i < numNodes; i++) {
+		Node *node = new Node(&instance);
+		node->meshInst->T.translation = glm::vec3(side * (rand() / (float)RAND_MAX - 0.5f),
+			side * (rand() / (float)RAND_MAX - 0.5f), side * (rand() / (float)RAND_MAX - 0.5f));
+		ostringstream name;
+		name << "node" << i;
+		node->name = name.str();
+		nodes[node->name] = node;
+	}
+
+	TransformHierarchy hierarchy;
+	SceneBVH bvh;
+	hierarchy.build(nodes);
+	double start = WALL_TIME();
+	hierarchy.update();
+	bvh.update(hierarchy, true);
+	double buildTime = WALL_TIME() - start;
+
+	// a tenth of the nodes drift each frame
+	int numFrames = 10;
+	start = WALL_TIME();
+	for (int f = 0; f < numFrames; f++) {
+		for (int i = 0; i < numNodes / 10; i++) {
+			hierarchy.nodes[rand() % numNodes]->meshInst->T.translation +=
+				glm::vec3(rand() / (float)RAND_MAX - 0.5f, 0.0f, rand() / (float)RAND_MAX - 0.5f) * 0.2f;
+		}
+		hierarchy.update();
+		bvh.update(hierarchy, false);
+	}
+	double moveTime = (WALL_TIME() - start) / numFrames;
+
+	// the same queries by brute force, to check against and compare with
+	vector<glm::vec3> lo(numNodes), hi(numNodes);
+	for (int i = 0; i < numNodes; i++) nodeWorldBounds(hierarchy.nodes[i], hierarchy.worlds[i], lo[i], hi[i]);
+	vector<glm::vec3> points(numQueries), dirs(numQueries);
+	for (int q = 0; q < numQueries; q++) {
+		points[q] = glm::vec3(side * (rand() / (float)RAND_MAX - 0.5f),
+			side * (rand() / (float)RAND_MAX - 0.5f), side * (rand() / (float)RAND_MAX - 0.5f));
+		dirs[q] = glm::normalize(glm::vec3(rand() / (float)RAND_MAX - 0.5f,
+			rand() / (float)RAND_MAX - 0.5f, rand() / (float)RAND_MAX - 0.5f) + glm::vec3(0, 0, 0.001f));
+	}
+	float radius = 5.0f;
+	int k = 8;
+	int mismatches = 0;
+	size_t sphereHits = 0, rayHits = 0;
+	vector<Node*> found;
+	vector<RayHit> hits;
+
+	start = WALL_TIME();
+	for (int q = 0; q < numQueries; q++) {
+		found.clear();
+		bvh.querySphere(points[q], radius, found);
+		sphereHits += found.size();
+	}
+	double sphereTime = WALL_TIME() - start;
+	start = WALL_TIME();
+	size_t bruteSphereHits = 0;
+	for (int q = 0; q < numQueries; q++) {
+		for (int i = 0; i < numNodes; i++) {
+			glm::vec3 d = glm::max(glm::max(lo[i] - points[q], points[q] - hi[i]), glm::vec3(0, 0, 0));
+			if (glm::dot(d, d) <= radius * radius) bruteSphereHits++;
+		}
+	}
+	double bruteSphereTime = WALL_TIME() - start;
+	if (sphereHits != bruteSphereHits) mismatches++;
+
+	vector<float> nearestDist(numQueries);
+	start = WALL_TIME();
+	for (int q = 0; q < numQueries; q++) {
+		found.clear();
+		bvh.queryNearest(points[q], k, found);
+		int last = found.back()->transformIndex;
+		glm::vec3 d = glm::max(glm::max(lo[last] - points[q], points[q] - hi[last]), glm::vec3(0, 0, 0));
+		nearestDist[q] = glm::dot(d, d);
+	}
+	double nearestTime = WALL_TIME() - start;
+	start = WALL_TIME();
+	vector<float> dists(numNodes);
+	for (int q = 0; q < numQueries; q++) {
+		for (int i = 0; i < numNodes; i++) {
+			glm::vec3 d = glm::max(glm::max(lo[i] - points[q], points[q] - hi[i]), glm::vec3(0, 0, 0));
+			dists[i] = glm::dot(d, d);
+		}
+		int kth = min(k, numNodes) - 1;
+		nth_element(dists.begin(), dists.begin() + kth, dists.end());
+		if (dists[kth] != nearestDist[q]) mismatches++;
+	}
+	double bruteNearestTime = WALL_TIME() - start;
+
+	start = WALL_TIME();
+	for (int q = 0; q < numQueries; q++) {
+		hits.clear();
+		bvh.queryRay(points[q], dirs[q], side, hits);
+		rayHits += hits.size();
+	}
+	double rayTime = WALL_TIME() - start;
+
+	printf("benchSceneBVH: %d nodes, %d queries, tree height %d\n", numNodes, numQueries, bvh.height());
+	printf("  build              %9.3f ms\n", buildTime * 1000.0);
+	printf("  update, 10%% moved  %9.3f ms per frame\n", moveTime * 1000.0);
+	printf("  sphere r=%.0f       %9.3f us per query, brute force %9.3f us (%.1f hits)\n", radius,
+		sphereTime * 1e6 / numQueries, bruteSphereTime * 1e6 / numQueries, sphereHits / (double)numQueries);
+	printf("  nearest k=%d        %9.3f us per query, brute force %9.3f us\n", k,
+		nearestTime * 1e6 / numQueries, bruteNearestTime * 1e6 / numQueries);
+	printf("  ray                %9.3f us per query (%.1f hits)\n",
+		rayTime * 1e6 / numQueries, rayHits / (double)numQueries);
+	if (mismatches) printf("  %d RESULTS DIFFER FROM BRUTE FORCE\n", mismatches);
+
+	for (map<string, Node*>::iterator it = nodes.begin(); it != nodes.end(); it++) {
+		delete it->second->meshInst;
+		delete it->second;
+	}
 }
 
+//-------------------------------------------------------------------------//
 
-void MoveScript::bulletTranslation()
+void benchBroadphase(int numBodies, int numFrames)
 {
-    if(scene->nodes["player"] != NULL)
-    {
-        node->meshInst->T.translateLocal(glm::vec3(0,0,-followSpeed), scene->camera);
-        distCounter += followSpeed;
-        if(distCounter >= maxDist)
-        {
-            scene->nodes.erase(node->name);
-            useBulletTrans = false;
-            //delete this;
-        }
-    }
-    
-    
+	if (numBodies < 2) numBodies = 2;
+	if (numFrames < 1) numFrames = 1;
+
+	TriMesh mesh;
+	mesh.boundsMin = glm::vec3(-1, -1, -1);
+	mesh.boundsMax = glm::vec3(1, 1, 1);
+	mesh.sphereCenter = glm::vec3(0, 0, 0);
+	mesh.sphereRadius = sqrt(3.0f);
+	TriMeshInstance instance;
+	instance.setMesh(&mesh);
+
+	// bodies bounce around a box at a density where each touches a few others
+	float side = 3.0f * (float)cbrt((double)numBodies);
+	srand(1);
+	map<string, Node*> nodes;
+	vector<glm::vec3> velocity;
+	int nextName = 0;
+	auto spawn = [&]() {
+		Node *node = new Node(&instance);
+		node->meshInst->T.translation = glm::vec3(side * (rand() / (float)RAND_MAX - 0.5f),
+			side * (rand() / (float)RAND_MAX - 0.5f), side * (rand() / (float)RAND_MAX - 0.5f));
+		ostringstream name;
+		name << "body" << nextName++;
+		node->name = name.str();
+		nodes[node->name] = node;
+	};
+	for (int i = 0; i < numBodies; i++) spawn();
+
+	TransformHierarchy hierarchy;
+	Broadphase broadphase;
+	hierarchy.build(nodes);
+	hierarchy.update();
+	double start = WALL_TIME();
+	broadphase.update(hierarchy, true);
+	double buildTime = WALL_TIME() - start;
+
+	double updateTime = 0.0;
+	size_t begins = 0, stays = 0, ends = 0;
+	for (int f = 0; f < numFrames; f++) {
+		// every tenth frame one body in a hundred is replaced
+		bool rebuilt = false;
+		if (f % 10 == 9) {
+			for (int i = 0; i < numBodies / 100; i++) {
+				map<string, Node*>::iterator it = nodes.find(hierarchy.nodes[rand() % hierarchy.size()]->name);
+				if (it == nodes.end()) continue;
+				delete it->second->meshInst;
+				delete it->second;
+				nodes.erase(it);
+				spawn();
+			}
+			hierarchy.build(nodes);
+			rebuilt = true;
+		}
+		if ((int)velocity.size() < nextName) velocity.resize(nextName);
+		for (int i = 0; i < hierarchy.size(); i++) {
+			Node *node = hierarchy.nodes[i];
+			glm::vec3 &v = velocity[atoi(node->name.c_str() + 4)];
+			if (v == glm::vec3(0, 0, 0)) {
+				v = glm::vec3(rand() / (float)RAND_MAX - 0.5f, rand() / (float)RAND_MAX - 0.5f,
+					rand() / (float)RAND_MAX - 0.5f) * 0.2f;
+			}
+			glm::vec3 &p = node->meshInst->T.translation;
+			p += v;
+			for (int axis = 0; axis < 3; axis++) {
+				if (fabs(p[axis]) > side * 0.5f) v[axis] = -v[axis];
+			}
+		}
+		hierarchy.update();
+		start = WALL_TIME();
+		broadphase.update(hierarchy, rebuilt);
+		updateTime += WALL_TIME() - start;
+		for (int i = 0; i < (int)broadphase.events.size(); i++) {
+			int type = broadphase.events[i].type;
+			if (type == CONTACT_BEGIN) begins++;
+			else if (type == CONTACT_STAY) stays++;
+			else ends++;
+		}
+	}
+
+	printf("benchBroadphase: %d bodies, %d frames\n", broadphase.numBodies(), numFrames);
+	printf("  first update     %9.3f ms\n", buildTime * 1000.0);
+	printf("  update           %9.3f ms per frame\n", updateTime * 1000.0 / numFrames);
+	printf("  per frame: %.1f begin, %.1f stay, %.1f end, %d pairs now\n", begins / (double)numFrames,
+		stays / (double)numFrames, ends / (double)numFrames, broadphase.numPairs());
+
+	// all pairs, to check the incremental result against
+	if (hierarchy.size() <= 10000) {
+		vector<glm::vec3> lo(hierarchy.size()), hi(hierarchy.size());
+		for (int i = 0; i < hierarchy.size(); i++) nodeWorldBounds(hierarchy.nodes[i], hierarchy.worlds[i], lo[i], hi[i]);
+		int brutePairs = 0;
+		start = WALL_TIME();
+		for (int i = 0; i < hierarchy.size(); i++) {
+			for (int j = i + 1; j < hierarchy.size(); j++) {
+				if (lo[i].x <= hi[j].x && lo[j].x <= hi[i].x && lo[i].y <= hi[j].y && lo[j].y <= hi[i].y &&
+					lo[i].z <= hi[j].z && lo[j].z <= hi[i].z) brutePairs++;
+			}
+		}
+		double bruteTime = WALL_TIME() - start;
+		printf("  all pairs        %9.3f ms, %d pairs\n", bruteTime * 1000.0, brutePairs);
+		if (brutePairs != broadphase.numPairs()) printf("  PAIRS DIFFER FROM BRUTE FORCE\n");
+	}
+
+	for (map<string, Node*>::iterator it = nodes.begin(); it != nodes.end(); it++) {
+		delete it->second->meshInst;
+		delete it->second;
+	}
 }
 
-void MoveScript::runScripts()
+//-------------------------------------------------------------------------//
+
+void benchMeshBVH(const string &meshFile, int numRays)
 {
-    if(useFaceTarget)
-    {
-        faceTarget();
-    }
-    if(useGlobalRotate)
-    {
-        globalRotate();
-    }
-    if(useLocalRotate)
-    {
-        localRotate();
-    }
-    if(useLocalTrans)
-    {
-        localTrans();
-    }
-    if(useGlobalTrans)
-    {
-        globalTrans();
-    }
-    if(useSetScale)
-    {
-        setScale();
-    }
-    if(useLimitedTrans)
-    {
-        localTransLimited();
-    }
-    if(useFollowPlayer)
-    {
-        followPlayer();
-    }
-    if(useBulletTrans)
-    {
-        bulletTranslation();
-    }
+	if (numRays < 1) numRays = 1;
 
-}
+	TriMesh mesh;
+	mesh.keepCPUData = true;
+	if (!mesh.load(meshFile) || mesh.sphereRadius < 0.0f) {
+		ERROR("Could not load mesh " + meshFile, false);
+		return;
+	}
+	int iterations = 5;
+	MeshBVH bvh;
+	double start = WALL_TIME();
+	for (int i = 0; i < iterations; i++) bvh.build(mesh);
+	double buildTime = (WALL_TIME() - start) / iterations;
+	int numTriangles = (int)bvh.triangles.size();
+
+	// from a sphere around the mesh toward points inside its bounds
+	srand(1);
+	vector<MeshRay> rays(numRays);
+	for (int i = 0; i < numRays; i++) {
+		glm::vec3 dir = glm::normalize(glm::vec3(rand() / (float)RAND_MAX - 0.5f,
+			rand() / (float)RAND_MAX - 0.5f, rand() / (float)RAND_MAX - 0.5f) + glm::vec3(0, 0, 0.001f));
+		glm::vec3 target = mesh.boundsMin + (mesh.boundsMax - mesh.boundsMin) *
+			glm::vec3(rand() / (float)RAND_MAX, rand() / (float)RAND_MAX, rand() / (float)RAND_MAX);
+		rays[i].origin = mesh.sphereCenter + dir * (2.0f * mesh.sphereRadius);
+		rays[i].dir = glm::normalize(target - rays[i].origin);
+		rays[i].maxDist = 4.0f * mesh.sphereRadius;
+	}
 
-//*****************
-//Scene Functions
-//****************
+	start = WALL_TIME();
+	int hits = bvh.intersect(rays, glm::mat4x4(1.0f));
+	double rayTime = WALL_TIME() - start;
+
+	// every triangle for a slice of the rays, to check against and compare with
+	int numBrute = min(numRays, 1000);
+	int mismatches = 0;
+	start = WALL_TIME();
+	for (int i = 0; i < numBrute; i++) {
+		float best = rays[i].maxDist;
+		for (int k = 0; k < numTriangles; k++) {
+			float t, u, v;
+			if (rayHitsTriangle(rays[i].origin, rays[i].dir, &bvh.corners[3 * k], t, u, v) && t < best) best = t;
+		}
+		if (best != rays[i].t) mismatches++;
+	}
+	double bruteTime = WALL_TIME() - start;
+
+	printf("benchMeshBVH '%s': %d triangles, %d nodes\n", meshFile.c_str(), numTriangles, bvh.size());
+	printf("  build        %9.3f ms\n", buildTime * 1000.0);
+	printf("  BVH          %9.3f Mrays/s (%d of %d rays hit)\n", numRays / rayTime / 1e6, hits, numRays);
+	printf("  brute force  %9.3f Mrays/s (%.1fx slower)\n", numBrute / bruteTime / 1e6,
+		(bruteTime / numBrute) / (rayTime / numRays));
+	if (mismatches) printf("  %d of %d RAYS DIFFER FROM BRUTE FORCE\n", mismatches, numBrute);
+}
 
+//-------------------------------------------------------------------------//
 
-void Scene::runScripts()
+void benchMeshLods(const string &meshFile)
 {
-    
-    
-    for(int i = 0; i < spawnScripts.size(); i++)
-    {
-        spawnScripts[i]->runScripts();
-    }
-    for(int i = 0; i < controlScripts.size(); i++)
-    {
-        controlScripts[i]->runScripts();
-    }
-    
-    for(auto& x : moveScripts)
-    {
-        
-        x.second->runScripts();
-        int i = 0;
-    }
+	TriMesh mesh;
+	if (!mesh.readFromPly(meshFile)) {
+		ERROR("Could not load mesh " + meshFile, false);
+		return;
+	}
+	double start = WALL_TIME();
+	mesh.buildLods();
+	double buildTime = WALL_TIME() - start;
+
+	printf("benchMeshLods '%s': %d triangles, %d levels in %.3f ms\n", meshFile.c_str(),
+		mesh.numIndices / 3, mesh.numLods, buildTime * 1000.0);
+	for (int i = 0; i < mesh.numLods; i++) {
+		printf("  level %d  %9d triangles  %5.1f%%  error %g (%.3f%% of radius)\n", i, mesh.lodCount[i] / 3,
+			100.0 * mesh.lodCount[i] / mesh.numIndices, mesh.lodError[i], 100.0 * mesh.lodError[i] / mesh.sphereRadius);
+	}
+}
 
-    
-    
-   
+//-------------------------------------------------------------------------//
+
+void benchOptimizeMesh(const string &meshFile)
+{
+	TriMesh mesh;
+	if (!mesh.readFromPly(meshFile)) {
+		ERROR("Could not load mesh " + meshFile, false);
+		return;
+	}
+	MeshOptimizeStats stats;
+	double start = WALL_TIME();
+	mesh.optimize(&stats);
+	double optimizeTime = WALL_TIME() - start;
+
+	printf("benchOptimizeMesh '%s': %d triangles, optimized in %.3f ms\n", meshFile.c_str(),
+		mesh.numIndices / 3, optimizeTime * 1000.0);
+	printf("  vertices  %9d -> %d\n", stats.verticesBefore, stats.verticesAfter);
+	printf("  ACMR      %9.3f -> %.3f\n", stats.acmrBefore, stats.acmrAfter);
+	printf("  ATVR      %9.3f -> %.3f\n", stats.atvrBefore, stats.atvrAfter);
 }
 
+//-------------------------------------------------------------------------//
 
-//*****************
-//SpawnScript Functions
-//****************
+void benchMeshlets(const string &meshFile, const string &vsFile, const string &fsFile, int numFrames)
+{
+	if (numFrames < 1) numFrames = 1;
 
+	setupBenchWindow(640, 480, "benchMeshlets");
+	gLodPixelError = 0.0f; // always full detail, the only level with meshlets
+	gMeshletConeCulling = true; // the mesh is taken to be closed
 
-void SpawnScript::spawnNode()
-{  
-    std::ostringstream oss;
-    oss << numOfSpawn;
-    //cout << "spawn Num = " << spawnNum << endl;
-    name = name + oss.str();
-    Node* newNode = copyNode;
-    node = new Node();
-    *node = *newNode;
-    node->name = name;
-    TriMeshInstance* newInst = copyNode->meshInst;
-    node->meshInst = new TriMeshInstance;
-    *node->meshInst = *newInst;
-    node->meshInst->T.translation = spawnloc;
-    
-    if(didSpawnBullet)
-    {
-        node->meshInst->T.rotation = scene->nodes["player"]->meshInst->T.rotation;
-    }
-    
-    if(moveScript != NULL)
-    {
-        attachMoveScript();
-    }
-    
-    scene->nodes[name] = this->node;
-    int i = 0;
+	TriMesh *mesh = new TriMesh();
+	if (!mesh->load(meshFile) || mesh->sphereRadius <= 0.0f) {
+		ERROR("Could not load mesh " + meshFile, false);
+		return;
+	}
+	mesh->sendToOpenGL();
+	if (mesh->meshlets.empty()) {
+		printf("benchMeshlets: '%s' is drawn whole (under %d triangles)\n", meshFile.c_str(), MESHLET_MIN_TRIANGLES);
+		return;
+	}
+	GLuint program = createShaderProgram(loadShader(vsFile, GL_VERTEX_SHADER),
+		loadShader(fsFile, GL_FRAGMENT_SHADER));
+	if (program == NULL_HANDLE) return;
+
+	Scene scene;
+	scene.backgroundColor = glm::vec3(0, 0, 0);
+	TriMeshInstance instance;
+	instance.setMesh(mesh);
+	instance.mat.shaderProgram = program;
+	Node *node = new Node(&instance);
+	node->name = "mesh";
+	scene.addNode(node);
+
+	// circle close to the surface, so much of the mesh is off screen or facing away
+	vector<Meshlet> meshlets = mesh->meshlets;
+	int avgTriangles = mesh->numIndices / 3 / (int)meshlets.size();
+	for (int pass = 0; pass < 2; pass++) {
+		if (pass == 1) mesh->meshlets.clear();
+		double submitTime = 0.0, finishTime = 0.0;
+		size_t triangles = 0, tested = 0, drawn = 0;
+		for (int f = 0; f < numFrames; f++) {
+			float angle = 6.2831853f * f / numFrames;
+			glm::vec3 eye = mesh->sphereCenter + mesh->sphereRadius * glm::vec3(1.2f * cos(angle), 0.5f, 1.2f * sin(angle));
+			aimBenchCamera(scene.camera, eye, mesh->sphereCenter, 0.01f * mesh->sphereRadius, 10.0f * mesh->sphereRadius);
+			double start = WALL_TIME();
+			scene.render();
+			double mid = WALL_TIME();
+			glFinish();
+			submitTime += mid - start;
+			finishTime += WALL_TIME() - mid;
+			triangles += gRenderStats.trianglesSubmitted;
+			tested += gRenderStats.meshletsTested;
+			drawn += gRenderStats.meshletsDrawn;
+		}
+		if (pass == 0) {
+			printf("benchMeshlets '%s': %d triangles, %d meshlets of %d triangles on average\n", meshFile.c_str(),
+				mesh->numIndices / 3, (int)meshlets.size(), avgTriangles);
+			printf("  meshlets  %9.3f ms submit, %9.3f ms glFinish, %.0f triangles, %.1f%% of meshlets drawn\n",
+				submitTime * 1000.0 / numFrames, finishTime * 1000.0 / numFrames, triangles / (double)numFrames,
+				100.0 * drawn / tested);
+		}
+		else {
+			printf("  whole     %9.3f ms submit, %9.3f ms glFinish, %.0f triangles\n",
+				submitTime * 1000.0 / numFrames, finishTime * 1000.0 / numFrames, triangles / (double)numFrames);
+		}
+	}
+	mesh->meshlets = meshlets;
 }
 
-void SpawnScript::attachMoveScript()
+//-------------------------------------------------------------------------//
+
+// binary copy of a mesh read from a ply: colors as uchar, everything else float
+static bool writeBinaryPly(const TriMesh &mesh, const string &fileName, PlyFormat format)
 {
-    MoveScript* ms = moveScript;
-    MoveScript* newMS = new MoveScript();
-    
-    *newMS = *ms;
-    newMS->node = node;
-    moveScript = newMS;
-    
-    scene->moveScripts[name] = moveScript;
-    
-    cout << name << endl;
+	FILE *f = fopen(fileName.c_str(), "wb");
+	if (f == NULL) {
+		ERROR("Could not write " + fileName, false);
+		return false;
+	}
+	bool swap = (format == PLY_BINARY_LITTLE_ENDIAN) != hostIsLittleEndian();
+	int stride = (int)mesh.attributes.size();
+	int numVertices = (int)(mesh.vertexData.size() / stride);
+	vector<bool> isColor(stride);
+	fprintf(f, "ply\nformat %s 1.0\nelement vertex %d\n",
+		(format == PLY_BINARY_LITTLE_ENDIAN) ? "binary_little_endian" : "binary_big_endian", numVertices);
+	for (int i = 0; i < stride; i++) {
+		const string &a = mesh.attributes[i];
+		isColor[i] = (a == "red" || a == "green" || a == "blue");
+		fprintf(f, "property %s %s\n", isColor[i] ? "uchar" : "float", a.c_str());
+	}
+	fprintf(f, "element face %d\nproperty list uchar int vertex_indices\nend_header\n", mesh.numIndices / 3);
+
+	auto put = [&](const void *value, int size) {
+		unsigned char b[4];
+		memcpy(b, value, size);
+		if (swap) reverse(b, b + size);
+		fwrite(b, 1, size, f);
+	};
+	for (int v = 0; v < numVertices; v++) {
+		for (int i = 0; i < stride; i++) {
+			float val = mesh.vertexData[(size_t)v * stride + i];
+			if (isColor[i]) {
+				unsigned char c = (unsigned char)fmin(fmax(val * 255.0f + 0.5f, 0.0f), 255.0f);
+				put(&c, 1);
+			}
+			else put(&val, 4);
+		}
+	}
+	for (int t = 0; t < mesh.numIndices / 3; t++) {
+		unsigned char n = 3;
+		put(&n, 1);
+		for (int k = 0; k < 3; k++) put(&mesh.indices[3 * t + k], 4);
+	}
+	fclose(f);
+	return true;
 }
 
-void SpawnScript::spawnBullet()
+void benchPlyFormats(const string &meshFile)
 {
-    if(scene->nodes["player"] != NULL)
-    {
-        spawnloc = scene->nodes["player"]->meshInst->T.translation;
-        didSpawnBullet = true;
-        spawnNode();
-    }
+	TriMesh ascii;
+	double start = WALL_TIME();
+	if (!ascii.readFromPly(meshFile)) {
+		ERROR("Could not load mesh " + meshFile, false);
+		return;
+	}
+	double asciiTime = WALL_TIME() - start;
+	struct stat st;
+	string fullName;
+	getFullFileName(meshFile, fullName);
+	double asciiMB = (stat(fullName.c_str(), &st) == 0) ? st.st_size / 1048576.0 : 0.0;
+	printf("benchPlyFormats '%s': %d vertices, %d triangles\n", meshFile.c_str(),
+		(int)(ascii.vertexData.size() / ascii.attributes.size()), ascii.numIndices / 3);
+	printf("  ascii                %9.3f ms, %7.1f MB\n", asciiTime * 1000.0, asciiMB);
+
+	PlyFormat formats[2] = { PLY_BINARY_LITTLE_ENDIAN, PLY_BINARY_BIG_ENDIAN };
+	const char *names[2] = { "binary_little_endian", "binary_big_endian" };
+	for (int i = 0; i < 2; i++) {
+		string binaryFile = fullName + "." + names[i] + ".ply";
+		if (!writeBinaryPly(ascii, binaryFile, formats[i])) return;
+		TriMesh binary;
+		start = WALL_TIME();
+		bool ok = binary.readFromPly(binaryFile);
+		double binaryTime = WALL_TIME() - start;
+		double binaryMB = (stat(binaryFile.c_str(), &st) == 0) ? st.st_size / 1048576.0 : 0.0;
+		remove(binaryFile.c_str());
+		if (!ok) return;
+		bool same = binary.attributes == ascii.attributes && binary.vertexData == ascii.vertexData &&
+			binary.indices == ascii.indices;
+		printf("  %-20s %9.3f ms, %7.1f MB, %5.1fx faster, %s\n", names[i], binaryTime * 1000.0, binaryMB,
+			asciiTime / binaryTime, same ? "same mesh" : "MESH DIFFERS");
+	}
 }
 
-void SpawnScript::runScripts()
+//-------------------------------------------------------------------------//
+
+void benchPlyParse(const string &meshFile, int iterations)
 {
+	if (iterations < 1) iterations = 1;
+	string fullName;
+	struct stat st;
+	if (!getFullFileName(meshFile, fullName) || stat(fullName.c_str(), &st) != 0) {
+		ERROR("Could not open file " + meshFile, false);
+		return;
+	}
+	double megabytes = st.st_size / 1048576.0;
+	int savedThreads = gPlyThreads;
+	int hardware = (int)thread::hardware_concurrency();
+	int counts[] = { 1, 2, 4, 8, hardware };
+	vector<string> serialAttributes;
+	vector<float> serialVertices;
+	vector<int> serialIndices;
+	printf("benchPlyParse '%s': %.1f MB, %d hardware threads\n", meshFile.c_str(), megabytes, hardware);
+	for (int i = 0; i < 5; i++) {
+		if (i == 4 && (hardware <= 1 || hardware == 2 || hardware == 4 || hardware == 8)) continue;
+		gPlyThreads = counts[i];
+		double best = 1e30;
+		bool same = true;
+		for (int k = 0; k < iterations; k++) {
+			TriMesh mesh;
+			double start = WALL_TIME();
+			if (!mesh.readFromPly(meshFile)) {
+				gPlyThreads = savedThreads;
+				return;
+			}
+			best = min(best, WALL_TIME() - start);
+			if (counts[i] == 1 && k == 0) {
+				serialAttributes = mesh.attributes;
+				serialVertices = mesh.vertexData;
+				serialIndices = mesh.indices;
+			}
+			same = same && mesh.attributes == serialAttributes && mesh.vertexData == serialVertices &&
+				mesh.indices == serialIndices;
+		}
+		printf("  %2d threads %9.3f ms, %8.1f MB/s, %s\n", counts[i], best * 1000.0, megabytes / best,
+			same ? "same as serial" : "DIFFERS FROM SERIAL");
+	}
+	gPlyThreads = savedThreads;
+}
 
-    if(this->useSpawn)
-    {
-        spawnNode();
-    }
+//-------------------------------------------------------------------------//
 
+void benchParticles(int numParticles, int numFrames)
+{
+	if (numParticles < 1) numParticles = 1;
+	if (numFrames < 1) numFrames = 1;
+
+	// life of 120 frames at a rate that keeps numParticles alive
+	Billboard bb;
+	float lifeFrames = 120.0f;
+	partSys system(glm::vec3(0, 0, 0), glm::vec3(0, 0, 0), glm::vec3(0, -0.001f, 0), glm::vec3(0.05f, 0.1f, 0.05f),
+		bb, 1e30f, lifeFrames, PS_FOUNTAIN);
+	system.rate = numParticles * PARTICLE_FRAME_RATE / lifeFrames;
+	float dt = 1.0f / PARTICLE_FRAME_RATE;
+	for (int f = 0; f < (int)lifeFrames + 1; f++) system.update(dt); // reach steady state
+
+	double start = WALL_TIME();
+	size_t live = 0;
+	for (int f = 0; f < numFrames; f++) {
+		system.update(dt);
+		live += system.count;
+	}
+	double time = (WALL_TIME() - start) / numFrames;
+	double average = live / (double)numFrames;
+	printf("benchParticles: %.0f live particles, %d frames\n", average, numFrames);
+	printf("  update   %9.3f ms per frame, %.2f ns per particle\n", time * 1000.0, time * 1e9 / average);
 }
 
+//-------------------------------------------------------------------------//
 
+void benchParticleDraw(const string &quadFile, const string &vsFile, const string &fsFile,
+	int numParticles, int numFrames)
+{
+	if (numParticles < 1) numParticles = 1;
+	if (numFrames < 1) numFrames = 1;
+
+	setupBenchWindow(640, 480, "benchParticleDraw");
+	TriMesh *quad = new TriMesh();
+	if (!quad->load(quadFile)) {
+		ERROR("Could not load mesh " + quadFile, false);
+		return;
+	}
+	quad->sendToOpenGL();
+	Billboard bb;
+	bb.setMesh(quad);
+	bb.type = 1;
+	bb.mat.shaderProgram = createShaderProgram(loadShader(vsFile, GL_VERTEX_SHADER),
+		loadShader(fsFile, GL_FRAGMENT_SHADER));
+	if (bb.mat.shaderProgram == NULL_HANDLE) return;
+
+	// a cloud of live particles, not moving
+	partSys system(glm::vec3(0, 0, 0), glm::vec3(0, 0, 0), glm::vec3(0, 0, 0), glm::vec3(0, 0, 0),
+		bb, 1e30f, 1e30f, PS_EXPLOSION);
+	system.emit(numParticles);
+	for (int i = 0; i < system.count; i++) {
+		system.posX[i] = glm::linearRand(-5.0f, 5.0f);
+		system.posY[i] = glm::linearRand(-5.0f, 5.0f);
+		system.posZ[i] = glm::linearRand(-5.0f, 5.0f);
+	}
+	Camera camera;
+	aimBenchCamera(camera, glm::vec3(0, 0, 20), glm::vec3(0, 0, 0), 0.1f, 100.0f, 0.8f);
+	glEnable(GL_DEPTH_TEST);
 
-int SpawnScript::spawnNum = 0;
+	// one billboard draw per particle, as partSys used to, then one instanced draw
+	ParticleRenderer renderer;
+	for (int pass = 0; pass < 2; pass++) {
+		gRenderStats.reset();
+		double start = WALL_TIME();
+		for (int f = 0; f < numFrames; f++) {
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			if (pass == 0) {
+				for (int i = 0; i < system.count; i++) {
+					bb.setTranslation(glm::vec3(system.posX[i], system.posY[i], system.posZ[i]));
+					bb.draw(camera);
+					gRenderStats.drawCalls++;
+				}
+			}
+			else renderer.draw(system, camera);
+		}
+		glFinish();
+		double time = (WALL_TIME() - start) / numFrames;
+		if (pass == 0) printf("benchParticleDraw: %d particles, %d frames\n", system.count, numFrames);
+		printf("  %-10s %9.3f ms per frame, %d draw calls per frame\n", (pass == 0) ? "billboards" : "instanced",
+			time * 1000.0, gRenderStats.drawCalls / numFrames);
+	}
+}
 
-//*****************
-//Particle System Functions
-//****************
+//-------------------------------------------------------------------------//
 
-Particle::Particle(glm::vec3 VelMag, glm::vec3 _Pos, glm::vec3 _Accel, float _life, Billboard inst, int type){
-	if (type == PS_EXPLOSION){
-		Vel = glm::vec3(glm::linearRand(-VelMag.x, VelMag.x), glm::linearRand(-VelMag.y, VelMag.y), glm::linearRand(-VelMag.z, VelMag.z));
-	}
-	if (type == PS_FOUNTAIN){
-		Vel = glm::vec3(glm::linearRand(-VelMag.x, VelMag.x), glm::linearRand(0.0f, VelMag.y), glm::linearRand(-VelMag.z, VelMag.z));
+void benchGpuParticles(int numParticles, int numFrames)
+{
+	if (numParticles < 1) numParticles = 1;
+	if (numFrames < 1) numFrames = 1;
+
+	setupBenchWindow(640, 480, "benchGpuParticles");
+	Camera camera;
+	aimBenchCamera(camera, glm::vec3(0, 2, 10), glm::vec3(0, 2, 0), 0.1f, 100.0f, 0.8f);
+
+	// the same fountain simulated on the CPU and streamed, then on the GPU
+	float lifeFrames = 120.0f;
+	float dt = 1.0f / PARTICLE_FRAME_RATE;
+	Billboard bb;
+	bb.T.scale = glm::vec3(0.05f, 0.05f, 0.05f);
+	ParticleRenderer renderer;
+	for (int pass = 0; pass < 2; pass++) {
+		partSys system(glm::vec3(0, 0, 0), glm::vec3(0, 0, 0), glm::vec3(0, -0.002f, 0), glm::vec3(0.05f, 0.2f, 0.05f),
+			bb, 1e30f, lifeFrames, PS_FOUNTAIN);
+		system.rate = numParticles * PARTICLE_FRAME_RATE / lifeFrames;
+		system.gpu = (pass == 1);
+		for (int f = 0; f < (int)lifeFrames + 1; f++) { // reach steady state
+			if (system.gpu) renderer.simulate(system, dt);
+			system.update(dt);
+		}
+		glFinish();
+
+		gRenderStats.reset();
+		double start = WALL_TIME();
+		for (int f = 0; f < numFrames; f++) {
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			if (system.gpu) renderer.simulate(system, dt);
+			system.update(dt);
+			renderer.draw(system, camera);
+		}
+		glFinish();
+		double time = (WALL_TIME() - start) / numFrames;
+
+		// live particles, read back from the GPU's slots
+		int live = system.count;
+		if (system.gpu) {
+			GpuParticleState &state = system.gpuState;
+			vector<float> slots((size_t)state.capacity * 8);
+			glBindBuffer(GL_ARRAY_BUFFER, state.buffers[state.current]);
+			glGetBufferSubData(GL_ARRAY_BUFFER, 0, slots.size() * sizeof(float), &slots[0]);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			live = 0;
+			for (int i = 0; i < state.capacity; i++) live += (slots[8 * i + 3] > 0.0f);
+			state.release();
+		}
+		size_t uploaded = system.gpu ? 0 : (size_t)system.count * sizeof(ParticleInstance);
+		if (pass == 0) printf("benchGpuParticles: %d particles wanted, %d frames\n", numParticles, numFrames);
+		printf("  %-4s %9.3f ms per frame, %d live, %.1f KB uploaded per frame\n", system.gpu ? "gpu" : "cpu",
+			time * 1000.0, live, uploaded / 1024.0);
 	}
-	T.translation = _Pos;
-	Accel = _Accel;
-	instance = inst;
-	life = _life;
-	instance.setTranslation(T.translation); //This is broken!
 }
 
-void Particle::update(){
-	T.translation = T.translation + Vel;
-	Vel = Vel + Accel;
-	life -= 1.0;
-	instance.setTranslation(T.translation);
-	//instance.setScale(instance.T.scale * (life / 1000));
-}
-void Particle::render(Camera &camera){
-	instance.draw(camera);
+void benchClusters(int numLights, int numFrames)
+{
+	if (numLights < 1) numLights = 1;
+	if (numFrames < 1) numFrames = 1;
+
+	setupBenchWindow(1280, 720, "benchClusters");
+	Camera camera;
+
+	// point lights scattered over a 200 x 200 floor, ranges of a few units
+	srand(1);
+	vector<Light> lights(numLights);
+	for (int i = 0; i < numLights; i++) {
+		Light &light = lights[i];
+		light.position = glm::vec4(200.0f * rand() / RAND_MAX - 100.0f, 0.5f + 2.0f * rand() / RAND_MAX,
+			200.0f * rand() / RAND_MAX - 100.0f, 1.0f);
+		light.color = glm::vec4(1, 0.9f, 0.8f, 1);
+		light.attenuation = glm::vec4(1, 0, 2.0f + 30.0f * rand() / RAND_MAX, POINT_LIGHT);
+	}
+	Light sun;
+	sun.direction = glm::vec4(0, -1, 0, 0);
+	sun.color = glm::vec4(0.2f, 0.2f, 0.2f, 1);
+	sun.attenuation.w = DIRECTIONAL_LIGHT;
+	lights.push_back(sun);
+
+	// orbit the camera so every frame's lists are new
+	ClusterGrid grid;
+	double assignTime = 0.0;
+	int maxPerCluster = 0, overflows = 0;
+	size_t references = 0, occupied = 0;
+	for (int f = 0; f < numFrames; f++) {
+		float angle = 6.2831853f * f / numFrames;
+		aimBenchCamera(camera, glm::vec3(60.0f * cos(angle), 8.0f, 60.0f * sin(angle)), glm::vec3(0, 0, 0), 0.1f, 200.0f, 0.8f);
+		grid.update(camera, lights, f == 0);
+		assignTime += grid.stats.assignTime;
+		maxPerCluster = max(maxPerCluster, grid.stats.maxPerCluster);
+		overflows += grid.stats.overflows;
+		references += grid.stats.references;
+		for (int c = 0; c < CLUSTER_COUNT; c++) occupied += (grid.count[c] > 0);
+	}
+	glFinish();
+
+	printf("benchClusters: %d lights (%d global, %d culled), %d x %d x %d clusters, %d frames\n",
+		grid.stats.lights, grid.stats.globalLights, grid.stats.culledLights, CLUSTER_X, CLUSTER_Y, CLUSTER_Z, numFrames);
+	printf("  %9.3f ms per frame to assign and upload\n", assignTime * 1000.0 / numFrames);
+	printf("  %9.1f lights per occupied cluster, %d at most, %d overflowed clusters per frame\n",
+		occupied ? (double)references / occupied : 0.0, maxPerCluster, overflows / numFrames);
+	printf("  %9d lights per fragment without clusters\n", grid.stats.lights);
 }
 
+static const char *FRAME_BENCH_UNIFORM_VS =
+	"#version 410 core\n"
+	"layout(location = 0) in vec3 vPosition;\n"
+	"layout(location = 1) in vec3 vNormal;\n"
+	"uniform mat4 uObjectWorldInverseM;\n"
+	"uniform mat4 uObjectPerpsectM;\n"
+	"out vec3 fN;\n"
+	"void main() { gl_Position = uObjectPerpsectM * vec4(vPosition, 1); fN = (vec4(vNormal, 0) * uObjectWorldInverseM).xyz; }\n";
+static const char *FRAME_BENCH_BLOCK_VS =
+	"#version 410 core\n"
+	"#include \"" FRAME_INCLUDE "\"\n"
+	"layout(location = 0) in vec3 vPosition;\n"
+	"layout(location = 1) in vec3 vNormal;\n"
+	"out vec3 fN;\n"
+	"void main() { gl_Position = uObjectPerpsectM * vec4(vPosition, 1); fN = (vec4(vNormal, 0) * uObjectWorldInverseM).xyz; }\n";
+static const char *FRAME_BENCH_FS =
+	"#version 410 core\n"
+	"struct Light { vec4 position, direction, color, attenuation, coneAngles; };\n"
+	"layout(std140) uniform Lights { Light lights[10]; };\n"
+	"in vec3 fN;\n"
+	"out vec4 outColor;\n"
+	"void main() { vec3 c = vec3(0); for (int i = 0; i < 10; i++) c += lights[i].color.rgb * max(dot(normalize(fN), normalize(lights[i].position.xyz)), 0.0); outColor = vec4(c, 1); }\n";
+
+void benchFrameData(const string &meshFile, int numNodes, int numFrames)
+{
+	if (numNodes < 1) numNodes = 1;
+	if (numFrames < 1) numFrames = 1;
+
+	setupBenchWindow(640, 480, "benchFrameData");
+	gNumLights = 1;
+	gLights[0].position = glm::vec4(1, 1, 1, 0);
+	gLights[0].color = glm::vec4(1, 1, 1, 1);
+	gLights[0].attenuation.w = DIRECTIONAL_LIGHT;
+
+	TriMesh *mesh = new TriMesh();
+	if (!mesh->load(meshFile)) return;
+	mesh->sendToOpenGL();
+	GLuint programs[2];
+	const char *vertexShaders[2] = { FRAME_BENCH_UNIFORM_VS, FRAME_BENCH_BLOCK_VS };
+	for (int i = 0; i < 2; i++) {
+		string source, alreadyIncluded;
+		string mainCode = vertexShaders[i];
+		replaceIncludes(mainCode, source, "#include", alreadyIncluded, true);
+		programs[i] = createShaderProgram(compileShader(source, GL_VERTEX_SHADER, "frame bench vertex shader"),
+			compileShader(FRAME_BENCH_FS, GL_FRAGMENT_SHADER, "frame bench fragment shader"));
+		if (programs[i] == NULL_HANDLE) return;
+	}
 
-void partSys::initPS(){
-	Particle emitter(glm::vec3(0, 0, 0), Origin, glm::vec3(0, 0, 0), duration, bb, type);
-	particles.push_back(emitter);
-}
+	// a square grid of nodes in front of the camera
+	Scene scene;
+	scene.backgroundColor = glm::vec3(0, 0, 0);
+	int side = (int)ceil(sqrt((double)numNodes));
+	vector<TriMeshInstance*> instances;
+	for (int i = 0; i < numNodes; i++) {
+		TriMeshInstance *instance = new TriMeshInstance();
+		instance->setMesh(mesh);
+		instance->setTranslation(glm::vec3(2.0f * (i % side - side / 2), 2.0f * (i / side - side / 2), 0.0f));
+		Node *node = new Node();
+		node->meshInst = instance;
+		ostringstream name;
+		name << "node" << i;
+		node->name = name.str();
+		scene.addNode(node);
+		instances.push_back(instance);
+	}
+	aimBenchCamera(scene.camera, glm::vec3(0, 0, 2.5f * side), glm::vec3(0, 0, 0), 0.1f, 10.0f * side);
+
+	// lights change every frame.  Plain uniforms and glBufferSubData of the
+	// light block first, as before the ring; then the ring, persistently
+	// mapped and orphaned.  Frames are only flushed, so the GPU can fall
+	// behind and the waits show up.
+	const char *modes[3] = { "uniforms", "persistent", "orphaned" };
+	bool savedUse = gUseFrameData, savedPersistent = gPersistentFrameData;
+	printf("benchFrameData: %d nodes, %d frames, %d frames in flight\n", numNodes, numFrames, FRAMES_IN_FLIGHT);
+	for (int mode = 0; mode < 3; mode++) {
+		if (mode == 1 && !GLEW_ARB_buffer_storage) continue;
+		gUseFrameData = (mode != 0);
+		gPersistentFrameData = (mode == 1);
+		gFrameData.release();
+		for (int i = 0; i < numNodes; i++) instances[i]->mat.shaderProgram = programs[mode == 0 ? 0 : 1];
+		gLightsChanged = true;
+		scene.render();
+		glFinish();
+
+		gFrameData.stats.reset();
+		double submitTime = 0.0;
+		double start = WALL_TIME();
+		for (int f = 0; f < numFrames; f++) {
+			gLightsChanged = true;
+			double frameStart = WALL_TIME();
+			scene.render();
+			submitTime += WALL_TIME() - frameStart;
+			glFlush();
+		}
+		glFinish();
+		double frameTime = WALL_TIME() - start;
 
-void partSys::addParticle(){
-	Particle p(VelMag, Origin, Accel, life, bb, type);
-	particles.push_back(p);
+		FrameDataStats &stats = gFrameData.stats;
+		printf("  %-10s %9.3f ms per frame, %9.3f ms submit, %9.3f ms stalled (%d stalls), %.1f KB through the ring, %d grows\n",
+			modes[mode], frameTime * 1000.0 / numFrames, submitTime * 1000.0 / numFrames,
+			stats.stallTime * 1000.0 / numFrames, stats.stalls, stats.bytes / 1024.0 / numFrames, stats.grows);
+	}
+	gUseFrameData = savedUse;
+	gPersistentFrameData = savedPersistent;
+	gFrameData.release();
 }
 
-void partSys::update(){
-	for (int i = particles.size() - 1; i > 0; i--){
-		Particle p = particles.at(i);
-		particles.at(i).update();
-		if (p.isDead()){
-			particles.erase(particles.begin() + i);
+//*****************
+//Tests
+//****************
+
+static bool sameMatrix(const glm::mat4x4 &a, const glm::mat4x4 &b)
+{
+	for (int c = 0; c < 4; c++) {
+		for (int r = 0; r < 4; r++) {
+			if (fabs(a[c][r] - b[c][r]) > 1e-4f) return false;
 		}
 	}
-	particles[0].update();
+	return true;
 }
 
-void partSys::render(Camera &camera){
-	for (int i = particles.size() - 1; i >= 0; i--){
-		particles[i].render(camera);
+bool testHierarchyRotation(void)
+{
+	// a spinning parent with a child, turned the way MoveScript turns nodes
+	map<string, Node*> nodes;
+	Node *parent = new Node(), *child = new Node();
+	parent->name = "parent";
+	child->name = "child";
+	parent->meshInst = new TriMeshInstance();
+	child->meshInst = new TriMeshInstance();
+	parent->meshInst->setTranslation(glm::vec3(1, 2, 3));
+	child->meshInst->setTranslation(glm::vec3(0, 0, 2));
+	child->parent = parent;
+	parent->addChildren(child);
+	nodes[parent->name] = parent;
+	nodes[child->name] = child;
+
+	TransformHierarchy hierarchy;
+	hierarchy.build(nodes);
+	hierarchy.update();
+
+	bool ok = true;
+	for (int frame = 0; frame < 3; frame++) {
+		parent->meshInst->T.rotateGlobal(glm::vec3(0, 1, 0), 0.5f); // refreshes the transform itself
+		parent->getWorldTransform(); // and so does drawing
+		int updated = hierarchy.update();
+
+		glm::mat4x4 expected = glm::translate(glm::vec3(1, 2, 3)) * glm::toMat4(parent->meshInst->T.rotation);
+		glm::mat4x4 expectedChild = expected * glm::translate(glm::vec3(0, 0, 2));
+		if (updated != 2) {
+			printf("testHierarchyRotation: frame %d updated %d worlds, expected 2\n", frame, updated);
+			ok = false;
+		}
+		if (!sameMatrix(hierarchy.worlds[parent->transformIndex], expected) ||
+			!sameMatrix(hierarchy.worlds[child->transformIndex], expectedChild) ||
+			!sameMatrix(hierarchy.worldInverses[child->transformIndex], glm::inverse(expectedChild))) {
+			printf("testHierarchyRotation: frame %d has a stale world matrix\n", frame);
+			ok = false;
+		}
 	}
-	addParticle();
+	if (hierarchy.update() != 0) {
+		printf("testHierarchyRotation: an unchanged frame rebuilt world matrices\n");
+		ok = false;
+	}
+
+	delete child->meshInst;
+	delete parent->meshInst;
+	delete child;
+	delete parent;
+	return ok;
 }
 
-partSys::partSys(glm::vec3 Pos, glm::vec3 _Vel, glm::vec3 _Accel, glm::vec3 _VelMag, Billboard _bb, float _duration, float _life, int _type){
-	Origin = Pos;
-	Vel = _Vel;
-	Accel = _Accel;
-	VelMag = _VelMag;
-	bb = _bb;
-	duration = _duration;
-	life = _life;
-	type = _type;
-	initPS();
+// whether the block bound to a uniform binding point holds data at offset
+static bool boundBlockHolds(GLuint index, GLsizeiptr offset, const void *data, GLsizeiptr bytes)
+{
+	GLint buffer = 0;
+	GLint64 start = 0;
+	glGetIntegeri_v(GL_UNIFORM_BUFFER_BINDING, index, &buffer);
+	glGetInteger64i_v(GL_UNIFORM_BUFFER_START, index, &start);
+	if (buffer == 0 || !glIsBuffer(buffer)) return false;
+	vector<unsigned char> contents(bytes);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	glGetBufferSubData(GL_UNIFORM_BUFFER, (GLintptr)start + offset, bytes, &contents[0]);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	return memcmp(&contents[0], data, bytes) == 0;
 }
 
+bool testFrameDataOverflow(void)
+{
+	createOpenGLWindow(64, 64, "testFrameDataOverflow");
+	bool wasPersistent = gPersistentFrameData;
+	bool ok = true;
+	for (int persistent = 0; persistent < 2; persistent++) {
+		gPersistentFrameData = (persistent != 0);
+		const char *mode = gPersistentFrameData ? "persistent" : "orphaned";
+		FrameAllocator frames;
+		frames.beginFrame();
+
+		glm::vec4 camera[6] = { glm::vec4(1, 2, 3, 4), glm::vec4(5, 6, 7, 8) };
+		frames.bind(CAMERA_BUFFER_ID, camera, sizeof(camera));
+		GLint cameraBuffer = 0;
+		glGetIntegeri_v(GL_UNIFORM_BUFFER_BINDING, CAMERA_BUFFER_ID, &cameraBuffer);
+
+		// light lists and objects, twice what a region holds, so the
+		// buffer grows with an Object block part filled
+		glm::vec4 lights[5 * MAX_LIGHTS];
+		glm::mat4x4 matrices[3];
+		int numDraws = 2 * FRAME_BUFFER_SIZE / (int)(sizeof(lights) + sizeof(matrices));
+		int index = 0;
+		for (int i = 0; i < numDraws; i++) {
+			for (int j = 0; j < 5 * MAX_LIGHTS; j++) lights[j] = glm::vec4((float)i, (float)j, 0, 1);
+			frames.bind(LIGHT_BUFFER_ID, lights, sizeof(lights));
+			for (int j = 0; j < 3; j++) matrices[j] = glm::translate(glm::vec3((float)i, (float)j, 0));
+			index = frames.bindObject(matrices);
+		}
 
+		if (frames.stats.grows < 1) {
+			printf("testFrameDataOverflow: %s buffer never grew\n", mode);
+			ok = false;
+		}
+		if (!boundBlockHolds(CAMERA_BUFFER_ID, 0, camera, sizeof(camera))) {
+			printf("testFrameDataOverflow: %s Camera block lost when the buffer grew\n", mode);
+			ok = false;
+		}
+		if (!boundBlockHolds(LIGHT_BUFFER_ID, 0, lights, sizeof(lights)) ||
+			!boundBlockHolds(OBJECT_BUFFER_ID, index * sizeof(matrices), matrices, sizeof(matrices))) {
+			printf("testFrameDataOverflow: %s blocks bound after growing are wrong\n", mode);
+			ok = false;
+		}
+		frames.endFrame();
+
+		// the old buffer goes once the GPU is done with it
+		glFinish();
+		frames.beginFrame();
+		frames.endFrame();
+		if (glIsBuffer(cameraBuffer)) {
+			printf("testFrameDataOverflow: %s buffer outgrown was never deleted\n", mode);
+			ok = false;
+		}
+		frames.release();
+		GLenum error = glGetError();
+		if (error != GL_NO_ERROR) {
+			printf("testFrameDataOverflow: %s GL error 0x%x\n", mode, error);
+			ok = false;
+		}
+	}
+	gPersistentFrameData = wasPersistent;
+	return ok;
+}
 
+bool testProgramKeepsLights(void)
+{
+	createOpenGLWindow(64, 64, "testProgramKeepsLights");
+	initLightBuffer();
+	FrameAllocator frames;
+	frames.beginFrame();
+
+	// lights changed this frame, then a program is made lazily, the way
+	// the particle renderer makes its own
+	glm::vec4 lights[5 * MAX_LIGHTS];
+	for (int i = 0; i < 5 * MAX_LIGHTS; i++) lights[i] = glm::vec4((float)i, 1, 2, 3);
+	frames.bind(LIGHT_BUFFER_ID, lights, sizeof(lights));
+	GLuint program = createShaderProgram(
+		compileShader("#version 410\nvoid main() { gl_Position = vec4(0, 0, 0, 1); }\n", GL_VERTEX_SHADER, "test vertex shader"),
+		compileShader("#version 410\nout vec4 color;\nvoid main() { color = vec4(1); }\n", GL_FRAGMENT_SHADER, "test fragment shader"));
+
+	bool ok = true;
+	if (program == NULL_HANDLE) {
+		printf("testProgramKeepsLights: could not build the program\n");
+		ok = false;
+	}
+	else if (!boundBlockHolds(LIGHT_BUFFER_ID, 0, lights, sizeof(lights))) {
+		printf("testProgramKeepsLights: making a program rebound the Lights block\n");
+		ok = false;
+	}
+	frames.endFrame();
+	deleteShaderProgram(program);
+	frames.release();
+	return ok;
+}
@@ -14,14 +14,27 @@
 // some standard includes
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <chrono>
 #include <vector>
+#include <deque>
 #include <map>
+#include <queue>
+#include <algorithm>
+#include <unordered_set>
+#include <set>
 using namespace std;
 
 // lodePNG stuff (image reading)
@@ -42,6 +55,8 @@ using namespace irrklang;
 //forward declarations
 class Camera;
 class Node;
+class TriMesh;
+class RenderQueue;
 class MoveScript;
 class ControlScript;
 class SpawnScript;
@@ -52,8 +67,40 @@ class SpawnScript;
 
 void ERROR(const string &msg, bool doExit = true);
 double TIME(void);
+double WALL_TIME(void);
 void SLEEP(int millis);
 
+//-------------------------------------------------------------------------//
+// THREADS
+//-------------------------------------------------------------------------//
+
+// Fixed set of worker threads pulling jobs off a shared queue.
+// wait() blocks until every job added so far has finished.
+class ThreadPool
+{
+public:
+	ThreadPool(int numThreads = 0); // 0 = one per hardware thread
+	~ThreadPool();
+	void add(const function<void(void)> &job);
+	void wait(void);
+	int size(void) const { return (int)workers.size(); }
+	static bool onWorker(void); // called from a job, on any pool
+
+private:
+	vector<thread> workers;
+	deque< function<void(void)> > jobs;
+	mutex jobLock;
+	condition_variable jobAdded, jobsDone;
+	int numActive;
+	bool stopping;
+
+	void workerLoop(void);
+	ThreadPool(const ThreadPool &);
+	ThreadPool &operator=(const ThreadPool &);
+};
+
+ThreadPool &getWorkerPool(void); // shared pool, created on first use
+
 //-------------------------------------------------------------------------//
 // TEMPLATES
 //-------------------------------------------------------------------------//
@@ -86,8 +133,76 @@ public:
 GLFWwindow* createOpenGLWindow(int width, int height, const char *title, int samplesPerPixel=0);
 
 #define NULL_HANDLE 0
+bool loadShaderSource(const string &fileName, string &shaderCode); // with includes expanded
+GLuint compileShader(const string &shaderCode, GLuint shaderType, const string &fileName);
 GLuint loadShader(const string &fileName, GLuint shaderType);
 GLuint createShaderProgram(GLuint vertexShader, GLuint fragmentShader);
+void setupShaderProgram(GLuint shaderProgram); // reflect uniforms, assign block bindings
+
+// Programs are cached by their include-expanded source, so every material
+// using the same vertex/fragment pair shares one compiled program.
+GLuint loadShaderProgram(const string &vsFileName, const string &fsFileName);
+
+class ShaderCacheStats
+{
+public:
+	int requests; // loadShaderProgram calls
+	int compiled; // programs compiled and linked from source
+	int shared; // requests answered from the in-memory cache
+	int loadedBinary; // programs restored from the on-disk cache
+	int rejectedBinary; // cached binaries the driver refused
+	double seconds; // total time spent in loadShaderProgram
+	ShaderCacheStats(void) { requests = compiled = shared = loadedBinary = rejectedBinary = 0; seconds = 0.0; }
+};
+extern ShaderCacheStats gShaderCacheStats;
+
+// Optional on-disk cache of linked program binaries, keyed by source hash and
+// the driver's vendor/renderer/version. Anything the driver rejects is rebuilt.
+#define SHADER_CACHE_VERSION 1
+#define SHADER_CACHE_EXTENSION ".ebprog"
+extern bool gUseShaderCache;
+bool shaderBinariesSupported(void);
+uint64_t programBinaryKey(uint64_t sourceKey); // mixes in the driver strings
+string programBinaryFileName(uint64_t binaryKey);
+GLuint loadProgramBinary(const string &cacheName, uint64_t binaryKey);
+bool saveProgramBinary(const string &cacheName, uint64_t binaryKey, GLuint program);
+
+uint64_t hashString(const string &s, uint64_t hash = 14695981039346656037ULL); // FNV-1a
+
+// Active uniforms and uniform blocks of a linked program, looked up once
+// when the program is created so drawing never asks the driver by name.
+class ShaderProgram
+{
+public:
+	GLuint handle;
+	map<string, GLint> uniforms; // name -> location
+	map<string, GLuint> uniformBlocks; // name -> block index
+
+	// slots set on every draw, -1 if the program doesn't use them
+	GLint uObjectWorldM;
+	GLint uObjectWorldInverseM;
+	GLint uObjectPerpsectM;
+	GLint uView;
+
+	// Instanced programs read their world matrices from per-instance
+	// attributes (mat4 aInstanceWorldM, optionally mat4 aInstanceWorldInverseM)
+	// and the camera from uViewPerspectM.  -1 if the program doesn't use them.
+	GLint aInstanceWorldM;
+	GLint aInstanceWorldInverseM;
+	GLint uViewPerspectM;
+	bool isInstanced(void) const { return aInstanceWorldM != -1; }
+
+	GLint uObjectIndex; // into the Object block of FRAME_INCLUDE, -1 if the program doesn't use it
+
+	ShaderProgram(GLuint programHandle) { handle = programHandle; reflect(); }
+	void reflect(void);
+	GLint getUniform(const string &name) const;
+	GLuint getUniformBlock(const string &name) const; // GL_INVALID_INDEX if missing
+};
+
+ShaderProgram *getShaderProgram(GLuint handle);
+// deletes the GL program and forgets it, since GL hands its number out again
+void deleteShaderProgram(GLuint handle);
 
 //-------------------------------------------------------------------------//
 // GLM UTILITY STUFF
@@ -109,11 +224,71 @@ void printPath();
 
 bool getFullFileName(const string &fileName, string &fullName);
 FILE *openFileForReading(const string &fileName);
+bool getFileModTime(const string &fullName, time_t &modTime);
+
+// Read-only view of a whole file.  Uses mmap where available,
+// otherwise falls back to reading the file into memory.
+class MappedFile
+{
+public:
+	const unsigned char *data;
+	size_t size;
+
+	MappedFile(void) { data = NULL; size = 0; isMapped = false; }
+	~MappedFile() { close(); }
+	bool open(const string &fullName);
+	void close(void);
+
+private:
+	bool isMapped;
+	MappedFile(const MappedFile &);
+	MappedFile &operator=(const MappedFile &);
+};
 
 bool getToken(FILE *f, string &token, const string &oneCharTokens);
 int getFloats(FILE *f, float *a, int num);
 int getInts(FILE *f, int *a, int num);
 
+#define TOKENIZER_TABLES 4
+
+// Same grammar as getToken, but over a whole file in memory.  Characters
+// are classified with a 256 entry table per set of one char tokens, tokens
+// are views into the buffer, and numbers are parsed with from_chars.
+class Tokenizer
+{
+public:
+	Tokenizer(void) { cur = end = NULL; numTables = 0; nextTable = 0; }
+	bool open(const string &fileName);
+	void setBuffer(const char *buffer, size_t size) { cur = buffer; end = buffer + size; }
+
+	bool next(string_view &token, const string &oneCharTokens);
+	bool getFloat(float &val);
+	bool getInt(int &val);
+	bool atEnd(void) const { return cur >= end; }
+
+	// raw access to the unread part of the buffer
+	const char *position(void) const { return cur; }
+	const char *bufferEnd(void) const { return end; }
+	void setPosition(const char *p) { cur = p; }
+
+private:
+	struct CharClasses {
+		string oneCharTokens;
+		unsigned char classes[256];
+	};
+	MappedFile file;
+	const char *cur, *end;
+	CharClasses tables[TOKENIZER_TABLES];
+	int numTables, nextTable;
+
+	const unsigned char *getCharClasses(const string &oneCharTokens);
+	void skipSpace(void);
+};
+
+bool getToken(Tokenizer &t, string &token, const string &oneCharTokens);
+int getFloats(Tokenizer &t, float *a, int num);
+int getInts(Tokenizer &t, int *a, int num);
+
 bool loadFileAsString(const string &fileName, string &buffer);
 
 void replaceIncludes(string &src, string &dest, const string &directive, 
@@ -172,13 +347,31 @@ public:
 	float znear, zfar; // near and far clip planes
     
 	glm::mat4x4 worldViewProject;
+	float viewportHeight; // in framebuffer pixels, from the last refreshTransform
+	float aspect; // width over height, from the last refreshTransform
+
+	Camera(void) { viewportHeight = 0.0f; aspect = 1.0f; }
     
+	// takes the framebuffer size, not the window's, since the two differ on
+	// HiDPI displays and gl_FragCoord counts framebuffer pixels
 	void refreshTransform(float screenWidth, float screenHeight) {
+		viewportHeight = screenHeight;
+		aspect = screenWidth / screenHeight;
 		glm::mat4x4 worldView = glm::lookAt(eye, center, vup);
 		glm::mat4x4 project = glm::perspective((float)fovy,
                                                (float)(screenWidth / screenHeight), (float)znear, (float)zfar);
 		worldViewProject = project * worldView;
 	}
+
+	// world space ray through a window position, (0, 0) being the top left
+	void pickRay(double x, double y, int width, int height, glm::vec3 &origin, glm::vec3 &dir) {
+		glm::mat4x4 inverse = glm::inverse(worldViewProject);
+		float ndcX = (float)(2.0 * x / width - 1.0), ndcY = (float)(1.0 - 2.0 * y / height);
+		glm::vec4 nearPoint = inverse * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+		glm::vec4 farPoint = inverse * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+		origin = glm::vec3(nearPoint) / nearPoint.w;
+		dir = glm::normalize(glm::vec3(farPoint) / farPoint.w - origin);
+	}
     
 	void translateGlobal(glm::vec3 t) { eye += t; center += t; }
 	void translateLocal(glm::vec3 t) {
@@ -220,14 +413,35 @@ public:
     
 	glm::mat4x4 transform;
 	glm::mat4x4 invTransform;
+
+	// what transform was last built from, so unchanged transforms are skipped
+	glm::vec3 builtScale;
+	glm::quat builtRotation;
+	glm::vec3 builtTranslation;
+	bool built;
+	// bumped by every rebuild, whoever asked for it; TransformHierarchy keeps
+	// its own copy to tell which nodes moved since its last update
+	unsigned int version;
+
+	Transform(void) { built = false; version = 0; }
     
-	void refreshTransform(void)
+	// returns true if the matrices had to be rebuilt
+	bool refreshTransform(void)
 	{
+		if (built && scale == builtScale && rotation == builtRotation && translation == builtTranslation) {
+			return false;
+		}
 		glm::mat4x4 Mtrans = glm::translate(translation);
 		glm::mat4x4 Mscale = glm::scale(scale);
 		glm::mat4x4 Mrot = glm::toMat4(rotation);
 		transform = Mtrans * Mrot * Mscale;  // transforms happen right to left
 		invTransform = glm::inverse(transform);
+		builtScale = scale;
+		builtRotation = rotation;
+		builtTranslation = translation;
+		built = true;
+		version++;
+		return true;
 	}
     
     void translateGlobal(glm::vec3 moveVec)
@@ -350,16 +564,225 @@ class Material
 {
 public:
 	GLuint shaderProgram;
+	ShaderProgram *program; // reflection for shaderProgram, found on first bind
 	vector< NameIdVal<glm::vec4> > colors;
 	vector< NameIdVal<RGBAImage*> > textures;
+
+	int textureSet; // id shared by materials binding the same textures, found on first use
+
+	Material(void) { shaderProgram = NULL_HANDLE; program = NULL; textureSet = -1; }
+	ShaderProgram *getProgram(void) {
+		if (program == NULL || program->handle != shaderProgram) program = getShaderProgram(shaderProgram);
+		return program;
+	}
+	int getTextureSet(void);
 	void bindMaterial(Transform &T, Camera &camera);
     void bindNodeMaterial(Node* node, Camera &camera);
+	void bindColors(ShaderProgram *p);
+	void bindTextures(ShaderProgram *p);
+
+private:
+	void bindColorsAndTextures(ShaderProgram *p) { bindColors(p); bindTextures(p); }
 };
 
 //-------------------------------------------------------------------------//
 // TRIANGLE MESH
 //-------------------------------------------------------------------------//
 
+// ASCII ply bodies of at least PLY_PARALLEL_MIN_BYTES are parsed in
+// chunks on gPlyThreads threads (0 = one per hardware thread).  Meshes
+// loaded by pool workers are parsed serially, since the pool already keeps
+// every core busy with other meshes.
+#define PLY_PARALLEL_MIN_BYTES (1 << 20)
+extern int gPlyThreads;
+
+// Binary mesh cache written next to the source .ply.  Bump the version
+// whenever the layout changes so stale caches get rebuilt.  The settings a
+// mesh was built with are recorded too, and a cache made with others is
+// rebuilt.
+#define MESH_CACHE_VERSION 5
+#define MESH_CACHE_LODS 1
+#define MESH_CACHE_OPTIMIZED 2
+#define MESH_CACHE_EXTENSION ".ebmesh"
+extern bool gUseMeshCache;
+
+// Levels of detail are made from the full mesh by quadric error edge
+// collapses when it is read from the ply, and cached with it.  Every level
+// reuses the full mesh's vertices, so they share one vertex buffer and only
+// differ in their range of the index buffer.  Each level has about half the
+// triangles of the one before.
+#define MESH_MAX_LODS 4
+#define MESH_LOD_MIN_TRIANGLES 256 // smaller meshes get no extra levels
+extern bool gBuildMeshLods;
+
+// A node draws the coarsest level whose error covers at most lodPixelError
+// pixels on screen.  It only changes level once it is LOD_HYSTERESIS past
+// that, so nodes near a threshold don't flicker.  Nodes smaller than
+// lodMinPixels across are not drawn.
+#define LOD_HYSTERESIS 0.25f
+extern float gLodPixelError;
+extern float gLodMinPixels;
+
+// Meshes read from a ply are optimized before they are cached: identical
+// vertices are welded, triangles reordered for the post-transform cache
+// (Tipsify) and vertices renumbered in order of first use, so fetches walk
+// the vertex buffer forwards.  ACMR is cache misses per triangle, ATVR cache
+// misses per vertex (1.0 is ideal), both for a FIFO of VERTEX_CACHE_SIZE.
+#define VERTEX_CACHE_SIZE 16
+extern bool gOptimizeMeshes;
+
+class MeshOptimizeStats
+{
+public:
+	int verticesBefore, verticesAfter;
+	float acmrBefore, acmrAfter;
+	float atvrBefore, atvrAfter;
+	MeshOptimizeStats(void) { verticesBefore = verticesAfter = 0; acmrBefore = acmrAfter = atvrBefore = atvrAfter = 0.0f; }
+};
+
+// Totals over every mesh optimized while loading, for loadScene to report.
+// Meshes are loaded on the worker threads, so add takes the lock.
+class MeshOptimizeTotals
+{
+public:
+	int meshes, triangles;
+	size_t verticesBefore, verticesAfter;
+	double missesBefore, missesAfter; // vertex cache misses, ACMR times triangles and ATVR times vertices
+	MeshOptimizeTotals(void) { meshes = triangles = 0; verticesBefore = verticesAfter = 0; missesBefore = missesAfter = 0.0; }
+	void add(const MeshOptimizeStats &stats, int numTriangles);
+private:
+	mutex lock;
+};
+extern MeshOptimizeTotals gMeshOptimizeStats;
+
+// How a mesh's vertices are packed on the GPU.  Only attributes a shader
+// can bind are uploaded, and with compression on each gets the smallest
+// type that keeps it accurate:
+//   positions  half float, if within VERTEX_POSITION_TOLERANCE of the radius
+//   normals    10:10:10:2 snorm
+//   texcoords  unorm16 when inside [0, 1]
+//   colors     unorm8
+// Everything is decoded by the vertex fetch, so shaders are unchanged.
+// Index buffers are 16 bit for meshes with at most 65536 vertices.  Packing
+// writes straight into the mapped buffer, and a format that matches the
+// mesh's floats is uploaded from them as is.
+#define VERTEX_POSITION_TOLERANCE 0.001f
+extern bool gCompressVertices;
+
+class VertexAttribute
+{
+public:
+	int location; // V_POSITION, V_NORMAL, V_ST or V_COLOR
+	int source; // first float of the attribute in the mesh's vertexData
+	int components;
+	GLenum type;
+	GLboolean normalized;
+	int offset; // bytes into the packed vertex
+};
+
+class VertexFormat
+{
+public:
+	vector<VertexAttribute> attributes;
+	int stride; // bytes per packed vertex, a multiple of 4
+
+	VertexFormat(void) { stride = 0; }
+	void choose(const TriMesh &mesh, const float *vertices, int numVertices, bool compress);
+	bool matches(int sourceStride) const; // packing would copy the floats unchanged
+	void pack(const float *vertices, int numVertices, int sourceStride, unsigned char *packed) const;
+	void bind(void) const; // with the vertex buffer bound to GL_ARRAY_BUFFER
+};
+
+class MeshUploadStats
+{
+public:
+	int meshes, shortIndices;
+	int unpacked; // vertices uploaded as they were read
+	size_t bytes; // vertex and index buffers as uploaded
+	size_t floatBytes; // and as every attribute in floats with 32 bit indices
+	MeshUploadStats(void) { meshes = shortIndices = unpacked = 0; bytes = floatBytes = 0; }
+};
+extern MeshUploadStats gMeshUploadStats;
+
+// Big meshes are split into meshlets when uploaded: runs of consecutive
+// triangles (so each is one range of the index buffer) with at most
+// MESHLET_MAX_VERTICES vertices and MESHLET_MAX_TRIANGLES triangles.  Each
+// has a bounding sphere and a cone holding its normals, and when the mesh is
+// drawn at full detail the meshlets off screen or facing away are skipped
+// and the rest drawn with one glMultiDrawElements.  Facing away assumes the
+// back of a surface is never seen, which only holds for closed meshes since
+// the engine draws both sides, so that test is off unless a scene turns it on.
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 128
+#define MESHLET_MIN_TRIANGLES 4096 // smaller meshes are drawn whole
+extern bool gUseMeshlets;
+extern bool gMeshletConeCulling;
+
+class Meshlet
+{
+public:
+	glm::vec3 center;
+	float radius;
+	glm::vec3 coneAxis;
+	float coneCutoff; // sine of the cone's half angle, 1 if it can't be culled
+	int start, count; // range of indices
+};
+
+// When streaming, meshes drop their CPU copies once they are on the GPU,
+// unless a mesh asks to keep them (collision, picking, etc).
+extern bool gStreamMeshes;
+
+// Triangle BVH for casting rays against a mesh's surface.  Built with binned
+// SAH over the triangle centroids and flattened depth first, so an interior
+// node's left child is the next node and only the right child is stored.
+// Triangles are copied out in leaf order to keep traversal off the vertex
+// array.
+#define MESH_BVH_BINS 16
+#define MESH_BVH_LEAF_SIZE 4 // never split at or below this
+#define MESH_BVH_MAX_LEAF 32 // always split above this, whatever it costs
+#define MESH_BVH_MAX_DEPTH 64
+
+class MeshBVHNode
+{
+public:
+	glm::vec3 lo, hi;
+	int start; // first triangle for leaves, right child otherwise
+	int count; // 0 for interior nodes
+};
+
+// Rays stay in the space they were given in; t is in units of dir, so it is
+// the same before and after transforming into the mesh's object space.
+class MeshRay
+{
+public:
+	glm::vec3 origin, dir;
+	float maxDist;
+	float t; // nearest hit, maxDist on a miss
+	int triangle; // index into the mesh's triangles, -1 on a miss
+	float u, v; // barycentrics of the hit
+};
+
+class MeshBVH
+{
+public:
+	vector<MeshBVHNode> nodes;
+	vector<glm::vec3> corners; // three per triangle, in leaf order
+	vector<int> triangles; // the mesh's triangle index for each of those
+
+	bool build(const TriMesh &mesh); // needs the mesh's CPU data
+	int size(void) const { return (int)nodes.size(); }
+
+	// nearest hits for a batch of rays given in world space
+	int intersect(vector<MeshRay> &rays, const glm::mat4x4 &worldInverse) const;
+	bool intersect(MeshRay &ray) const; // object space
+	bool occluded(const glm::vec3 &from, const glm::vec3 &to) const; // object space, any hit
+
+private:
+	bool trace(MeshRay &ray, bool anyHit) const;
+	int buildNode(vector<int> &order, int start, int count, int depth, const vector<glm::vec3> &lo,
+		const vector<glm::vec3> &hi, const vector<glm::vec3> &centroid);
+};
+
 class TriMesh
 {
 public:
@@ -371,8 +794,59 @@ public:
     
 	GLuint vao; // vertex array handle
 	GLuint ibo; // index buffer handle
+
+	// If keepCPUData is false, vertexData and indices are released after
+	// sendToOpenGL, and a cached mesh is uploaded straight from the mapped
+	// cache file without ever being copied into them.
+	bool keepCPUData;
+	MappedFile mappedCache;
+	const float *mappedVertices;
+	const int *mappedIndices;
+	size_t mappedNumFloats;
+
+	// object space bounds, kept when the CPU copies are released
+	glm::vec3 boundsMin, boundsMax;
+	glm::vec3 sphereCenter;
+	float sphereRadius; // negative if the mesh has no positions
+
+	MeshBVH *bvh; // built on first use, see getBVH
+
+	VertexFormat format;
+	GLenum indexType; // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, set on upload
+	int indexSize; // bytes per index
+
+	vector<Meshlet> meshlets; // of level 0, empty if it is drawn whole
+
+	// level 0 is the full mesh, indices [0, numIndices); the others follow it
+	int numLods;
+	int lodStart[MESH_MAX_LODS], lodCount[MESH_MAX_LODS]; // in indices
+	float lodError[MESH_MAX_LODS]; // object space distance from the full mesh
 	
-	bool readFromPly(const string &fileName, bool flipZ = false);
+	TriMesh(void) {
+		numIndices = 0; vao = NULL_HANDLE; ibo = NULL_HANDLE;
+		keepCPUData = !gStreamMeshes;
+		mappedVertices = NULL; mappedIndices = NULL; mappedNumFloats = 0;
+		sphereRadius = -1.0f;
+		bvh = NULL;
+		indexType = GL_UNSIGNED_INT; indexSize = sizeof(int);
+		numLods = 1; lodStart[0] = 0; lodCount[0] = 0; lodError[0] = 0.0f;
+	}
+	void releaseCPUData(void);
+	void computeBounds(void);
+	void optimize(MeshOptimizeStats *stats = NULL); // before buildLods
+	void buildLods(void); // from indices [0, numIndices), appended after them
+	void buildMeshlets(const float *vertices, const int *faces);
+
+	// fills in the draws for the meshlets that might be seen, returns how many
+	int cullMeshlets(const glm::mat4x4 &world, const float planes[6][4], const glm::vec3 &eye,
+		vector<GLsizei> &counts, vector<const void*> &offsets) const;
+	int totalIndices(void) const { return lodStart[numLods - 1] + lodCount[numLods - 1]; }
+	MeshBVH *getBVH(void); // NULL once the CPU data is gone, unless built before
+
+	bool load(const string &fileName, bool flipZ = false); // cache if current, else ply
+	bool readFromPly(const string &fileName, bool flipZ = false); // ascii or binary, either byte order
+	bool readFromCache(const string &cacheName, bool flipZ, bool useMmap = true);
+	bool writeToCache(const string &cacheName, bool flipZ);
 	bool sendToOpenGL(void);
 	void draw(void);
 };
@@ -486,56 +960,241 @@ extern GLuint gLightBufferObject;
 extern int gNumLights;
 extern Light gLights[MAX_LIGHTS];
 
+extern bool gLightsChanged; // set when gLights changes, the block is only re-sent then
+
 void initLightBuffer(void);
 
+//-------------------------------------------------------------------------//
+// Clustered lights
+//-------------------------------------------------------------------------//
+
+// Clustered forward shading for any number of lights.  The view frustum is
+// cut into CLUSTER_X x CLUSTER_Y tiles and CLUSTER_Z exponential depth
+// slices.  Every frame each point and spot light's bounding sphere is
+// tested against the tile planes (four at a time) to find the clusters it
+// touches.  Lights with no finite range (directional, ambient, or without
+// falloff) are global and reach every fragment.  Shaders read everything
+// through texture buffers by including the built-in CLUSTER_INCLUDE.  Lists
+// are capped at CLUSTER_MAX_LIGHTS, so the per-fragment cost stays bounded
+// however many lights the scene has.  Nothing is built while no linked
+// program reads the Clusters block.
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_COUNT (CLUSTER_X * CLUSTER_Y * CLUSTER_Z)
+#define CLUSTER_MAX_LIGHTS 64
+#define CLUSTER_LIGHT_CUTOFF (1.0f / 256.0f) // intensity where a light's range ends
+#define CLUSTER_BUFFER_ID 2 // uniform block binding, after LIGHT_BUFFER_ID
+#define CLUSTER_TEXTURE_UNIT 13 // lights, then ranges, then indices
+#define CLUSTER_INCLUDE "clusters.glsl"
+extern vector<Light> gClusterLights; // every light in the scene, gLights is the first MAX_LIGHTS
+extern bool gUseClusteredLights;
+extern set<GLuint> gClusterPrograms; // linked programs with a Clusters block
+
+class ClusterStats
+{
+public:
+	int lights, globalLights, culledLights;
+	int references; // light indices over all clusters
+	int maxPerCluster;
+	int overflows; // clusters that hit CLUSTER_MAX_LIGHTS
+	double assignTime;
+};
+
+class ClusterGrid
+{
+public:
+	ClusterStats stats;
+
+	ClusterGrid(void);
+	void update(const Camera &camera, const vector<Light> &lights, bool lightsChanged);
+
+	// cluster c's lights are indices[offset[c] .. offset[c] + count[c]),
+	// after the globals, which are lights 0 .. stats.globalLights - 1
+	vector<unsigned int> offset, count, indices;
+
+private:
+	GLuint uniformBuffer, lightBuffer, rangeBuffer, indexBuffer;
+	GLuint textures[3];
+	vector<float> boundaryX[2], boundaryY[2]; // tile planes through the eye, as (a, b) of a*x + b*z
+	vector<glm::vec4> lightData; // global lights first, 5 texels each
+	vector<int> lightRange; // per clustered light: x0 x1 y0 y1 z0 z1
+	vector<unsigned int> rangeData;
+	float lastFovy, lastAspect;
+
+	void buildPlanes(float fovy, float aspect);
+	void assign(const Camera &camera, const vector<Light> &lights);
+	void upload(bool lightsChanged);
+};
+
+//-------------------------------------------------------------------------//
+// Frame data
+//-------------------------------------------------------------------------//
+
+// Per-frame constants (camera, lights, per-object matrices) are written into
+// one uniform buffer used as a ring, and each block is bound with
+// glBindBufferRange.  With ARB_buffer_storage the buffer is mapped once,
+// persistently, and split into FRAMES_IN_FLIGHT regions; the fence left at
+// the end of a frame says when its region can be written again.  Otherwise
+// the buffer is orphaned at the start of every frame.  Shaders get the
+// Camera and Object blocks by including the built-in FRAME_INCLUDE, and
+// those without it keep their plain uniforms.  Object data is packed
+// FRAME_OBJECT_BATCH draws to a block, since rebinding a range on every
+// draw costs more than the glUniform calls it replaces; each draw only
+// sets its index, uObjectIndex.  A frame that outgrows its region moves on
+// to a bigger buffer; the old one keeps the blocks already bound from it
+// until a fence says the GPU is done with them.
+#define FRAME_BUFFER_SIZE (1 << 20) // bytes per frame, doubled if a frame needs more
+#define FRAME_BUFFER_MAX_SIZE (64 << 20)
+#define FRAMES_IN_FLIGHT 3
+#define CAMERA_BUFFER_ID 3 // uniform block bindings, after CLUSTER_BUFFER_ID
+#define OBJECT_BUFFER_ID 4
+#define FRAME_OBJECT_BATCH 64 // 3 matrices each, inside the 16 KB every GL 4.1 block may hold
+#define FRAME_INCLUDE "frame.glsl"
+extern bool gUseFrameData;
+extern bool gPersistentFrameData; // false to orphan even where buffer storage exists
+
+class FrameDataStats
+{
+public:
+	double stallTime; // blocked before constants could be written
+	int stalls;
+	size_t bytes; // written through the ring
+	int grows; // frames that outgrew their region
+
+	FrameDataStats(void) { reset(); }
+	void reset(void) { stallTime = 0.0; stalls = 0; bytes = 0; grows = 0; }
+};
+
+class FrameAllocator
+{
+public:
+	FrameDataStats stats;
+
+	FrameAllocator(void);
+	void beginFrame(void); // waits until the GPU is done with the region this frame reuses
+	void endFrame(void);
+	void release(void);
+	// copies data into this frame's region and binds it to a uniform block binding point
+	void bind(GLuint index, const void *data, GLsizeiptr bytes);
+	// adds one object's matrices to the current Object block, returns its index there
+	int bindObject(const glm::mat4x4 matrices[3]);
+	bool isPersistent(void) const { return mapped != NULL; }
+
+private:
+	GLuint buffer;
+	unsigned char *mapped; // NULL when orphaning
+	GLsizeiptr regionSize, head, end;
+	GLint alignment;
+	GLsync fences[FRAMES_IN_FLIGHT];
+	int region;
+	GLsizeiptr objectOffset; // of the current Object block
+	int numObjects; // in it
+	struct RetiredBuffer { GLuint buffer; GLsync fence; }; // fence is NULL until the frame ends
+	vector<RetiredBuffer> retired;
+
+	void create(GLsizeiptr size);
+	void retire(void);
+	GLsizeiptr allocate(GLsizeiptr bytes);
+	void write(GLsizeiptr offset, const void *data, GLsizeiptr bytes);
+};
+
+extern FrameAllocator gFrameData;
+
+// fill the Camera and Object blocks of FRAME_INCLUDE; bindObjectData does
+// nothing for programs that don't read the Object block
+void bindCameraData(const Camera &camera);
+void bindObjectData(ShaderProgram *p, const Camera &camera, const glm::mat4x4 &world, const glm::mat4x4 &worldInverse);
+
+const char *getBuiltinInclude(const string &fileName); // NULL unless the engine provides it
+
 //-------------------------------------------------------------------------//
 //  Particle System
 //-------------------------------------------------------------------------//
-#define MAX_PARTICLES 10000
+// Particles live in a structure of arrays, each padded to a multiple of 4
+// so update() integrates four at a time.  Dead particles are swapped with
+// the last live one.  Velocity, acceleration, life and duration are in the
+// scene file's units, which are per frame at PARTICLE_FRAME_RATE, so the
+// emitter can run off a real time step; rate is particles per second.
+#define MAX_PARTICLES 262144
+#define PARTICLE_FRAME_RATE 60.0f
+#define PARTICLE_MAX_STEP 0.1f // seconds, longer frames are clamped
 #define PS_FOUNTAIN 0
 #define PS_EXPLOSION 1
+extern float gParticleTimeStep; // seconds per frame, 0 = wall clock
 
-class Particle{
-public:
-	Transform T;
-	glm::vec3 Vel, Accel;
-	Billboard instance;
-	float life;
+// Systems marked gpu simulate in a vertex shader with transform feedback,
+// ping-ponging between two buffers of a fixed number of slots (rate times
+// life).  A slot's life counts down while alive and up while waiting to be
+// born; it respawns at the emitter with a hashed random velocity.
+#define MAX_GPU_PARTICLES (1 << 22)
 
-	Particle(glm::vec3 VelMag, glm::vec3 _Pos, glm::vec3 _Accel, float _life, Billboard inst, int type);
+class GpuParticleState
+{
+public:
+	GLuint buffers[2], updateVaos[2], drawVaos[2];
+	int current, capacity;
 
-	bool isDead(){
-		if (life < 0.0)
-			return true;
-		else
-			return false;
-	}
-	void update();
-	void render(Camera &camera);
+	GpuParticleState(void) { buffers[0] = buffers[1] = updateVaos[0] = updateVaos[1] = drawVaos[0] = drawVaos[1] = NULL_HANDLE; current = capacity = 0; }
+	void release(void);
 };
 
 class partSys{
 public:
-	vector<Particle> particles;
+	vector<float> posX, posY, posZ, velX, velY, velZ, life;
+	int count;
 
 	Billboard bb;
 	glm::vec3 Origin, Vel, Accel, VelMag;
-	float duration, life;
+	float duration, lifeSpan, rate;
+	float age, emitCarry;
 	int type;
 
+	// blended from start to end over each particle's life
+	glm::vec4 startColor, endColor;
+	float startSize, endSize; // default to the billboard's width
+
+	bool gpu; // simulated by ParticleRenderer::simulate, the arrays stay empty
+	GpuParticleState gpuState;
+
 	partSys(glm::vec3 Pos, glm::vec3 Vel, glm::vec3 Accel, glm::vec3 VelMag, Billboard _bb, float _duration, float _life, int _type);
 
-	void initPS();
-	void addParticle();
-	void update();
-	void render(Camera &camera);
+	void emit(int n);
+	void update(float dt);
 
-	bool isDead(){
-		if (particles[0].life < 0.0)
-			return true;
-		else
-			return false;
-	}
+	bool isDead(){ return age > duration && (gpu ? age > duration + lifeSpan : count == 0); }
+
+private:
+	void reserve(int n);
+};
+
+// Draws a whole system with one glDrawElementsInstanced.  Positions, sizes
+// and colors are streamed into instanceBuffer every frame, and the vertex
+// shader turns each into a quad facing the camera (type 1 billboards) or
+// standing upright (type 0), textured with the billboard's first texture.
+struct ParticleInstance
+{
+	float x, y, z, size;
+	unsigned char color[4];
+};
+
+class ParticleRenderer
+{
+public:
+	ParticleRenderer(void);
+	void simulate(partSys &system, float dt); // gpu systems only
+	void draw(partSys &system, Camera &camera);
+
+private:
+	GLuint program, vao, quadBuffer, indexBuffer, instanceBuffer;
+	size_t instanceBufferSize;
+	vector<ParticleInstance> instanceData;
+	GLuint updateProgram, gpuDrawProgram;
+
+	bool init(void);
+	bool initGpu(partSys &system);
+	void drawGpu(partSys &system, Camera &camera);
+	void drawInstances(partSys &system, Camera &camera, ShaderProgram *p, GLuint instanceVao, int count);
 };
 
 
@@ -553,13 +1212,18 @@ public:
    
 
 	TriMeshInstance *meshInst;
+	int transformIndex; // slot in the scene's TransformHierarchy, -1 until built
+	int bvhProxy; // leaf in the scene's SceneBVH, -1 if not indexed
+	int collisionBody; // body in the scene's Broadphase, -1 if none
+	int lodLevel; // level of detail drawn last frame
 
-    Node(){ nodeType = NULL; parent = NULL;}
+    Node(){ nodeType = NULL; parent = NULL; transformIndex = -1; bvhProxy = -1; collisionBody = -1; lodLevel = 0;}
 
-    Node(TriMeshInstance *_meshInst){ meshInst = new TriMeshInstance(*_meshInst); nodeType = 0; }
+    Node(TriMeshInstance *_meshInst){ meshInst = new TriMeshInstance(*_meshInst); nodeType = 0; parent = NULL; transformIndex = -1; bvhProxy = -1; collisionBody = -1; lodLevel = 0; }
 
 	void addChildren(Node *child){ children.push_back(child); }
     void draw(Camera &camera);
+	glm::mat4x4 getWorldTransform(void);
 	void rotateLocal(glm::vec3 axis, float angle, bool inverse); //rotates just parent 
 	void rotateGlobal(glm::vec3 axis, float angle, bool inverse){ //rotates parent and children 
 		rotateLocal(axis, angle, !inverse);
@@ -583,6 +1247,269 @@ public:
 };
 
 
+//-------------------------------------------------------------------------//
+// Transform Hierarchy
+//-------------------------------------------------------------------------//
+
+// World matrices for every drawn node, flattened so parents always come
+// before their children.  update() is one pass in that order: a node is
+// rebuilt only if its own transform changed or its parent's world did.
+class TransformHierarchy
+{
+public:
+	vector<Node*> nodes;
+	vector<int> parents; // index into nodes, -1 for roots
+	vector<glm::mat4x4> worlds, worldInverses;
+	vector<unsigned char> dirty; // set for the worlds rebuilt by the last update
+
+	TransformHierarchy(void) { rebuilt = false; }
+	void build(map<string, Node*> &sceneNodes);
+	int update(void); // returns the number of world matrices rebuilt
+	int size(void) const { return (int)nodes.size(); }
+
+private:
+	bool rebuilt; // everything is dirty on the first update after a build
+	vector<unsigned int> versions; // Transform::version each world was built from
+	void addSubtree(Node *node, int parent);
+};
+
+//-------------------------------------------------------------------------//
+// Frustum Culling
+//-------------------------------------------------------------------------//
+
+// World space bounding spheres for the hierarchy's nodes, stored as
+// structure of arrays and padded to a multiple of 4 so the plane tests
+// run four spheres at a time.  Spheres are only re-transformed for nodes
+// whose world matrix or mesh changed.
+// planes from the matrix's rows, normalized and pointing inwards
+void frustumPlanes(const glm::mat4x4 &worldViewProject, float planes[6][4]);
+
+class FrustumCuller
+{
+public:
+	vector<float> centerX, centerY, centerZ, radius;
+	vector<TriMesh*> meshes; // mesh each sphere was made from
+	vector<unsigned char> visible; // per node, filled by cull()
+
+	void update(TransformHierarchy &hierarchy);
+	int cull(const glm::mat4x4 &worldViewProject); // returns the number visible
+};
+
+//-------------------------------------------------------------------------//
+// Scene BVH
+//-------------------------------------------------------------------------//
+
+// Dynamic AABB tree over the scene's nodes.  Leaves hold a node's world
+// bounds inside a fattened box, so small moves only update the leaf; a node
+// is reinserted when it leaves its fat box.  Inserts pick the sibling with
+// the least surface area cost and rotations keep the tree balanced, so
+// queries stay logarithmic in the number of nodes.
+#define BVH_NULL -1
+#define BVH_FAT_FRACTION 0.1f // of the box size, added on every side
+#define BVH_FAT_MIN 0.05f
+
+class BVHNode
+{
+public:
+	glm::vec3 lo, hi; // fat box for leaves, union of children otherwise
+	glm::vec3 boundsLo, boundsHi; // leaves only, the node's actual bounds
+	int parent; // next free slot while on the free list
+	int left, right; // BVH_NULL for leaves
+	int height; // 0 for leaves, -1 when free
+	Node *node;
+
+	bool isLeaf(void) const { return left == BVH_NULL; }
+};
+
+class RayHit
+{
+public:
+	Node *node;
+	float t; // distance along the ray to the hit
+	int triangle; // the mesh triangle hit, -1 if t is only to the node's bounds
+};
+
+class SceneBVH
+{
+public:
+	SceneBVH(void) { root = BVH_NULL; freeList = BVH_NULL; numLeaves = 0; }
+
+	// called after TransformHierarchy::update, rebuilt if it was just rebuilt
+	void update(TransformHierarchy &hierarchy, bool rebuilt);
+
+	int size(void) const { return numLeaves; }
+	int height(void) const { return root == BVH_NULL ? 0 : tree[root].height; }
+
+	// Results are appended.  Nearest and ray results are sorted by distance,
+	// which is measured to a node's world bounds.
+	void queryFrustum(const glm::mat4x4 &worldViewProject, vector<Node*> &result) const;
+	void querySphere(const glm::vec3 &center, float radius, vector<Node*> &result) const;
+	void queryNearest(const glm::vec3 &point, int k, vector<Node*> &result) const;
+	void queryRay(const glm::vec3 &origin, const glm::vec3 &dir, float maxDist, vector<RayHit> &result) const;
+
+private:
+	vector<BVHNode> tree;
+	int root;
+	int freeList;
+	int numLeaves;
+
+	int allocate(void);
+	void release(int index);
+	int insertLeaf(Node *node, const glm::vec3 &lo, const glm::vec3 &hi);
+	void removeLeaf(int leaf);
+	void moveLeaf(int leaf, const glm::vec3 &lo, const glm::vec3 &hi);
+	void attach(int leaf);
+	void detach(int leaf);
+	void refitFrom(int index);
+	int balance(int index);
+};
+
+// world space AABB of a node's mesh, a point at its origin if it has none
+void nodeWorldBounds(Node *node, const glm::mat4x4 &world, glm::vec3 &lo, glm::vec3 &hi);
+
+//-------------------------------------------------------------------------//
+// Collision
+//-------------------------------------------------------------------------//
+
+// Sweep and prune broadphase over the nodes' world bounds.  Each axis keeps
+// its box endpoints sorted; as nodes move only a few endpoints change place,
+// so an insertion sort fixes the order in near linear time and every swap
+// of a min past a max starts or ends an overlap.  Each update() reports the
+// overlapping pairs as begin, stay and end events.
+#define CONTACT_BEGIN 0
+#define CONTACT_STAY 1
+#define CONTACT_END 2
+
+class ContactEvent
+{
+public:
+	Node *a, *b;
+	int type;
+};
+
+class SAPEndpoint
+{
+public:
+	float value;
+	uint32_t data; // body index << 1, low bit set for a max endpoint
+};
+
+class SAPBody
+{
+public:
+	Node *node;
+	glm::vec3 lo, hi;
+	bool alive;
+	int eventStart, eventCount; // this body's slice of eventsByBody
+};
+
+class Broadphase
+{
+public:
+	vector<ContactEvent> events; // from the last update
+
+	// called after TransformHierarchy::update, rebuilt if the node set changed
+	void update(TransformHierarchy &hierarchy, bool rebuilt);
+
+	int numBodies(void) const { return (int)bodies.size() - (int)freeBodies.size(); }
+	int numPairs(void) const { return (int)pairs.size(); }
+
+	// appends the last update's events involving node, with node as a
+	void getContacts(Node *node, vector<ContactEvent> &result) const;
+
+private:
+	vector<SAPBody> bodies;
+	vector<int> freeBodies;
+	vector<SAPEndpoint> endpoints[3];
+	unordered_set<uint64_t> pairs, lastPairs;
+	vector<int> eventsByBody; // event indices grouped by body
+
+	int addBody(Node *node);
+	void removeBodies(vector<int> &dead);
+	void sortAxis(int axis);
+	void rebuildPairs(void);
+	bool overlaps(int a, int b) const;
+	void buildEvents(void);
+};
+
+//-------------------------------------------------------------------------//
+// Render Queue
+//-------------------------------------------------------------------------//
+
+// Nodes are collected into packets, radix sorted by key and then submitted,
+// so program, texture and vertex array changes happen once per run of equal
+// state rather than once per node.  Key layout, high bits first:
+//   program (16) | texture set (24) | vertex array (16) | level of detail (8)
+#define RQ_PROGRAM_SHIFT 48
+#define RQ_TEXTURES_SHIFT 24
+#define RQ_VAO_SHIFT 8
+#define RQ_LOD_MASK 0xFF
+
+class DrawPacket
+{
+public:
+	uint64_t key;
+	uint32_t transform; // index into the queue's per draw arrays
+};
+
+class RenderStats
+{
+public:
+	int packets;
+	int drawCalls;
+	int programBinds;
+	int textureBinds;
+	int vaoBinds;
+	int instancedDraws; // glDrawElementsInstanced calls, included in drawCalls
+	int instances; // packets drawn through them
+	int transformsUpdated; // world matrices rebuilt by the hierarchy
+	int visibleNodes; // nodes that passed the frustum test
+	int culledNodes; // and those that didn't
+	int tooSmallNodes; // visible, but below gLodMinPixels
+	int lodNodes[MESH_MAX_LODS]; // nodes drawn at each level
+	int trianglesSubmitted;
+	int trianglesFull; // had every visible node been drawn at level 0
+	int meshletsTested, meshletsDrawn;
+
+	RenderStats(void) { reset(); }
+	void reset(void) {
+		packets = drawCalls = programBinds = textureBinds = vaoBinds = instancedDraws = instances = 0;
+		transformsUpdated = visibleNodes = culledNodes = tooSmallNodes = 0;
+		trianglesSubmitted = trianglesFull = 0;
+		meshletsTested = meshletsDrawn = 0;
+		for (int i = 0; i < MESH_MAX_LODS; i++) lodNodes[i] = 0;
+	}
+};
+extern RenderStats gRenderStats; // counts for the frame being rendered
+
+class RenderQueue
+{
+public:
+	RenderQueue(void) { instanceBuffer = NULL_HANDLE; instanceBufferSize = 0; }
+	void clear(void);
+	void add(TriMeshInstance *instance, const glm::mat4x4 &world, const glm::mat4x4 &worldInverse, int lod = 0);
+	void submit(Camera &camera);
+
+private:
+	vector<DrawPacket> packets, sorted;
+	vector<TriMeshInstance*> instances;
+	vector<glm::mat4x4> worlds, worldInverses;
+
+	// Packets that share program, textures, colors and mesh are drawn with one
+	// glDrawElementsInstanced when the program is instanced.  Their matrices
+	// are streamed through instanceBuffer, which is reallocated every frame.
+	GLuint instanceBuffer;
+	size_t instanceBufferSize;
+	vector<glm::mat4x4> instanceData;
+
+	// meshlet draws for glMultiDrawElements
+	vector<GLsizei> multiCounts;
+	vector<const void*> multiOffsets;
+
+	void sort(void);
+	int drawInstanced(ShaderProgram *p, int first);
+};
+
 //-------------------------------------------------------------------------//
 // Scene
 //-------------------------------------------------------------------------//
@@ -611,8 +1538,19 @@ public:
 	// Scene graph
 	Camera camera;
 	int currCam = 0;
+	RenderQueue queue;
+	TransformHierarchy hierarchy;
+	bool hierarchyChanged = true; // set whenever nodes or parents change
+	FrustumCuller culler;
+	SceneBVH bvh;
+	Broadphase broadphase;
+	bool broadphaseStale = true; // node set changed since the last collision update
 	vector<Billboard> bboards;
 	vector<partSys> ps;
+	double lastParticleTime = -1.0; // wall clock of the last particle step
+	ClusterGrid clusters;
+	bool lightBufferStale = false; // gLightBufferObject is behind the copy in the frame data ring
+	ParticleRenderer particleRenderer;
 	vector<Camera> cameras;
     
     //member functions
@@ -693,7 +1631,7 @@ public:
 		else return NULL;
 	}
 	void addCamera(Camera c){cameras.push_back(c);}
-	void addNode(Node* node){ nodes[node->name] = node;
+	void addNode(Node* node){ nodes[node->name] = node; hierarchyChanged = true;
     
         //nodes.insert(nodes.begin(), nodes.find(node->name));
     
@@ -706,7 +1644,7 @@ public:
 	void addBillboard(Billboard board){ bboards.push_back(board); }
 
 	void addParticleSystem(partSys partsys){ ps.push_back(partsys); }
-	void removeParticleSystem(int index){ ps.erase(ps.begin() + index); }
+	void removeParticleSystem(int index){ ps[index].gpuState.release(); ps.erase(ps.begin() + index); }
 
 	// multi cam functions
 	void switchCamera(int camNum){
@@ -720,51 +1658,116 @@ public:
 	// multi light functions
 	void updateLights(void)
 	{
-		// Update global lights
-		glBindBuffer(GL_UNIFORM_BUFFER, gLightBufferObject);
-		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Light) * MAX_LIGHTS, gLights);
-		//glBufferData(GL_UNIFORM_BUFFER, sizeof(Light) * MAX_LIGHTS, gLights, GL_STREAM_DRAW);
-		glBindBuffer(GL_UNIFORM_BUFFER, 0); // unbind buffer
+		// Update global lights.  Lights that change go through the frame data
+		// ring, so rewriting them never waits on the GPU; once they settle the
+		// fixed buffer catches up and is bound again.
+		if (gLightsChanged && gUseFrameData) {
+			gFrameData.bind(LIGHT_BUFFER_ID, gLights, sizeof(Light) * MAX_LIGHTS);
+			lightBufferStale = true;
+		}
+		else if (gLightsChanged || lightBufferStale) {
+			double start = WALL_TIME();
+			glBindBuffer(GL_UNIFORM_BUFFER, gLightBufferObject);
+			glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Light) * MAX_LIGHTS, gLights);
+			//glBufferData(GL_UNIFORM_BUFFER, sizeof(Light) * MAX_LIGHTS, gLights, GL_STREAM_DRAW);
+			glBindBuffer(GL_UNIFORM_BUFFER, 0); // unbind buffer
+			glBindBufferBase(GL_UNIFORM_BUFFER, LIGHT_BUFFER_ID, gLightBufferObject);
+			gFrameData.stats.stallTime += WALL_TIME() - start; // waits if the GPU still reads it
+			lightBufferStale = false;
+		}
+
+		// the cluster lists follow the camera, so they are rebuilt every frame
+		if (gUseClusteredLights && !gClusterPrograms.empty()) clusters.update(camera, gClusterLights, gLightsChanged);
+		gLightsChanged = false;
 	}
 
 	void render(void) {
 		glClearColor(backgroundColor.r, backgroundColor.g, backgroundColor.b, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+		if (gUseFrameData) {
+			gFrameData.beginFrame();
+			bindCameraData(camera);
+		}
 		updateLights();
+		gRenderStats.reset();
 
         renderNodes();
         renderBBoards();
 		renderPartSys();
+		if (gUseFrameData) gFrameData.endFrame();
 	}
     
-    void renderNodes(void)
+    // brings world matrices, culling spheres and the BVH up to date; cheap
+    // if nothing moved, so scripts can call it before querying
+    void updateTransforms(void)
     {
-        string nameSub;
-        for (auto& x : nodes){
-            
-            if(x.second->parent == NULL)
-            {
-                //cout << "Node Name" << x.second->name << endl;
-                x.second->draw(camera);
-                renderNodes(x.second->children);
-            }
+        bool rebuilt = hierarchyChanged;
+        if (hierarchyChanged) {
+            hierarchy.build(nodes);
+            hierarchyChanged = false;
+            broadphaseStale = true;
         }
+        gRenderStats.transformsUpdated += hierarchy.update();
+        culler.update(hierarchy);
+        bvh.update(hierarchy, rebuilt);
     }
     
-    void renderNodes(vector<Node*> nodes)
+    // once per frame, before the scripts that read the contact events
+    void updateCollisions(void)
     {
-        for (int i = 0; i < nodes.size(); i++){
-            
-            nodes[i]->draw(camera);
-            
-            if(nodes[i] != NULL)
-            {
-                renderNodes(nodes[i]->children);
+        updateTransforms();
+        broadphase.update(hierarchy, broadphaseStale);
+        broadphaseStale = false;
+    }
+    
+    // spatial queries for scripts, see SceneBVH
+    void nodesInFrustum(vector<Node*> &result) { updateTransforms(); bvh.queryFrustum(camera.worldViewProject, result); }
+    void nodesInSphere(const glm::vec3 &center, float radius, vector<Node*> &result) {
+        updateTransforms();
+        bvh.querySphere(center, radius, result);
+    }
+    void nearestNodes(const glm::vec3 &point, int k, vector<Node*> &result) {
+        updateTransforms();
+        bvh.queryNearest(point, k, result);
+    }
+    void raycastNodes(const glm::vec3 &origin, const glm::vec3 &dir, float maxDist, vector<RayHit> &result) {
+        updateTransforms();
+        bvh.queryRay(origin, dir, maxDist, result);
+    }
+    
+    // nearest surface hit, using each mesh's BVH where it has one and its
+    // bounds where it doesn't; ignore is skipped (the shooter, say)
+    bool raycast(const glm::vec3 &origin, const glm::vec3 &dir, float maxDist, RayHit &hit, Node *ignore = NULL);
+    bool lineOfSight(const glm::vec3 &from, const glm::vec3 &to, Node *ignoreA = NULL, Node *ignoreB = NULL);
+    bool pick(double cursorX, double cursorY, int width, int height, RayHit &hit);
+    
+    void renderNodes(void)
+    {
+        updateTransforms();
+        int numVisible = culler.cull(camera.worldViewProject);
+        gRenderStats.visibleNodes += numVisible;
+        gRenderStats.culledNodes += hierarchy.size() - numVisible;
+        
+        queue.clear();
+        for (int i = 0; i < hierarchy.size(); i++){
+            if (!culler.visible[i]) continue;
+            TriMeshInstance *meshInst = hierarchy.nodes[i]->meshInst;
+            if (meshInst->triMesh == NULL) {
+                printf("Error! Null Mesh.");
+                continue;
             }
+            gRenderStats.trianglesFull += meshInst->triMesh->numIndices / 3;
+            int lod = selectLod(i);
+            if (lod < 0) gRenderStats.tooSmallNodes++;
+            else queue.add(meshInst, hierarchy.worlds[i], hierarchy.worldInverses[i], lod);
         }
+        queue.submit(camera);
     }
     
+    // level of detail for hierarchy node i, -1 if it is too small to draw
+    int selectLod(int i);
+    
     void renderBBoards()
     {
         for(int i = 0; i < bboards.size(); i++)
@@ -775,14 +1778,19 @@ public:
 
 	void renderPartSys()
 	{
+		float dt = particleTimeStep();
 		for (int i = 0; i < ps.size(); i++){
-			ps.at(i).update();
-			ps.at(i).render(camera);
+			if (ps.at(i).gpu) particleRenderer.simulate(ps.at(i), dt);
+			ps.at(i).update(dt);
+			particleRenderer.draw(ps.at(i), camera);
 			if (ps.at(i).isDead()){
-				removeParticleSystem(i);
+				removeParticleSystem(i--);
 			}
 		}
 	}
+
+	// seconds since the last particle step
+	float particleTimeStep(void);
     
 };
 
@@ -846,6 +1854,7 @@ public:
         useSetScale = false;
         useBulletTrans = false;
         distCounter = 0;
+        hitNode = NULL;
     }
     
     Node* node;
@@ -874,6 +1883,7 @@ public:
     float followDist;
     float maxDist;
     int distCounter;
+    Node* hitNode; // what bulletTranslation last hit, NULL if nothing
     
     
     //utils
@@ -960,6 +1970,35 @@ public:
 
 //
 
+//-------------------------------------------------------------------------//
+// BENCHMARKS
+//-------------------------------------------------------------------------//
 
+void benchLoadMesh(const string &fileName, int iterations);
+void benchTokenizer(const string &fileName, const string &oneCharTokens, int iterations);
+void benchDrawNodes(const string &meshFile, const string &vsFile, const string &fsFile,
+	int numNodes, int numFrames);
+void benchShaderCache(const string &vsFile, const string &fsFile, int iterations);
+void benchSceneBVH(int numNodes, int numQueries);
+void benchBroadphase(int numBodies, int numFrames);
+void benchMeshBVH(const string &meshFile, int numRays);
+void benchMeshLods(const string &meshFile);
+void benchOptimizeMesh(const string &meshFile);
+void benchPlyFormats(const string &meshFile);
+void benchPlyParse(const string &meshFile, int iterations);
+void benchMeshlets(const string &meshFile, const string &vsFile, const string &fsFile, int numFrames);
+void benchParticles(int numParticles, int numFrames);
+void benchParticleDraw(const string &quadFile, const string &vsFile, const string &fsFile,
+	int numParticles, int numFrames);
+void benchGpuParticles(int numParticles, int numFrames);
+void benchClusters(int numLights, int numFrames);
+void benchFrameData(const string &meshFile, int numNodes, int numFrames);
 
+//-------------------------------------------------------------------------//
+// TESTS
+//-------------------------------------------------------------------------//
 
+// self checks run with -test name, each prints what failed and returns false
+bool testHierarchyRotation(void);
+bool testFrameDataOverflow(void); // these need a GL context, and open a window
+bool testProgramKeepsLights(void);
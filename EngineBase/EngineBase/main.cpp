@@ -17,8 +17,11 @@ GLFWwindow* gWindow = NULL;
 string gWindowTitle = "OpenGL App";
 int gWidth = 600; // window width
 int gHeight = 600; // window height
+int gFramebufferWidth = 600; // framebuffer size in pixels, bigger than the
+int gFramebufferHeight = 600; // window's on HiDPI displays
 int gSPP = 16; // samples per pixel
 int cameraControl = 0;
+void (*gPickCallback)(const RayHit &hit) = NULL; // told what a left click lands on, if set
 
 Scene gScene;
 
@@ -70,7 +73,7 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 string ONE_TOKENS = "{}[]()<>+-*/,;";
 
 
-void loadWorldSettings(FILE *F)
+void loadWorldSettings(Tokenizer &F)
 {
 	string token, t;
 	while (getToken(F, token, ONE_TOKENS)) {
@@ -81,17 +84,76 @@ void loadWorldSettings(FILE *F)
 		else if (token == "height") getInts(F, &gHeight, 1);
 		else if (token == "spp") getInts(F, &gSPP, 1);
 		else if (token == "controller") getInts(F, &cameraControl, 1);
+		else if (token == "meshCache") {
+			int useCache = 1;
+			getInts(F, &useCache, 1);
+			gUseMeshCache = (useCache != 0);
+		}
+		else if (token == "streamMeshes") {
+			int stream = 0;
+			getInts(F, &stream, 1);
+			gStreamMeshes = (stream != 0);
+		}
+		else if (token == "shaderCache") {
+			int useCache = 0;
+			getInts(F, &useCache, 1);
+			gUseShaderCache = (useCache != 0);
+		}
+		else if (token == "meshLods") {
+			int build = 1;
+			getInts(F, &build, 1);
+			gBuildMeshLods = (build != 0);
+		}
+		else if (token == "compressVertices") {
+			int compress = 1;
+			getInts(F, &compress, 1);
+			gCompressVertices = (compress != 0);
+		}
+		else if (token == "meshlets") {
+			int use = 1;
+			getInts(F, &use, 1);
+			gUseMeshlets = (use != 0);
+		}
+		else if (token == "meshletConeCulling") {
+			int use = 1;
+			getInts(F, &use, 1);
+			gMeshletConeCulling = (use != 0);
+		}
+		else if (token == "optimizeMeshes") {
+			int optimize = 1;
+			getInts(F, &optimize, 1);
+			gOptimizeMeshes = (optimize != 0);
+		}
+		else if (token == "lodPixelError") getFloats(F, &gLodPixelError, 1);
+		else if (token == "lodMinPixels") getFloats(F, &gLodMinPixels, 1);
+		else if (token == "particleTimeStep") getFloats(F, &gParticleTimeStep, 1);
+		else if (token == "clusteredLights") {
+			int use = 1;
+			getInts(F, &use, 1);
+			gUseClusteredLights = (use != 0);
+		}
+		else if (token == "frameData") {
+			int use = 1;
+			getInts(F, &use, 1);
+			gUseFrameData = (use != 0);
+		}
+		else if (token == "persistentFrameData") {
+			int persistent = 1;
+			getInts(F, &persistent, 1);
+			gPersistentFrameData = (persistent != 0);
+		}
 	}
 
 	// Initialize the window with OpenGL context
 	gWindow = createOpenGLWindow(gWidth, gHeight, gWindowTitle.c_str(), gSPP);
+	glfwGetFramebufferSize(gWindow, &gFramebufferWidth, &gFramebufferHeight);
 	glfwSetKeyCallback(gWindow, keyCallback);
 	if (cameraControl == MOUSE_CONTROL){
 		//glfwSetScrollCallback(gWindow, scroll_callback);
 	}
 }
 
-void loadSceneSettings(FILE *F, Scene *scene)
+void loadSceneSettings(Tokenizer &F, Scene *scene)
 {
 	string token, t;
 
@@ -116,9 +178,11 @@ void loadSceneSettings(FILE *F, Scene *scene)
 	}
 }
 
-void loadMesh(FILE *F, Scene *scene)
+void loadMesh(Tokenizer &F, Scene *scene)
 {
 	string token;
+	vector<string> fileNames;
+	bool keepCPUData = !gStreamMeshes;
 	while (getToken(F, token, ONE_TOKENS)) {
 		if (token == "}") {
 			break;
@@ -126,19 +190,27 @@ void loadMesh(FILE *F, Scene *scene)
 		else if (token == "file") {
 			string fileName = "";
 			getToken(F, fileName, ONE_TOKENS);
-			TriMesh *mesh = new TriMesh();
-			mesh->readFromPly(fileName, false);
-			mesh->sendToOpenGL();
-			scene->addMesh(mesh);
+			fileNames.push_back(fileName);
+		}
+		else if (token == "keepCPUData" || token == "collision") {
+			keepCPUData = true;
 		}
 	}
+
+	for (int i = 0; i < (int)fileNames.size(); i++) {
+		if (scene->getMesh(fileNames[i]) != NULL) continue; // preloaded
+		TriMesh *mesh = new TriMesh();
+		mesh->keepCPUData = keepCPUData;
+		mesh->load(fileNames[i], false);
+		mesh->sendToOpenGL();
+		scene->addMesh(mesh);
+	}
 }
 
-void loadMeshInstance(FILE *F, Scene *scene)
+void loadMeshInstance(Tokenizer &F, Scene *scene)
 {
 	string token;
-	GLuint vertexShader = NULL_HANDLE;
-	GLuint fragmentShader = NULL_HANDLE;
+	string vsFileName, fsFileName;
 	GLuint shaderProgram = NULL_HANDLE;
 	TriMeshInstance *meshInstance = new TriMeshInstance();
 	//scene->addMeshInstance(meshInstance);
@@ -148,14 +220,10 @@ void loadMeshInstance(FILE *F, Scene *scene)
 			break;
 		}
 		else if (token == "vertexShader") {
-			string vsFileName;
 			getToken(F, vsFileName, ONE_TOKENS);
-			vertexShader = loadShader(vsFileName.c_str(), GL_VERTEX_SHADER);
 		}
 		else if (token == "fragmentShader") {
-			string fsFileName;
 			getToken(F, fsFileName, ONE_TOKENS);
-			fragmentShader = loadShader(fsFileName.c_str(), GL_FRAGMENT_SHADER);
 		}
 		else if (token == "texture") {
 			string texAttributeName;
@@ -178,7 +246,7 @@ void loadMeshInstance(FILE *F, Scene *scene)
 			TriMesh *mesh = scene->getMesh(meshName);
 			if (mesh == NULL){
 				mesh = new TriMesh();
-				mesh->readFromPly(meshName);
+				mesh->load(meshName);
 				mesh->sendToOpenGL();
 				scene->addMesh(mesh);
 			}
@@ -212,7 +280,7 @@ void loadMeshInstance(FILE *F, Scene *scene)
         }
 	}
 
-        shaderProgram = createShaderProgram(vertexShader, fragmentShader);
+        shaderProgram = loadShaderProgram(vsFileName, fsFileName);
         meshInstance->mat.shaderProgram = shaderProgram;
     
  
@@ -221,7 +289,7 @@ void loadMeshInstance(FILE *F, Scene *scene)
 
 }
 
-void loadCamera(FILE *F, Scene *scene)
+void loadCamera(Tokenizer &F, Scene *scene)
 {
 	string token;
 	//Camera *camera = &scene->camera;
@@ -238,10 +306,10 @@ void loadCamera(FILE *F, Scene *scene)
 	}
 	scene->addCamera(camera);
 
-	camera.refreshTransform((float)gWidth, (float)gHeight);
+	camera.refreshTransform((float)gFramebufferWidth, (float)gFramebufferHeight);
 }
 
-void loadLight(FILE *F, Scene *scene)
+void loadLight(Tokenizer &F, Scene *scene)
 {
 	string token;
 	Light light;
@@ -272,17 +340,16 @@ void loadLight(FILE *F, Scene *scene)
 		}
 	}
 
-	// Add light to global light list
-	gLights[gNumLights] = light;
-	gNumLights++;
-	if (gNumLights >= MAX_LIGHTS)
-	{
-		ERROR("Too many lights!", false);
-		gNumLights--;
+	// Add light to global light list; only clustered shaders see past MAX_LIGHTS
+	gClusterLights.push_back(light);
+	if (gNumLights < MAX_LIGHTS) gLights[gNumLights++] = light;
+	else if (gClusterLights.size() == MAX_LIGHTS + 1) {
+		printf("More than %d lights, the rest only reach shaders that include %s\n", MAX_LIGHTS, CLUSTER_INCLUDE);
 	}
+	gLightsChanged = true;
 }
 
-void loadNode(FILE *F, Scene *scene){
+void loadNode(Tokenizer &F, Scene *scene){
 	string token;
 	Node *node = new Node();
 
@@ -331,10 +398,9 @@ void loadNode(FILE *F, Scene *scene){
 
 
 
-void loadBillboard(FILE *F, Scene *scene){
+void loadBillboard(Tokenizer &F, Scene *scene){
 	string token;
-	GLuint vertexShader = NULL_HANDLE;
-	GLuint fragmentShader = NULL_HANDLE;
+	string vsFileName, fsFileName;
 	GLuint shaderProgram = NULL_HANDLE;
 	Billboard board;
 
@@ -344,14 +410,10 @@ void loadBillboard(FILE *F, Scene *scene){
 		}
 
 		else if (token == "vertexShader") {
-			string vsFileName;
 			getToken(F, vsFileName, ONE_TOKENS);
-			vertexShader = loadShader(vsFileName.c_str(), GL_VERTEX_SHADER);
 		}
 		else if (token == "fragmentShader") {
-			string fsFileName;
 			getToken(F, fsFileName, ONE_TOKENS);
-			fragmentShader = loadShader(fsFileName.c_str(), GL_FRAGMENT_SHADER);
 		}
 
 		else if (token == "texture") {
@@ -376,7 +438,7 @@ void loadBillboard(FILE *F, Scene *scene){
 			TriMesh *mesh = scene->getMesh(meshName);
 			if (mesh == NULL){
 				mesh = new TriMesh();
-				mesh->readFromPly(meshName);
+				mesh->load(meshName);
 				mesh->sendToOpenGL();
 				scene->addMesh(mesh);
 			}
@@ -400,16 +462,20 @@ void loadBillboard(FILE *F, Scene *scene){
 			board.name = name;
 		}
 	}
-	shaderProgram = createShaderProgram(vertexShader, fragmentShader);
+	shaderProgram = loadShaderProgram(vsFileName, fsFileName);
 	board.mat.shaderProgram = shaderProgram;
 	scene->addBillboard(board);
 }
 
-void loadPartSys(FILE *F, Scene *scene){
+void loadPartSys(Tokenizer &F, Scene *scene){
 	string token;
 	glm::vec3 pos, vel, accel, velmag;
 	int in, type;
-	float life, duration;
+	float life, duration, rate = 0.0f;
+	float size = 0.0f, endSize = -1.0f;
+	glm::vec4 color(1, 1, 1, 1), endColor(1, 1, 1, 1);
+	bool hasColor = false, hasEndColor = false;
+	int gpu = 0;
 	Billboard bb;
 	while (getToken(F, token, ONE_TOKENS)){
 		if (token == "}"){
@@ -437,18 +503,44 @@ void loadPartSys(FILE *F, Scene *scene){
 		else if (token == "type"){
 			getInts(F, &type, 1);
 		}
+		else if (token == "rate"){
+			getFloats(F, &rate, 1);
+		}
+		else if (token == "color"){
+			getFloats(F, &color[0], 4);
+			hasColor = true;
+		}
+		else if (token == "endColor"){
+			getFloats(F, &endColor[0], 4);
+			hasEndColor = true;
+		}
+		else if (token == "size"){
+			getFloats(F, &size, 1);
+		}
+		else if (token == "endSize"){
+			getFloats(F, &endSize, 1);
+		}
+		else if (token == "gpu"){
+			getInts(F, &gpu, 1);
+		}
 	}
 	partSys p(pos, vel, accel, velmag, bb, duration, life, type);
+	if (rate > 0.0f) p.rate = rate;
+	if (hasColor) p.startColor = p.endColor = color;
+	if (hasEndColor) p.endColor = endColor;
+	if (size > 0.0f) p.startSize = p.endSize = size;
+	if (endSize >= 0.0f) p.endSize = endSize;
+	p.gpu = (gpu != 0);
 	scene->addParticleSystem(p);
 }
 
-void loadControlScript(FILE* F, Scene* scene)
+void loadControlScript(Tokenizer &F, Scene* scene)
 {
     string token;
     ControlScript* controlScript = new ControlScript;
     controlScript->scene = scene;
-    controlScript->height = gWidth;
-    controlScript->width = gHeight;
+    controlScript->width = gFramebufferWidth;
+    controlScript->height = gFramebufferHeight;
     controlScript->gWindow = gWindow;
     controlScript->keyboard = true;
     
@@ -474,7 +566,7 @@ void loadControlScript(FILE* F, Scene* scene)
     
 }
 
-void loadMoveScript(FILE* F, Scene* scene)
+void loadMoveScript(Tokenizer &F, Scene* scene)
 {
     string token;
     MoveScript* moveScript = new MoveScript();
@@ -648,7 +740,7 @@ void loadMoveScript(FILE* F, Scene* scene)
     
 }
 
-void loadSpawnScript(FILE* F, Scene* scene)
+void loadSpawnScript(Tokenizer &F, Scene* scene)
 {
     
     string token;
@@ -665,7 +757,7 @@ void loadSpawnScript(FILE* F, Scene* scene)
     }
 }
 
-void loadBaseNode(FILE* F, Scene* scene)
+void loadBaseNode(Tokenizer &F, Scene* scene)
 {
     string token;
     string nodeName;
@@ -712,6 +804,123 @@ void loadBaseNode(FILE* F, Scene* scene)
     scene->baseNodes[nodeName] = node;
 }
 
+//-------------------------------------------------------------------------//
+// Asset preloading.  Scene files are scanned once for the meshes and
+// textures they use, which are then decoded on the worker threads.  The
+// GL uploads happen in one batch when the window has been created.
+//-------------------------------------------------------------------------//
+
+class SceneAssets
+{
+public:
+	map<string, bool> meshes; // file name -> keepCPUData
+	set<string> textures;
+};
+
+void scanSceneAssets(const char *sceneFile, SceneAssets &assets)
+{
+	Tokenizer F;
+	if (!F.open(sceneFile)) return;
+	string token, block, fileName, attributeName;
+	vector<string> blockMeshes;
+	bool keepCPUData = false;
+	int depth = 0;
+
+	while (getToken(F, token, ONE_TOKENS)) {
+		if (token == "{") {
+			depth++;
+		}
+		else if (token == "}") {
+			depth--;
+			if (depth <= 0) {
+				for (int i = 0; i < (int)blockMeshes.size(); i++) {
+					if (assets.meshes.find(blockMeshes[i]) == assets.meshes.end()) {
+						assets.meshes[blockMeshes[i]] = keepCPUData || !gStreamMeshes;
+					}
+					else if (keepCPUData) {
+						assets.meshes[blockMeshes[i]] = true;
+					}
+				}
+				blockMeshes.clear();
+				keepCPUData = false;
+				depth = 0;
+			}
+		}
+		else if (depth == 0) {
+			block = token;
+		}
+		else if (block == "worldSettings") {
+			// these decide how meshes are loaded and built, so they are needed
+			// before decodeSceneAssets; loadWorldSettings reads them again
+			int val = 0;
+			if (token == "meshCache" && getInts(F, &val, 1) == 1) gUseMeshCache = (val != 0);
+			else if (token == "streamMeshes" && getInts(F, &val, 1) == 1) gStreamMeshes = (val != 0);
+			else if (token == "meshLods" && getInts(F, &val, 1) == 1) gBuildMeshLods = (val != 0);
+			else if (token == "optimizeMeshes" && getInts(F, &val, 1) == 1) gOptimizeMeshes = (val != 0);
+			else if (token == "compressVertices" && getInts(F, &val, 1) == 1) gCompressVertices = (val != 0);
+			else if (token == "meshlets" && getInts(F, &val, 1) == 1) gUseMeshlets = (val != 0);
+		}
+		else if (block == "mesh") {
+			if (token == "file" && getToken(F, fileName, ONE_TOKENS)) blockMeshes.push_back(fileName);
+			else if (token == "keepCPUData" || token == "collision") keepCPUData = true;
+		}
+		else if (block == "meshInstance" || block == "billboard") {
+			if (token == "mesh" && getToken(F, fileName, ONE_TOKENS)) {
+				blockMeshes.push_back(fileName);
+			}
+			else if (token == "texture" && getToken(F, attributeName, ONE_TOKENS) &&
+				getToken(F, fileName, ONE_TOKENS)) {
+				assets.textures.insert(fileName);
+			}
+		}
+	}
+}
+
+void decodeSceneAssets(SceneAssets &assets, Scene *scene)
+{
+	ThreadPool &pool = getWorkerPool();
+
+	// objects go into the scene here, the workers only fill them in
+	for (auto& x : assets.meshes) {
+		string fileName = x.first;
+		if (scene->getMesh(fileName) != NULL) continue;
+		TriMesh *mesh = new TriMesh();
+		mesh->name = fileName;
+		mesh->keepCPUData = x.second;
+		scene->addMesh(mesh);
+		pool.add([mesh, fileName] { mesh->load(fileName); });
+	}
+	for (auto& x : assets.textures) {
+		string fileName = x;
+		if (scene->getTexture(fileName) != NULL) continue;
+		RGBAImage *image = new RGBAImage();
+		image->name = fileName;
+		scene->addTexture(image);
+		pool.add([image, fileName] { image->loadPNG(fileName); });
+	}
+	pool.wait();
+}
+
+int uploadSceneAssets(Scene *scene)
+{
+	int numUploads = 0;
+	for (auto& x : scene->meshes) {
+		if (x.second->vao == NULL_HANDLE) {
+			x.second->sendToOpenGL();
+			numUploads++;
+		}
+	}
+	for (auto& x : scene->textures) {
+		if (x.second->textureId == NULL_HANDLE && x.second->width > 0) {
+			x.second->sendToOpenGL();
+			numUploads++;
+		}
+	}
+	return numUploads;
+}
+
+//-------------------------------------------------------------------------//
+
 void loadScene(const char *sceneFile, Scene *scene)
 {
 	string sceneFileName = sceneFile;
@@ -721,7 +930,24 @@ void loadScene(const char *sceneFile, Scene *scene)
 	//printf("PATH:\n");
 	//printPath();
 
-	FILE *F = openFileForReading(sceneFile);
+	// phase one: find the assets, phase two: decode them in parallel
+	double loadStart = WALL_TIME();
+	SceneAssets assets;
+	scanSceneAssets(sceneFile, assets);
+	double scanTime = WALL_TIME() - loadStart;
+
+	double decodeStart = WALL_TIME();
+	decodeSceneAssets(assets, scene);
+	double decodeTime = WALL_TIME() - decodeStart;
+
+	// then build the scene, uploading the decoded assets once GL is up
+	double buildStart = WALL_TIME();
+	double uploadTime = 0.0;
+	int numUploads = 0;
+	bool uploaded = false;
+
+	Tokenizer F;
+	if (!F.open(sceneFile)) return;
 	string token;
 
 	while (getToken(F, token, ONE_TOKENS)) {
@@ -729,6 +955,11 @@ void loadScene(const char *sceneFile, Scene *scene)
 		if (token == "worldSettings") {
 			loadWorldSettings(F);
 			initLightBuffer();
+
+			double uploadStart = WALL_TIME();
+			numUploads += uploadSceneAssets(scene);
+			uploadTime += WALL_TIME() - uploadStart;
+			uploaded = true;
 		}
 		else if (token == "sceneSettings") {
 			loadSceneSettings(F, scene);
@@ -773,6 +1004,37 @@ void loadScene(const char *sceneFile, Scene *scene)
         }
         
 	}
+
+	if (!uploaded && gWindow != NULL) {
+		double uploadStart = WALL_TIME();
+		numUploads += uploadSceneAssets(scene);
+		uploadTime += WALL_TIME() - uploadStart;
+	}
+	double buildTime = WALL_TIME() - buildStart - uploadTime;
+
+	printf("Scene load %.1f ms: scan %.1f ms, decode %.1f ms (%d meshes, %d textures, %d threads), "
+		"upload %.1f ms (%d objects), build %.1f ms\n",
+		(WALL_TIME() - loadStart) * 1000.0, scanTime * 1000.0,
+		decodeTime * 1000.0, (int)assets.meshes.size(), (int)assets.textures.size(), getWorkerPool().size(),
+		uploadTime * 1000.0, numUploads, buildTime * 1000.0);
+	printf("Shaders %.1f ms: %d programs requested, %d compiled, %d shared, %d from disk (%d rejected)\n",
+		gShaderCacheStats.seconds * 1000.0, gShaderCacheStats.requests,
+		gShaderCacheStats.compiled, gShaderCacheStats.shared,
+		gShaderCacheStats.loadedBinary, gShaderCacheStats.rejectedBinary);
+	if (gMeshOptimizeStats.meshes > 0) {
+		const MeshOptimizeTotals &t = gMeshOptimizeStats;
+		printf("Optimized %d meshes: %d -> %d vertices, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", t.meshes,
+			(int)t.verticesBefore, (int)t.verticesAfter,
+			t.missesBefore / max(t.triangles, 1), t.missesAfter / max(t.triangles, 1),
+			t.missesBefore / max(t.verticesBefore, (size_t)1), t.missesAfter / max(t.verticesAfter, (size_t)1));
+	}
+	if (gMeshUploadStats.meshes > 0) {
+		printf("Meshes %.1f KB on the GPU, %.1f KB as floats (%.0f%% saved), %d of %d with 16 bit indices, "
+			"%d unpacked\n",
+			gMeshUploadStats.bytes / 1024.0, gMeshUploadStats.floatBytes / 1024.0,
+			100.0 * (1.0 - (double)gMeshUploadStats.bytes / gMeshUploadStats.floatBytes),
+			gMeshUploadStats.shortIndices, gMeshUploadStats.meshes, gMeshUploadStats.unpacked);
+	}
 }
 
 
@@ -798,7 +1060,7 @@ void update(void)
     //moveFollow3->runScripts();
     //spawn->runScripts();
     
-    gScene.camera.refreshTransform(gWidth, gHeight);
+    gScene.camera.refreshTransform(gFramebufferWidth, gFramebufferHeight);
 	//engine->setListenerPosition(vec3df(cameraPos.x, cameraPos.y, cameraPos.z), vec3df(cameraRot.x, cameraRot.y, cameraRot.z) );
 
 	//gScene.nodes["parent"]->rotateLocal(glm::vec3(0, 1, 0), 0.03, false);
@@ -826,6 +1088,120 @@ void cameraController(Camera &camera, int type){
 
 }
 
+//-------------------------------------------------------------------------//
+// Benchmarks
+//-------------------------------------------------------------------------//
+
+void runBenchmark(int numArgs, char **args)
+{
+	string name = (numArgs > 0) ? args[0] : "";
+
+	if (name == "loadMesh" && numArgs >= 2) {
+		benchLoadMesh(args[1], (numArgs >= 3) ? atoi(args[2]) : 5);
+	}
+	else if (name == "tokenizer" && numArgs >= 2) {
+		benchTokenizer(args[1], ONE_TOKENS, (numArgs >= 3) ? atoi(args[2]) : 5);
+	}
+	else if (name == "drawNodes" && numArgs >= 4) {
+		benchDrawNodes(args[1], args[2], args[3], (numArgs >= 5) ? atoi(args[4]) : 5000,
+			(numArgs >= 6) ? atoi(args[5]) : 20);
+	}
+	else if (name == "shaderCache" && numArgs >= 3) {
+		benchShaderCache(args[1], args[2], (numArgs >= 4) ? atoi(args[3]) : 5);
+	}
+	else if (name == "sceneBVH") {
+		benchSceneBVH((numArgs >= 2) ? atoi(args[1]) : 10000, (numArgs >= 3) ? atoi(args[2]) : 1000);
+	}
+	else if (name == "broadphase") {
+		benchBroadphase((numArgs >= 2) ? atoi(args[1]) : 5000, (numArgs >= 3) ? atoi(args[2]) : 100);
+	}
+	else if (name == "meshBVH" && numArgs >= 2) {
+		benchMeshBVH(args[1], (numArgs >= 3) ? atoi(args[2]) : 100000);
+	}
+	else if (name == "meshLods" && numArgs >= 2) {
+		benchMeshLods(args[1]);
+	}
+	else if (name == "optimizeMesh" && numArgs >= 2) {
+		benchOptimizeMesh(args[1]);
+	}
+	else if (name == "plyFormats" && numArgs >= 2) {
+		benchPlyFormats(args[1]);
+	}
+	else if (name == "plyParse" && numArgs >= 2) {
+		benchPlyParse(args[1], (numArgs >= 3) ? atoi(args[2]) : 3);
+	}
+	else if (name == "particles") {
+		benchParticles((numArgs >= 2) ? atoi(args[1]) : 100000, (numArgs >= 3) ? atoi(args[2]) : 300);
+	}
+	else if (name == "particleDraw" && numArgs >= 4) {
+		benchParticleDraw(args[1], args[2], args[3], (numArgs >= 5) ? atoi(args[4]) : 10000,
+			(numArgs >= 6) ? atoi(args[5]) : 20);
+	}
+	else if (name == "gpuParticles") {
+		benchGpuParticles((numArgs >= 2) ? atoi(args[1]) : 100000, (numArgs >= 3) ? atoi(args[2]) : 60);
+	}
+	else if (name == "clusters") {
+		benchClusters((numArgs >= 2) ? atoi(args[1]) : 10000, (numArgs >= 3) ? atoi(args[2]) : 100);
+	}
+	else if (name == "frameData" && numArgs >= 2) {
+		benchFrameData(args[1], (numArgs >= 3) ? atoi(args[2]) : 2000, (numArgs >= 4) ? atoi(args[3]) : 100);
+	}
+	else if (name == "meshlets" && numArgs >= 4) {
+		benchMeshlets(args[1], args[2], args[3], (numArgs >= 5) ? atoi(args[4]) : 20);
+	}
+	else {
+		cout << "Benchmarks:" << endl;
+		cout << "  -bench loadMesh file.ply [iterations]" << endl;
+		cout << "  -bench tokenizer file.scene [iterations]" << endl;
+		cout << "  -bench drawNodes mesh.ply shader.vs shader.fs [nodes] [frames]" << endl;
+		cout << "  -bench shaderCache shader.vs shader.fs [iterations]" << endl;
+		cout << "  -bench sceneBVH [nodes] [queries]" << endl;
+		cout << "  -bench broadphase [bodies] [frames]" << endl;
+		cout << "  -bench meshBVH file.ply [rays]" << endl;
+		cout << "  -bench meshLods file.ply" << endl;
+		cout << "  -bench optimizeMesh file.ply" << endl;
+		cout << "  -bench meshlets mesh.ply shader.vs shader.fs [frames]" << endl;
+		cout << "  -bench plyFormats file.ply" << endl;
+		cout << "  -bench plyParse file.ply [iterations]" << endl;
+		cout << "  -bench particles [count] [frames]" << endl;
+		cout << "  -bench particleDraw quad.ply shader.vs shader.fs [count] [frames]" << endl;
+		cout << "  -bench gpuParticles [count] [frames]" << endl;
+		cout << "  -bench clusters [lights] [frames]" << endl;
+		cout << "  -bench frameData mesh.ply [nodes] [frames]" << endl;
+	}
+}
+
+//-------------------------------------------------------------------------//
+// Tests
+//-------------------------------------------------------------------------//
+
+// runs the named self check, or all of them; returns the exit code
+int runTest(int numArgs, char **args)
+{
+	string name = (numArgs > 0) ? args[0] : "all";
+	struct { const char *name; bool (*run)(void); } tests[] = {
+		{ "hierarchyRotation", testHierarchyRotation },
+		{ "frameDataOverflow", testFrameDataOverflow },
+		{ "programKeepsLights", testProgramKeepsLights },
+	};
+	int numTests = sizeof(tests) / sizeof(tests[0]);
+
+	int failed = 0, ran = 0;
+	for (int i = 0; i < numTests; i++) {
+		if (name != "all" && name != tests[i].name) continue;
+		bool ok = tests[i].run();
+		printf("%-24s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+		failed += !ok;
+		ran++;
+	}
+	if (ran == 0) {
+		cout << "Tests:" << endl;
+		for (int i = 0; i < numTests; i++) cout << "  -test " << tests[i].name << endl;
+		return 1;
+	}
+	return (failed > 0) ? 1 : 0;
+}
+
 //-------------------------------------------------------------------------//
 // Main method
 //-------------------------------------------------------------------------//
@@ -835,9 +1211,19 @@ int main(int numArgs, char **args)
 	// check usage
 	if (numArgs < 2) {
 		cout << "Usage: Transforms sceneFile.scene" << endl;
+		cout << "       Transforms -bench name [args]" << endl;
+		cout << "       Transforms -test [name]" << endl;
 		exit(0);
 	}
 
+	if (string(args[1]) == "-bench") {
+		runBenchmark(numArgs - 2, args + 2);
+		return 0;
+	}
+	if (string(args[1]) == "-test") {
+		return runTest(numArgs - 2, args + 2);
+	}
+
     engine = createIrrKlangDevice(); // start default sound engine
 	if (!engine) 
 		return 0; // start up error
@@ -859,12 +1245,14 @@ int main(int numArgs, char **args)
 	}*/
 
 	// render loop
+	bool leftWasDown = false;
 	while (true) {
 		// update and render
         //SLEEP(30);
 		update();
 		render();
 		glfwGetWindowSize(gWindow, &gWidth, &gHeight);
+		glfwGetFramebufferSize(gWindow, &gFramebufferWidth, &gFramebufferHeight);
         
 		// handle input
 		glfwPollEvents();
@@ -873,6 +1261,15 @@ int main(int numArgs, char **args)
 
 		double xx, yy;
 		glfwGetCursorPos(gWindow, &xx, &yy);
+
+		// report what a click lands on
+		bool leftDown = (glfwGetMouseButton(gWindow, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS);
+		if (leftDown && !leftWasDown && gPickCallback != NULL) {
+			RayHit hit;
+			double scaleX = (double)gFramebufferWidth / gWidth, scaleY = (double)gFramebufferHeight / gHeight;
+			if (gScene.pick(xx * scaleX, yy * scaleY, gFramebufferWidth, gFramebufferHeight, hit)) gPickCallback(hit);
+		}
+		leftWasDown = leftDown;
         
 		// print framerate
 		double endTime = TIME();